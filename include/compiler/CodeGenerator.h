@@ -7,6 +7,8 @@
 ============================================================================*/
 #pragma once
 
+#include <unordered_map>
+
 #include "runtime/VirtualMachine.h"
 #include "compiler/SourceParser.h"
 
@@ -22,12 +24,20 @@ namespace vm {
         CodeGenerator();
         ~CodeGenerator();
         bool generateCode(ExecutableImage* img, TreeNode* rootNode);
+        bool generateCode(ExecutableImage* img, SourceParser* parser);
+        WORD resolveStub(ExecutableImage* img, WORD index);
+        void setPreviousImage(ExecutableImage* previous);
+        inline size_t getReusedCount() { return reusedCount; }
         void emitModule(ExecutableImage* img, TreeNode* rootNode);
-        void emitFunction(ExecutableImage* img, TreeNode* node);
+        void emitFunction(ExecutableImage* img, TreeNode* node, uint64_t fingerprint = 0);
+        bool reuseFunction(ExecutableImage* img, TreeNode* node, uint64_t fingerprint);
+        void emitStub(ExecutableImage* img, TreeNode* node, WORD index);
+        void linkRelocations(ExecutableImage* img);
         void emitStatement(ExecutableImage* img, TreeNode* body);
         void emitBlock(ExecutableImage* img, TreeNode* body);
         void emitDeclaration(ExecutableImage* img, TreeNode* node);
         void emitCall(ExecutableImage* img, TreeNode* node);
+        void emitCallStatement(ExecutableImage* img, TreeNode* node);
         void emitIfElse(ExecutableImage* img, TreeNode* node);
         void emitWhile(ExecutableImage* img, TreeNode* node);
         void emitReturn(ExecutableImage* img, TreeNode* node);
@@ -36,8 +46,17 @@ namespace vm {
         void emitExpression(ExecutableImage* img, TreeNode* expression);
         void emitSymbol(ExecutableImage* img, TreeNode* node);
         WORD emitOpcode(ExecutableImage* img, Token& token);
+        const SystemFunction* lookupSystemFunction(Token& token);
 
     private:
+        SourceParser* parser = NULL;
+        SymbolTable* globals = NULL;
+        ExecutableImage* previous = NULL;
+        unordered_map<string, size_t> previousFunctions;
+        unordered_map<WORD, size_t> previousAddresses;
+        unordered_map<string, WORD> functionOrdinals;
+        size_t linkedRelocations = 0;
+        size_t reusedCount = 0;
         inline void raiseError(char* msg) { throw CodeGeneratorException{msg }; }
     };
 
@@ -2,22 +2,46 @@
 *
 *  Virtual Machine Compiler source code loader header
 *
+*  Source files are memory mapped (or read when mapping is not possible),
+*  standard input ("-") is streamed in chunks of complete lines.
+*
+*  Streaming only avoids one contiguous copy of whole input (and growing
+*  it while reading): tokens point into chunk text and images cache hash
+*  reads input to the end, so every chunk stays allocated until source
+*  file is destroyed and memory used by streamed input is still about
+*  input size.
+*
 *  (C) Bolat Basheyev 2021
 *
 ============================================================================*/
 #pragma once
 
+#include <vector>
+#include <string>
+#include <istream>
+#include <cstdint>
 
+#include "runtime/MappedFile.h"
 
 namespace vm {
 
+	constexpr size_t SOURCE_CHUNK_SIZE = 0x10000;
+
 	class SourceFile {
 	public:
 		SourceFile(const char* filename);
 		~SourceFile();
-		char* getData();
+		bool isOpen();
+		char* getData();                                      // Whole source (NULL for stdin)
+		char* nextChunk();                                    // Next chunk, valid until destroyed
+		uint64_t getHash();
 	private:
 		char* data;
+		MappedFile* mapping;
+		std::istream* stream;
+		std::vector<char*> chunks;
+		std::string tail;
+		size_t chunkIndex;
 	};
 
-}
\ No newline at end of file
+}
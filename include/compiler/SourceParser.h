@@ -16,12 +16,11 @@
 *  <while>       ::= 'while' '(' <condition> ')' <statement>
 *  <jump>        ::= 'return' <expression> ';' | 'break' ';'
 *  <assign>      ::= <identifier> = <expression> ';'
-*  <logical>     ::= <comparison> {( && | '||') <comparison>}
-*  <comparison>  ::= <expression> {( == | != | > | >= | < | <= ) <expression>}
-*  <expression>  ::= <term> {(+|-) <term>}
-*  <term>        ::= <bitwise> {(*|/) <bitwise>}
-*  <bitwise>     ::= <factor> {( & | '|' | ^ | << | >> ) <factor>}
+*  <expression>  ::= <factor> {<binary-op> <factor>}
+*  <binary-op>   ::= '||' | && | '|' | ^ | & | == | != | > | >= | < | <= | << | >> | + | - | * | /
+*                    (C-like precedence from lowest to highest, see OPERATORS table)
 *  <factor>      ::= ({~|!|-|+} <number>) | <identifer> | <call>
+*                    (function identifier is function address, see fspawn)
 * 
 * 
 *  (C) Bolat Basheyev 2021
@@ -31,9 +30,11 @@
 
 #include <string>
 #include <vector>
+#include <unordered_map>
 #include <cstring>
 
 #include "runtime/VirtualMachine.h"
+#include "compiler/SourceFile.h"
 
 using namespace std;
 
@@ -62,6 +63,54 @@ namespace vm {
 
     constexpr int TOKEN_TYPE_COUNT = sizeof(TOKEN_TYPE_MNEMONIC) / sizeof(char*);
 
+    //------------------------------------------------------------------------
+    // Binary operators precedence (C-like, 0 - not a binary operator),
+    // all binary operators are left associative
+    //------------------------------------------------------------------------
+    constexpr int OPERATORS[] = {
+        0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+        // =  +  -  *   /   ~  &  |  ^  <<  >>
+        0, 9, 9, 10, 10, 0, 5, 3, 4, 8, 8,
+        // == != >  >= <  <= && || !
+        6, 6, 7, 7, 7, 7, 2, 1, 0
+    };
+
+    static_assert(sizeof(OPERATORS) / sizeof(int) == TOKEN_TYPE_COUNT, "Operators table size mismatch");
+
+    //------------------------------------------------------------------------
+    // System functions compiled to system calls or intrinsic opcodes
+    //------------------------------------------------------------------------
+    class SystemFunction {
+    public:
+        char* name;
+        int argCount;
+        WORD opcode;
+        WORD sysCall;
+        bool returnsValue;
+    };
+
+    constexpr SystemFunction SYSTEM_FUNCTIONS[] = {
+        {"iput", 1, OP_SYSCALL, SYS_PRINT_INT, false},           // write int to std out
+        {"iget", 1, OP_SYSCALL, SYS_READ_INT, true},             // read int from std in (parks fiber on empty queue)
+        {"fspawn", 2, OP_SYSCALL, SYS_FIBER_SPAWN, true},        // spawn fiber calling function(argument)
+        {"fyield", 0, OP_SYSCALL, SYS_FIBER_YIELD, false},       // switch to next ready fiber
+        {"fjoin", 1, OP_SYSCALL, SYS_FIBER_JOIN, true},          // wait fiber and get function result
+        {"tspawn", 2, OP_SYSCALL, SYS_THREAD_SPAWN, true},       // run function(argument) on new thread
+        {"tjoin", 1, OP_SYSCALL, SYS_THREAD_JOIN, true},         // wait thread and get function result
+        {"csend", 2, OP_SYSCALL, SYS_CHANNEL_SEND, true},        // csend(channel, value) returns 0 if closed
+        {"crecv", 1, OP_SYSCALL, SYS_CHANNEL_RECV, true},        // crecv(channel) returns 0 if closed and empty
+        {"csendb", 3, OP_SYSCALL, SYS_CHANNEL_SEND_BLOCK, true}, // csendb(channel, address, count) from shared memory
+        {"crecvb", 3, OP_SYSCALL, SYS_CHANNEL_RECV_BLOCK, true}, // crecvb(channel, address, count) to shared memory
+        {"cclose", 1, OP_SYSCALL, SYS_CHANNEL_CLOSE, false},     // close channel
+        {"checkpoint", 0, OP_SYSCALL, SYS_CHECKPOINT, true},     // pause for snapshot (returns 0)
+        {"afetchadd", 2, OP_AFADD, 0, true},                     // afetchadd(address, value) returns old value
+        {"acas", 3, OP_ACAS, 0, true},                           // acas(address, expected, desired) returns old value
+        {"aload", 1, OP_ALOAD, 0, true},                         // aload(address) with acquire order
+        {"astore", 2, OP_ASTORE, 0, false}                       // astore(address, value) with release order
+    };
+
+    constexpr int SYSTEM_FUNCTIONS_COUNT = sizeof(SYSTEM_FUNCTIONS) / sizeof(SystemFunction);
+
 
     class Token {
     public:
@@ -90,6 +139,8 @@ namespace vm {
         "UNKNOWN", "CONSTANT", "FUNCTION", "ARGUMENT", "VARIABLE"
     };
 
+    constexpr int SYMBOL_TYPES_COUNT = sizeof(SYMBOL_TYPE_MNEMONIC) / sizeof(char*);
+
     class Symbol {
     public:
         string name = "";
@@ -123,6 +174,8 @@ namespace vm {
     private:
         string name;
         vector<Symbol> symbols;
+        unordered_map<string, size_t> symbolsIndex;          // symbol name to position in scope
+        int nextIndex[SYMBOL_TYPES_COUNT] = {};              // next local index of each symbol type
         vector<SymbolTable*> childs;
         SymbolTable* parent;
         int getNextIndex(SymbolType type);
@@ -168,6 +221,19 @@ namespace vm {
         void print(int tab);
     };
 
+    //------------------------------------------------------------------------
+    // Function source (signature and body token range)
+    //------------------------------------------------------------------------
+    class FunctionSource {
+    public:
+        TreeNode* function;                 // function node
+        SymbolTable* scope;                 // function arguments and locals scope
+        size_t firstToken;                  // return type token index
+        size_t bodyToken;                   // body opening brace token index
+        size_t lastToken;                   // body closing brace token index
+        uint64_t fingerprint;               // tokens and module signatures hash
+    };
+
     //------------------------------------------------------------------------
     // Parser exception
     //------------------------------------------------------------------------
@@ -182,20 +248,32 @@ namespace vm {
     //------------------------------------------------------------------------
     class SourceParser {
     public:
-        SourceParser(const char* sourceCode);
+        SourceParser(const char* sourceCode, bool lazy = false);
+        SourceParser(SourceFile& source, bool lazy = false);
         ~SourceParser();
         inline size_t getTokenCount() { return tokens.size(); }
         Token& getToken(size_t index) { return tokens[index]; }      // FIXME: not sure
         SymbolTable& getSymbolTable() { return rootSymbolTable; }
         TreeNode* getSyntaxTree() { return root; }
+        inline bool isLazy() { return lazy; }
+        inline size_t getFunctionCount() { return functions.size(); }
+        inline FunctionSource& getFunction(size_t index) { return functions[index]; }
+        TreeNode* parseFunctionBody(size_t index);
+        inline double getLexTime() { return lexTime; }                 // Tokenization time (seconds)
+        inline double getParseTime() { return parseTime; }             // Syntax tree build time (seconds)
     private:
         vector<Token> tokens;
+        vector<FunctionSource> functions;
         TreeNode* root = NULL;
         SymbolTable rootSymbolTable;
         size_t currentToken = 0;
         int blockCounter = 0;
+        bool lazy = false;
+        double lexTime = 0;
+        double parseTime = 0;
 
-        void parseToTokens(const char* sourceCode);
+        void printError(ParserException& e);
+        int parseToTokens(const char* sourceCode, int row = 1);
         bool isBlank(char value) { return strchr(BLANKS, value) != NULL; };
         bool isDelimeter(char value) { return strchr(DELIMETERS, value) != NULL; };
         bool pushToken(char* text, int length, int row, int col);
@@ -205,21 +283,19 @@ namespace vm {
         TokenType validateString(char* text, int length);
 
         void buildSyntaxTree();
+        void buildFingerprints();
         TreeNode* parseModule(SymbolTable* scope);
         TreeNode* parseDeclaration(SymbolTable* scope);
         TreeNode* parseFunction(SymbolTable* scope);
         TreeNode* parseArgument(SymbolTable* scope);
         TreeNode* parseBlock(SymbolTable* scope, bool isFunction, bool whileBlock);
+        void skipBlock();
         TreeNode* parseStatement(SymbolTable* scope, bool whileBlock);
         TreeNode* parseCall(SymbolTable* scope);
         TreeNode* parseIfElse(SymbolTable* scope, bool whileBlock);
         TreeNode* parseWhile(SymbolTable* scope);
         TreeNode* parseAssignment(SymbolTable* scope);
-        TreeNode* parseLogical(SymbolTable* scope);
-        TreeNode* parseComparison(SymbolTable* scope);
-        TreeNode* parseExpression(SymbolTable* scope);
-        TreeNode* parseTerm(SymbolTable* scope);
-        TreeNode* parseBitwise(SymbolTable* scope);
+        TreeNode* parseExpression(SymbolTable* scope, int minPrecedence = 1);
         TreeNode* parseFactor(SymbolTable* scope);
 
         inline bool next() { currentToken++; return currentToken < getTokenCount(); }
@@ -227,9 +303,7 @@ namespace vm {
         inline Token& getNextToken() { return getToken(currentToken + 1); }
         inline bool isTokenType(TokenType type) { return getToken().type == type; }
 
-        inline bool isComparison(TokenType type) { return type >= TokenType::EQUAL && type <= TokenType::LS_EQUAL; }
-        inline bool isLogical(TokenType type) { return type >= TokenType::LOGIC_AND && type <= TokenType::LOGIC_OR; }
-        inline bool isBitwise(TokenType type) { return type >= TokenType::AND && type <= TokenType::SHR; }
+        inline int getPrecedence(TokenType type) { return OPERATORS[(int)type]; }
         inline bool isDataType(TokenType type) { return type == TokenType::INT; }
         inline void checkToken(TokenType type, const char* msg) { if (!isTokenType(type)) raiseError(msg); }
         inline void raiseError(Token& tkn, const char* msg) { throw ParserException{ tkn, msg }; }
@@ -0,0 +1,48 @@
+/*============================================================================
+*
+*  Virtual Machine buffered output stream header
+*
+*  Output stream for system calls output which collects written text and
+*  passes it to target stream in blocks: when block is full, on explicit
+*  flush (std::endl, machine reads input) and when stream is destroyed.
+*  Writers sharing stream have to be synchronized (threads of machine use
+*  machine input/output lock).
+*
+*  (C) Bolat Basheyev 2021
+*
+============================================================================*/
+#pragma once
+
+#include <vector>
+#include <iostream>
+#include <streambuf>
+
+namespace vm {
+
+	constexpr size_t OUTPUT_BLOCK_SIZE = 64 << 10;            // Output block size in bytes
+
+	//-------------------------------------------------------------------------
+	// Stream buffer writing full blocks to target stream
+	//-------------------------------------------------------------------------
+	class BlockBuffer : public std::streambuf {
+	public:
+		BlockBuffer(std::ostream& target, size_t size);
+	protected:
+		int overflow(int c) override;                         // Writes full block, stores character
+		int sync() override;                                  // Writes block and flushes target
+	private:
+		std::ostream& target;                                 // Target stream
+		std::vector<char> block;                              // Collected output
+		bool writeBlock();                                    // Passes collected output to target
+	};
+
+
+	class BufferedOutput : public std::ostream {
+	public:
+		BufferedOutput(std::ostream& target, size_t size = OUTPUT_BLOCK_SIZE); // Buffers output to target
+		~BufferedOutput();                                    // Flushes collected output
+	private:
+		BlockBuffer buffer;                                   // Stream buffer
+	};
+
+}
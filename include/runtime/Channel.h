@@ -0,0 +1,74 @@
+/*============================================================================
+*
+*  Virtual Machine lock-free channels header
+*
+*  Bounded ring buffers of words passed between virtual machines and host.
+*  SPSCChannel supports one sending and one receiving thread and copies
+*  whole blocks with one index update, MPMCChannel supports any number of
+*  threads (per slot sequence numbers). Capacity is rounded up to power of
+*  two. Operations never block, they return count of words transferred.
+*
+*  (C) Bolat Basheyev 2021
+*
+============================================================================*/
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <memory>
+
+#include "runtime/VirtualMachine.h"
+
+namespace vm {
+
+	constexpr size_t CACHE_LINE_SIZE = 64;                    // Avoids false sharing of indices
+	constexpr WORD CHANNEL_CAPACITY = 1024;                   // Default capacity in words
+
+	enum class ChannelType { SPSC, MPMC };
+
+	class Channel {
+	public:
+		virtual ~Channel() {};
+		virtual WORD send(const WORD* data, WORD count) = 0;  // Sends up to count words
+		virtual WORD receive(WORD* data, WORD count) = 0;     // Receives up to count words
+		inline void close() { closed.store(true, memory_order_release); }; // No more sends
+		inline bool isClosed() { return closed.load(memory_order_acquire); };
+		static shared_ptr<Channel> create(ChannelType type, WORD capacity = CHANNEL_CAPACITY);
+	protected:
+		atomic<bool> closed{ false };
+	};
+
+
+	class SPSCChannel : public Channel {
+	public:
+		SPSCChannel(WORD capacity);
+		~SPSCChannel();
+		WORD send(const WORD* data, WORD count);
+		WORD receive(WORD* data, WORD count);
+	private:
+		WORD* buffer;
+		uint32_t mask;
+		alignas(CACHE_LINE_SIZE) atomic<uint32_t> head{ 0 };  // Next read position
+		alignas(CACHE_LINE_SIZE) atomic<uint32_t> tail{ 0 };  // Next write position
+	};
+
+
+	class MPMCChannel : public Channel {
+	public:
+		MPMCChannel(WORD capacity);
+		~MPMCChannel();
+		WORD send(const WORD* data, WORD count);
+		WORD receive(WORD* data, WORD count);
+	private:
+		class Slot {
+		public:
+			atomic<uint32_t> sequence;
+			WORD value;
+		};
+		Slot* slots;
+		uint32_t mask;
+		alignas(CACHE_LINE_SIZE) atomic<uint32_t> head{ 0 };  // Next read position
+		alignas(CACHE_LINE_SIZE) atomic<uint32_t> tail{ 0 };  // Next write position
+	};
+
+};
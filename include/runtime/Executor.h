@@ -0,0 +1,136 @@
+/*============================================================================
+*
+*  Virtual Machine pool executor header
+*
+*  Runs batches of jobs (code segment, input, output sink) on a pool of
+*  worker threads. Every worker owns a job deque: worker takes its own jobs
+*  from the back and steals jobs from the front of other workers deques
+*  when its own deque is empty.
+*
+*  Jobs run on reusable virtual machines (M:N scheduling): job which fibers
+*  all wait for input is parked with its virtual machine and the worker
+*  thread takes next job. Feeding input moves parked job back to deques.
+*  Jobs submitted with snapshot restore it to idle machine and resume.
+*
+*  With time slice set jobs are preempted after time slice fuel (backward
+*  jumps and calls) is spent and requeued to the front of worker deque, so
+*  long running jobs do not hold workers from other jobs.
+*
+*  With metrics enabled machines publish live metrics to block of worker
+*  running them, pool metrics aggregate workers blocks.
+*
+*  (C) Bolat Basheyev 2021
+*
+============================================================================*/
+#pragma once
+
+#include <vector>
+#include <deque>
+#include <string>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <unordered_map>
+
+#include "runtime/VirtualMachine.h"
+#include "runtime/Channel.h"
+#include "runtime/Snapshot.h"
+#include "runtime/Metrics.h"
+
+namespace vm {
+
+	typedef chrono::steady_clock::time_point TimePoint;
+
+	class Job {
+	public:
+		uint64_t id;                                          // Job id
+		shared_ptr<CodeSegment> code;                         // Code segment to run
+		shared_ptr<Snapshot> snapshot;                        // Snapshot to resume (or NULL)
+		shared_ptr<InputQueue> input;                         // Input values of job
+		ostream* output;                                      // Output sink (NULL - discard)
+		shared_ptr<ostream> discard;                          // Discarding output sink
+		vector<shared_ptr<Channel>> channels;                 // Channels attached to machine
+		VirtualMachine* machine;                              // Machine of started job
+		TimePoint submitted;                                  // Submission time
+	};
+
+
+	class ExecutorStats {
+	public:
+		uint64_t jobs;                                        // Completed jobs
+		uint64_t stolen;                                      // Jobs stolen by other workers
+		uint64_t parked;                                      // Times jobs parked waiting for input
+		uint64_t preempted;                                   // Times jobs time slice exhausted
+		uint64_t machines;                                    // Virtual machines created
+		double   seconds;                                     // Wall time since first submit
+		double   throughput;                                  // Jobs per second
+		double   latencyMin;                                  // Submit to completion (seconds)
+		double   latencyAvg;
+		double   latencyP50;
+		double   latencyP99;
+		double   latencyMax;
+		void print(ostream& out);                             // Prints statistics
+	};
+
+
+	class Executor {
+	public:
+		Executor(unsigned workers = 0, size_t memorySize = DEFAULT_MEMORY_SIZE); // Starts workers (0 - all cores)
+		~Executor();                                          // Stops and joins workers
+		uint64_t submit(shared_ptr<CodeSegment> code, const string& input, ostream* output,
+			bool interactive = false,                         // Submits job, returns job id
+			const vector<shared_ptr<Channel>>& channels = {}); // Channels attached in order
+		uint64_t submit(shared_ptr<Snapshot> snapshot, const string& input, ostream* output,
+			bool interactive = false,                         // Submits job resuming snapshot fork
+			const vector<shared_ptr<Channel>>& channels = {});
+		void feed(uint64_t id, WORD value);                   // Feeds input to interactive job
+		void closeInput(uint64_t id);                         // Closes interactive job input
+		void wait();                                          // Waits for all submitted jobs
+		inline void setTimeSlice(int64_t fuel) { timeSlice = fuel; }; // Job fuel per run (-1 unlimited)
+		ExecutorStats getStats();                             // Throughput and latency
+		inline void setMetricsEnabled(bool enabled) { metricsEnabled = enabled; }; // Publish live metrics
+		MetricsReport getMetrics();                           // Live metrics of all workers (any thread)
+		MetricsReport getWorkerMetrics(unsigned index);       // Live metrics of worker machines
+		inline unsigned getWorkersCount() { return (unsigned) workers.size(); };
+	private:
+		class Worker {
+		public:
+			mutex lock;                                       // Guards deque
+			deque<Job> jobs;                                  // Own jobs (back) stolen (front)
+			thread worker;                                    // Worker thread
+			Metrics metrics;                                  // Metrics of machines run by worker
+		};
+		vector<Worker*> workers;                              // Worker threads
+		size_t memorySize;                                    // Virtual machines memory size
+		mutex lock;                                           // Guards fields below
+		vector<VirtualMachine*> idleMachines;                 // Reusable virtual machines
+		unordered_map<uint64_t, shared_ptr<InputQueue>> inputs; // Not completed jobs inputs
+		unordered_map<uint64_t, Job> parked;                  // Jobs waiting for input
+		uint64_t nextId;                                      // Next job id
+		uint64_t machinesCount;                               // Virtual machines created
+		uint64_t parkedCount;                                 // Jobs parkings count
+		condition_variable jobsAvailable;                     // Signalled on submit and stop
+		condition_variable jobsDone;                          // Signalled when pending is zero
+		uint64_t queued;                                      // Jobs in deques
+		uint64_t pending;                                     // Submitted not completed jobs
+		bool     stopping;                                    // Workers stop request
+		unsigned nextWorker;                                  // Round robin submit
+		atomic<uint64_t> stolen;                              // Stolen jobs count
+		atomic<uint64_t> preempted;                           // Preempted jobs count
+		atomic<int64_t> timeSlice;                            // Job fuel per run
+		atomic<bool> metricsEnabled;                          // Machines publish live metrics
+		TimePoint started;                                    // First submit time
+		TimePoint finished;                                   // Last completion time
+		vector<double> latencies;                             // Jobs latencies (seconds)
+		void run(unsigned index);                             // Worker thread loop
+		bool takeJob(unsigned index, Job& job);               // Pops own or steals job
+		uint64_t submitJob(Job& job, const string& input, bool interactive); // Queues new job
+		void pushJob(unsigned index, Job& job, bool front = false); // Pushes job to worker deque
+		void runJob(unsigned index, Job& job);                // Runs or resumes job
+		void wakeJob(uint64_t id);                            // Moves parked job to deque
+	};
+
+};
@@ -0,0 +1,99 @@
+/*============================================================================
+*
+*  Virtual Machine compiled executable image file header
+*
+*  Image file layout (little endian):
+*
+*  [ImageHeader]  magic, version, sections, source hash, checksum, deepest
+*                 function stack usage and recommended memory size
+*  [Code]         codeSize words of executable image
+*  [Symbols]      symbolsCount records: address, argCount, size, fingerprint
+*                 (two words), relocationsCount, nameLength, name (padded
+*                 with zeros to WORD boundary), relocations offsets
+*  [Lines]        linesCount records: address, row, col (source line table)
+*
+*  Checksum covers the whole file except the checksum field itself, so
+*  corrupted header fields (sizes, offsets, entry point) are detected too.
+*
+*  (C) Bolat Basheyev 2021
+*
+============================================================================*/
+#pragma once
+
+#include <string>
+#include <cstdint>
+
+#include "runtime/VirtualMachine.h"
+#include "runtime/MappedFile.h"
+
+namespace vm {
+
+	constexpr uint32_t IMAGE_MAGIC = 0x494D5643;              // "CVMI"
+	constexpr uint32_t IMAGE_VERSION = 6;                     // Image file format version
+	constexpr size_t IMAGE_SYMBOL_WORDS = 7;                  // Symbol record size in words
+	constexpr size_t IMAGE_LINE_WORDS = 3;                    // Line record size in words
+	constexpr uint64_t HASH_SEED = 0xCBF29CE484222325;        // FNV-1a offset basis
+
+	uint64_t hashData(const void* data, size_t size, uint64_t hash = HASH_SEED);
+	uint32_t imageChecksum(const char* data, size_t size);    // Checksum of image file data
+
+	class ImageHeader {
+	public:
+		uint32_t magic;                                       // IMAGE_MAGIC
+		uint32_t version;                                     // IMAGE_VERSION
+		uint32_t headerSize;                                  // Header size in bytes
+		uint32_t checksum;                                    // Checksum of file except this field
+		uint64_t sourceHash;                                  // Source code hash
+		uint32_t codeOffset;                                  // Code section offset in bytes
+		uint32_t codeSize;                                    // Code section size in words
+		uint32_t symbolsOffset;                               // Symbols section offset in bytes
+		uint32_t symbolsCount;                                // Symbols count
+		uint32_t linesOffset;                                 // Lines section offset in bytes
+		uint32_t linesCount;                                  // Line table entries count
+		WORD     entryPoint;                                  // Entry point address
+		uint32_t stackWords;                                  // Deepest function stack usage in words
+		uint32_t memoryWords;                                 // Recommended memory in words (0 - default)
+		uint32_t reserved;                                    // Reserved (zero)
+	};
+
+
+	class ImageFile {
+	public:
+		ImageFile(const char* filename);                      // Maps and validates image file
+		~ImageFile();                                         // Unmaps image file
+		inline bool isValid() { return header != NULL; };     // Is image file valid
+		inline ImageHeader* getHeader() { return header; };   // Image file header
+		inline WORD* getCode() { return code; };              // Mapped code section
+		inline WORD getSize() { return header->codeSize; };   // Code size in words
+		inline size_t getMemorySize() { return (size_t) header->memoryWords * sizeof(WORD); }; // Recommended memory (0 - default)
+		inline WORD getMaxStackUsage() { return (WORD) header->stackWords; }; // Deepest function stack usage
+		bool readSymbols(vector<ImageSymbol>& symbols);       // Reads symbols section
+		bool readLines(vector<LineEntry>& lines);             // Reads line table section
+		static bool writeMemorySize(const char* filename, size_t memorySize); // Updates recommended memory
+	private:
+		MappedFile mapping;                                   // Mapped image file
+		ImageHeader* header;                                  // Validated header or NULL
+		WORD* code;                                           // Code section
+		bool validate();                                      // Checks header and checksum
+	};
+
+
+	//-------------------------------------------------------------------------
+	// Compiled images cache. Cached images are mapped and run, so directory
+	// is private to user: created with mode 0700, directory and images not
+	// owned by current user are not used
+	//-------------------------------------------------------------------------
+	class ImageCache {
+	public:
+		ImageCache(std::string directory = "");               // Default: $CVM_CACHE_DIR, $XDG_CACHE_HOME/cvm or ~/.cache/cvm
+		inline bool isValid() { return trusted; };            // Is directory owned by current user
+		inline std::string getDirectory() { return directory; }; // Cache directory
+		std::string getPath(uint64_t sourceHash);             // Image file path for source hash
+		std::string getLastBuildPath(std::string sourcePath); // Last image built from source file
+		static bool isOwned(const std::string& path);         // Is file owned by current user
+	private:
+		std::string directory;                                // Cache directory
+		bool trusted;                                         // Directory is usable
+	};
+
+}
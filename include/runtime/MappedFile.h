@@ -0,0 +1,27 @@
+/*============================================================================
+*
+*  Read-only memory mapped file class header
+*
+*  (C) Bolat Basheyev 2021
+*
+============================================================================*/
+#pragma once
+
+#include <cstddef>
+
+namespace vm {
+
+	class MappedFile {
+	public:
+		MappedFile(const char* filename);                     // Maps whole file for reading
+		~MappedFile();                                        // Unmaps file
+		inline bool isOpen() { return data != NULL; };       // Is file mapped
+		inline char* getData() { return data; };             // Pointer to file contents
+		inline size_t getSize() { return size; };            // File size in bytes
+		static size_t getPageSize();                          // Memory page size in bytes
+	private:
+		char* data;                                           // Mapped file contents
+		size_t size;                                          // Mapped file size in bytes
+	};
+
+}
@@ -0,0 +1,56 @@
+/*============================================================================
+*
+*  Virtual Machine live metrics header
+*
+*  Metrics block is updated by attached machines while they run and can be
+*  read by any thread (monitoring). Machine with attached block runs counting
+*  dispatch loop and publishes counters increments with relaxed atomics once
+*  per fuel slice (backward jumps and calls) and when dispatch loop returns,
+*  so readers see values at most one slice old. Machines add increments, so
+*  block shared by several machines (spawned threads, pool workers)
+*  aggregates them. Maximum stack depth is checked on calls.
+*
+*  (C) Bolat Basheyev 2021
+*
+============================================================================*/
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <iostream>
+
+#include "runtime/VirtualMachine.h"
+
+namespace vm {
+
+	class MetricsReport {
+	public:
+		uint64_t instructions;                                // VM instructions retired
+		uint64_t calls;                                       // Function calls
+		uint64_t syscalls;                                    // System calls
+		int64_t  stackDepth;                                  // Stack depth in words (last published)
+		int64_t  maxStackDepth;                               // Maximum stack depth in words
+		uint64_t running;                                     // Machines running dispatch loop now
+		double   seconds;                                     // Dispatch loop running time
+		void add(const MetricsReport& other);                 // Aggregates other report
+		void print(ostream& out);                             // Prints metrics
+	};
+
+
+	class Metrics {
+	public:
+		Metrics();
+		MetricsReport read();                                 // Reads published values (any thread)
+		void reset();                                         // Zeroes counters
+	private:
+		friend class VirtualMachine;
+		atomic<uint64_t> instructions;
+		atomic<uint64_t> calls;
+		atomic<uint64_t> syscalls;
+		atomic<int64_t>  stackDepth;
+		atomic<int64_t>  maxStackDepth;
+		atomic<uint64_t> running;
+		atomic<uint64_t> nanoseconds;
+	};
+
+}
@@ -0,0 +1,64 @@
+/*============================================================================
+*
+*  Virtual Machine hardware performance counters header
+*
+*  Counts host CPU events (Linux perf_event_open, user space only) while
+*  attached virtual machine runs dispatch loop. Counters belong to thread
+*  which created them, so machine has to be run by the same thread.
+*  Machine with attached counters runs counting dispatch loop, which counts
+*  VM instructions for derived metrics (one host add per VM instruction).
+*  Events not supported by host (virtual machines often have no PMU) are
+*  reported as not available.
+*
+*  (C) Bolat Basheyev 2021
+*
+============================================================================*/
+#pragma once
+
+#include <cstdint>
+#include <iostream>
+
+#include "runtime/VirtualMachine.h"
+
+namespace vm {
+
+	enum PerfEvent {
+		PERF_CYCLES,                                          // CPU cycles
+		PERF_INSTRUCTIONS,                                    // Host instructions retired
+		PERF_BRANCH_MISSES,                                   // Mispredicted branches
+		PERF_L1D_MISSES,                                      // L1 data cache read misses
+		PERF_LLC_MISSES,                                      // Last level cache misses
+		PERF_EVENTS_COUNT
+	};
+
+	constexpr const char* PERF_EVENT_NAMES[PERF_EVENTS_COUNT] = {
+		"cycles", "instructions", "branch-misses", "L1D read misses", "LLC misses"
+	};
+
+
+	class PerfReport {
+	public:
+		uint64_t values[PERF_EVENTS_COUNT];                   // Counted events (scaled if multiplexed)
+		bool available[PERF_EVENTS_COUNT];                    // Event is supported
+		uint64_t vmInstructions;                              // VM instructions executed
+		double seconds;                                       // Time counters were enabled
+		double perInstruction(PerfEvent event);               // Events per VM instruction (-1 unknown)
+		void print(ostream& out);                             // Prints counters and derived metrics
+	};
+
+
+	class PerfCounters {
+	public:
+		PerfCounters();                                       // Opens disabled counters of thread
+		~PerfCounters();                                      // Closes counters
+		bool isValid();                                       // Any event is supported
+		void start();                                         // Enables counters
+		void stop(uint64_t vmInstructions = 0);               // Disables counters, adds VM instructions
+		void reset();                                         // Zeroes counters
+		PerfReport read();                                    // Reads counted events
+	private:
+		int fds[PERF_EVENTS_COUNT];                           // Event descriptors (-1 not supported)
+		uint64_t vmInstructions;                              // VM instructions while enabled
+	};
+
+}
@@ -0,0 +1,56 @@
+/*============================================================================
+*
+*  Virtual Machine execution profile header
+*
+*  Profile counts instructions executed by profiling dispatch loop: per
+*  instruction address, per opcode, and taken / not taken conditional jumps.
+*  Counts are mapped to source lines with executable image line table.
+*  Profile is attached to one machine (spawned threads are not profiled).
+*
+*  (C) Bolat Basheyev 2021
+*
+============================================================================*/
+#pragma once
+
+#include <vector>
+#include <cstdint>
+#include <iostream>
+
+#include "runtime/VirtualMachine.h"
+
+namespace vm {
+
+	constexpr size_t OPCODES_COUNT = OP_CODE_MASK + 1;        // Opcode counters
+	constexpr size_t PROFILE_TOP_LINES = 10;                  // Hotspot lines reported
+
+	class Profile {
+	public:
+		Profile();
+		void clear();                                         // Resets counters
+		inline void count(WORD address, WORD opcode) {        // Counts executed instruction
+			if ((size_t) address >= counts.size()) grow(address);
+			counts[address]++;
+			opcodes[opcode & OP_CODE_MASK]++;
+			total++;
+		};
+		inline void branch(WORD address, bool taken) {        // Counts conditional jump outcome
+			if (taken) takenCounts[address]++; else notTakenCounts[address]++;
+		};
+		inline uint64_t getTotal() { return total; };         // Instructions executed
+		uint64_t getCount(WORD address);                      // Executions of instruction
+		uint64_t getTaken(WORD address);                      // Conditional jump taken
+		uint64_t getNotTaken(WORD address);                   // Conditional jump not taken
+		inline uint64_t getOpcodeCount(WORD opcode) { return opcodes[opcode & OP_CODE_MASK]; };
+		void printOpcodes(ostream& out);                      // Prints opcodes by count
+		void printLines(ExecutableImage& image, ostream& out, const char* source = NULL,
+			size_t top = PROFILE_TOP_LINES);                  // Prints hottest source lines
+	private:
+		vector<uint64_t> counts;                              // Executions by address
+		vector<uint64_t> takenCounts;                         // Jumps taken by address
+		vector<uint64_t> notTakenCounts;                      // Jumps not taken by address
+		uint64_t opcodes[OPCODES_COUNT];                      // Executions by opcode
+		uint64_t total;                                       // Instructions executed
+		void grow(WORD address);                              // Fits lazily appended code
+	};
+
+}
@@ -0,0 +1,57 @@
+/*============================================================================
+*
+*  Virtual Machine sampling profiler header
+*
+*  Sampler interrupts thread running virtual machine by timer signal
+*  (Linux: SIGPROF of monotonic clock timer directed to thread), signal
+*  handler reads instruction pointer and walks frames chain (return address
+*  and saved locals pointer pushed by OP_CALL) into preallocated buffer,
+*  so there is no cost per instruction. Samples are mapped to functions by
+*  image symbols and written as folded stacks ("main;fact;fact 42" lines)
+*  for flame graphs. Registers are read in the middle of instruction, so
+*  some samples of calls and returns attribute leaf to caller.
+*
+*  (C) Bolat Basheyev 2021
+*
+============================================================================*/
+#pragma once
+
+#include <vector>
+#include <atomic>
+#include <cstdint>
+#include <iostream>
+#include <ctime>
+
+#include "runtime/VirtualMachine.h"
+
+namespace vm {
+
+	constexpr unsigned SAMPLER_FREQUENCY = 1000;              // Default samples per CPU second
+	constexpr size_t SAMPLER_CAPACITY = 1 << 20;              // Default buffer size in words
+	constexpr WORD SAMPLER_MAX_DEPTH = 128;                   // Frames recorded per sample
+
+	class Sampler {
+	public:
+		Sampler(size_t capacity = SAMPLER_CAPACITY);         // Preallocates samples buffer
+		~Sampler();                                           // Stops sampling
+		bool start(VirtualMachine& machine, unsigned frequency = SAMPLER_FREQUENCY); // Samples calling thread
+		void stop();                                          // Stops timer (samples are kept)
+		void clear();                                         // Drops samples
+		inline size_t getSamplesCount() { return samples; };  // Recorded samples
+		inline size_t getDroppedCount() { return dropped; };  // Samples not fit in buffer
+		void writeFolded(ExecutableImage& image, ostream& out); // Writes folded stacks
+	private:
+		vector<WORD> buffer;                                  // Samples: depth, frames (leaf first)
+		size_t used;                                          // Buffer words used
+		size_t samples;                                       // Recorded samples
+		size_t dropped;                                       // Dropped samples
+		VirtualMachine* machine;                              // Sampled machine
+		atomic<bool> active;                                  // Timer is running
+#ifdef __linux__
+		timer_t timer;                                        // Sampling timer of thread
+#endif
+		static void handler(int signal);                      // Timer signal handler
+		void sample();                                        // Records machine call stack
+	};
+
+}
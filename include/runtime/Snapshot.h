@@ -0,0 +1,112 @@
+/*============================================================================
+*
+*  Virtual Machine snapshot header
+*
+*  Snapshot captures paused virtual machine (registers, fibers and memory)
+*  and forks new machines from it. On Linux pages of live stacks are kept
+*  in sparse memory file (memfd) and mapped MAP_PRIVATE over machine memory,
+*  so forks share pages copy-on-write. Elsewhere memory is copied.
+*
+*  Code segment is shared, shared memory is copied, channels, input queue
+*  and trap handler are not captured (host attaches them to forks).
+*
+*  Snapshot can be saved to checkpoint file and loaded in other process.
+*  Checkpoint file layout (little endian):
+*
+*  [CheckpointHeader]  magic, version, registers, sections and checksum
+*  [Code]              codeSize words of code segment
+*  [State]             stateSize words: fibers count, fiber records (ip, sp,
+*                      fp, lp, stackTop, region, state, result, joiners
+*                      count, joiners), run queue, input waiters and free
+*                      regions (count and fiber ids / region indices)
+*  [Shared]            sharedSize words of shared memory
+*  [Ranges]            rangesCount records: memory address, size and file
+*                      offset in bytes
+*  [Pages]             used memory pages (live fiber stacks), page aligned,
+*                      so ranges are mapped MAP_PRIVATE right from the file
+*
+*  Free memory between stacks is not saved (restored as zero pages).
+*  Checksum covers everything after the header.
+*
+*  (C) Bolat Basheyev 2021
+*
+============================================================================*/
+#pragma once
+
+#include <vector>
+#include <memory>
+#include <cstdint>
+
+#include "runtime/VirtualMachine.h"
+
+namespace vm {
+
+	constexpr uint32_t CHECKPOINT_MAGIC = 0x534D5643;         // "CVMS"
+	constexpr uint32_t CHECKPOINT_VERSION = 2;                // Checkpoint file format version
+
+	class CheckpointHeader {
+	public:
+		uint32_t magic;                                       // CHECKPOINT_MAGIC
+		uint32_t version;                                     // CHECKPOINT_VERSION
+		uint32_t headerSize;                                  // Header size in bytes
+		uint32_t checksum;                                    // Checksum of data after header
+		uint64_t memoryBytes;                                 // Memory mapping size in bytes
+		uint64_t pageSize;                                    // Page size of saving host
+		WORD     maxAddress;                                  // Highest address in words
+		WORD     ip, sp, fp, lp;                              // Registers
+		WORD     current;                                     // Running fiber
+		WORD     regionsCount;                                // Allocated stack regions
+		WORD     fiberStackSize;                              // Fiber stack size in words
+		uint32_t codeOffset;                                  // Code section offset in bytes
+		uint32_t codeSize;                                    // Code section size in words
+		uint32_t stateOffset;                                 // State section offset in bytes
+		uint32_t stateSize;                                   // State section size in words
+		uint32_t sharedOffset;                                // Shared memory offset in bytes
+		uint32_t sharedSize;                                  // Shared memory size in words
+		uint32_t rangesOffset;                                // Ranges section offset in bytes
+		uint32_t rangesCount;                                 // Memory ranges count
+	};
+
+
+	class MemoryRange {
+	public:
+		uint64_t address;                                     // Memory offset in bytes
+		uint64_t size;                                        // Size in bytes
+		uint64_t offset;                                      // File offset in bytes
+	};
+
+
+	class Snapshot {
+	public:
+		Snapshot(VirtualMachine& machine);                    // Captures paused machine
+		Snapshot(const char* filename);                       // Loads checkpoint file
+		~Snapshot();                                          // Releases memory file
+		inline bool isValid() { return valid; };              // Is snapshot captured
+		inline size_t getMemorySize() { return (size_t) maxAddress * sizeof(WORD); }; // VM memory size in bytes
+		inline shared_ptr<CodeSegment> getCode() { return segment; }; // Snapshot code segment
+		VirtualMachine* fork();                               // New paused machine
+		bool restore(VirtualMachine& machine);                // Restores state to same size machine
+		bool save(const char* filename);                      // Saves checkpoint file
+	private:
+		bool valid;
+		int  fd;                                              // Memory or checkpoint file (-1 - copy)
+		vector<WORD> memory;                                  // Memory copy (no memory file)
+		vector<MemoryRange> ranges;                           // Memory ranges in memory file
+		size_t memoryBytes;                                   // Memory size in bytes (page aligned)
+		WORD maxAddress;                                      // Highest address in words
+		shared_ptr<CodeSegment> segment;                      // Code segment
+		vector<WORD> sharedWords;                             // Shared memory copy
+		WORD ip, sp, fp, lp;                                  // Registers
+		vector<Fiber> fibers;                                 // Fibers state
+		deque<WORD> runQueue;                                 // Ready fibers
+		deque<WORD> inputWaiters;                             // Fibers parked on input
+		vector<WORD> freeRegions;                             // Released stack regions
+		WORD regionsCount;                                    // Allocated stack regions
+		WORD fiberStackSize;                                  // Fiber stack size in words
+		WORD current;                                         // Running fiber
+		vector<MemoryRange> usedRanges(size_t pageSize);      // Live stacks rounded to pages
+		void readMemory(const MemoryRange& range, char* data); // Copies memory range
+		bool load(const char* filename);                      // Parses checkpoint file
+	};
+
+};
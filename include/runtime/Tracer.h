@@ -0,0 +1,137 @@
+/*============================================================================
+*
+*  Virtual Machine call tracing header
+*
+*  Dispatch loop built with CVM_TRACING records OP_CALL, OP_RET and
+*  OP_SYSCALL as begin / end events with timestamps into lock-free ring
+*  buffer of machine (single producer - thread running machine). Writer
+*  thread drains buffers and writes Chrome trace event format JSON (opens
+*  in chrome://tracing and Perfetto), every fiber of machine is own track.
+*  Without CVM_TRACING dispatch loop has no tracing code at all.
+*  Events not fit into full buffer are dropped and counted: buffer keeps
+*  room for end events of recorded calls, and call that is dropped drops
+*  its nested calls and its end, so trace has no unmatched events.
+*
+*  (C) Bolat Basheyev 2021
+*
+============================================================================*/
+#pragma once
+
+#include <vector>
+#include <string>
+#include <map>
+#include <set>
+#include <memory>
+#include <atomic>
+#include <mutex>
+#include <thread>
+#include <chrono>
+#include <fstream>
+#include <condition_variable>
+
+#include "runtime/VirtualMachine.h"
+
+namespace vm {
+
+#ifdef CVM_TRACING
+	constexpr bool TRACING_ENABLED = true;                    // Dispatch loop records events
+#else
+	constexpr bool TRACING_ENABLED = false;
+#endif
+	constexpr uint32_t TRACE_BUFFER_EVENTS = 1 << 18;         // Ring buffer capacity of machine
+	constexpr unsigned TRACE_FLUSH_INTERVAL = 1;              // Writer drain interval in ms
+
+	enum class TraceEventType : uint8_t {
+		CALL,                                                 // Function begin (callee address)
+		RETURN,                                               // Function end
+		SYSCALL_BEGIN,                                        // System call begin (call number)
+		SYSCALL_END                                           // System call end (call number)
+	};
+
+
+	class TraceEvent {
+	public:
+		int64_t time;                                         // Steady clock in nanoseconds
+		WORD value;                                           // Callee address or system call
+		WORD fiber;                                           // Fiber id
+		TraceEventType type;                                  // Event type
+	};
+
+
+	//-------------------------------------------------------------------------
+	// Single producer single consumer ring buffer of machine trace events
+	//-------------------------------------------------------------------------
+	class TraceBuffer {
+	public:
+		TraceBuffer(WORD id);
+		~TraceBuffer();
+		inline WORD getId() { return id; };                   // Buffer id (trace thread id)
+		inline uint64_t getDropped() { return dropped.load(memory_order_relaxed); }; // Dropped events
+		inline void record(TraceEventType type, WORD value, WORD fiber) { // Adds event (producer)
+			bool begin = (type == TraceEventType::CALL || type == TraceEventType::SYSCALL_BEGIN);
+			if ((size_t) fiber >= skipped.size()) skipped.resize(fiber + 1, 0);
+			uint32_t& depth = skipped[fiber];
+			if (depth > 0) {
+				// inside dropped call: drop nested calls and end of dropped call
+				if (begin) depth++; else depth--;
+				dropped.fetch_add(1, memory_order_relaxed);
+				return;
+			}
+			uint32_t t = tail.load(memory_order_relaxed);
+			uint32_t used = t - head.load(memory_order_acquire);
+			// begin also needs room for its end and for ends of open calls
+			if (begin ? (used + open + 1 > mask) : (open == 0 && used > mask)) {
+				if (begin) depth = 1;
+				dropped.fetch_add(1, memory_order_relaxed);
+				return;
+			}
+			if (begin) open++; else if (open > 0) open--;
+			TraceEvent& event = events[t & mask];
+			event.time = chrono::duration_cast<chrono::nanoseconds>(chrono::steady_clock::now().time_since_epoch()).count();
+			event.value = value;
+			event.fiber = fiber;
+			event.type = type;
+			tail.store(t + 1, memory_order_release);
+		};
+		size_t drain(vector<TraceEvent>& out);                // Takes all events (consumer)
+		void restart();                                       // Forgets calls of previous run (producer)
+	private:
+		WORD id;
+		TraceEvent* events;
+		uint32_t mask;
+		atomic<uint32_t> head;                                // Next event to read
+		atomic<uint32_t> tail;                                // Next event to write
+		atomic<uint64_t> dropped;                             // Events not fit in buffer
+		uint32_t open;                                        // Recorded calls without end (producer)
+		vector<uint32_t> skipped;                             // Dropped calls depth of fiber (producer)
+	};
+
+
+	class Tracer {
+	public:
+		Tracer(const char* filename);                         // Opens trace file, starts writer
+		~Tracer();                                            // Closes trace file
+		inline bool isOpen() { return opened; };              // Is trace file open
+		TraceBuffer* createBuffer();                          // New buffer of machine
+		void setSymbols(ExecutableImage& image);              // Function names by address
+		void close();                                         // Writes remaining events, completes file
+		inline uint64_t getEventsCount() { return written; }; // Events written
+		uint64_t getDroppedCount();                           // Events dropped by all buffers
+	private:
+		ofstream file;                                        // Trace file
+		bool opened;                                          // Trace file is open
+		mutex lock;                                           // Guards buffers, symbols and stopping
+		condition_variable wake;                              // Wakes writer to stop
+		thread writer;                                        // Drains buffers to file
+		bool stopping;                                        // Writer has to finish
+		vector<unique_ptr<TraceBuffer>> buffers;              // Buffers of machines
+		map<WORD, string> symbols;                            // Function names by address
+		set<int64_t> tracks;                                  // Named tracks (thread ids)
+		int64_t start;                                        // Trace start time in nanoseconds
+		uint64_t written;                                     // Events written
+		void run();                                           // Writer thread loop
+		void flush(vector<TraceEvent>& events);               // Drains buffers to file
+		void writeEvent(TraceBuffer* buffer, TraceEvent& event); // Writes event JSON
+	};
+
+}
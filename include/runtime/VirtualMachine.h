@@ -12,7 +12,15 @@
 #pragma once
 
 #include <vector>
+#include <string>
 #include <cstdint>
+#include <functional>
+#include <memory>
+#include <iostream>
+#include <deque>
+#include <mutex>
+#include <thread>
+#include <atomic>
 
 using namespace std;
 
@@ -56,12 +64,70 @@ namespace vm {
 	constexpr WORD OP_CALL      = 0b00000000000000000000000000011001;
 	constexpr WORD OP_RET       = 0b00000000000000000000000000011010;
 	constexpr WORD OP_SYSCALL   = 0b00000000000000000000000000011011;
-	constexpr WORD OP_RESERVED  = 0b00000000000000000000000000011100;
+	constexpr WORD OP_TRAP      = 0b00000000000000000000000000011100;
 
 	constexpr WORD OP_LOAD      = 0b00000000000000000000000000011101;
 	constexpr WORD OP_STORE     = 0b00000000000000000000000000011110;
 	constexpr WORD OP_ARG       = 0b00000000000000000000000000011111;
 
+	constexpr WORD OP_AFADD     = 0b00000000000000000000000000100000;
+	constexpr WORD OP_ACAS      = 0b00000000000000000000000000100001;
+	constexpr WORD OP_ALOAD     = 0b00000000000000000000000000100010;
+	constexpr WORD OP_ASTORE    = 0b00000000000000000000000000100011;
+
+	constexpr WORD OP_DROP      = 0b00000000000000000000000000100100;
+
+	constexpr WORD SYS_PRINT_STRING = 0x20;                   // System calls numbers
+	constexpr WORD SYS_PRINT_INT    = 0x21;
+	constexpr WORD SYS_READ_INT     = 0x22;
+	constexpr WORD SYS_FIBER_SPAWN  = 0x23;
+	constexpr WORD SYS_FIBER_YIELD  = 0x24;
+	constexpr WORD SYS_FIBER_JOIN   = 0x25;
+	constexpr WORD SYS_THREAD_SPAWN = 0x26;
+	constexpr WORD SYS_THREAD_JOIN  = 0x27;
+	constexpr WORD SYS_CHANNEL_SEND = 0x28;
+	constexpr WORD SYS_CHANNEL_RECV = 0x29;
+	constexpr WORD SYS_CHANNEL_SEND_BLOCK = 0x2A;
+	constexpr WORD SYS_CHANNEL_RECV_BLOCK = 0x2B;
+	constexpr WORD SYS_CHANNEL_CLOSE = 0x2C;
+	constexpr WORD SYS_CHECKPOINT   = 0x2D;
+
+	constexpr WORD HALT_ADDRESS = 3;                          // OP_HALT after entry point call
+	constexpr WORD FIBER_STACK_SIZE = 256;                    // Default fiber stack in words
+	constexpr WORD SHARED_MEMORY_SIZE = 0x1000;               // Default shared memory in words
+	constexpr size_t DEFAULT_MEMORY_SIZE = 64 << 20;         // Reserved memory in bytes (committed on touch)
+	constexpr size_t MAX_MEMORY_SIZE = (size_t) 0x7FFFFFFF * sizeof(WORD); // Addressable memory in bytes
+	constexpr WORD FUEL_SLICE = 4096;                         // Fuel charges between interrupt checks
+	constexpr int64_t FUEL_UNLIMITED = -1;                    // No fuel budget
+	constexpr size_t MEMORY_HEADROOM = 4;                     // Recommended memory adds 1/4 of used
+
+
+	class ImageFile;
+	class Channel;
+	class Profile;
+	class PerfCounters;
+	class Metrics;
+	class Tracer;
+	class TraceBuffer;
+
+	class ImageSymbol {
+	public:
+		string name;                                          // Function name
+		WORD address;                                         // Function address
+		WORD argCount;                                        // Function arguments count
+		WORD size = 0;                                        // Function code size in words
+		uint64_t fingerprint = 0;                             // Function source fingerprint
+		vector<WORD> relocations;                             // Call targets offsets in code
+	};
+
+
+	class LineEntry {
+	public:
+		WORD address;                                         // First instruction address
+		WORD row;                                             // Source line
+		WORD col;                                             // Source column
+	};
+
 
 	class ExecutableImage {
 	public:
@@ -79,38 +145,265 @@ namespace vm {
 		WORD readWord(WORD address);
 		WORD* getImage();
 		WORD getSize();
-		void disassemble();
+		void addRelocation(WORD address);
+		inline vector<WORD>& getRelocations() { return relocations; };
+		ImageSymbol& addSymbol(string name, WORD address, WORD argCount);
+		inline size_t getSymbolCount() { return symbols.size(); };
+		inline ImageSymbol& getSymbol(size_t index) { return symbols[index]; };
+		inline uint64_t getSourceHash() { return sourceHash; };
+		inline void setSourceHash(uint64_t hash) { sourceHash = hash; };
+		void addLine(WORD row, WORD col);
+		void addLine(WORD address, WORD row, WORD col);
+		inline vector<LineEntry>& getLines() { return lines; };
+		const LineEntry* findLine(WORD address);
+		bool save(const char* filename);
+		bool load(const char* filename);
+		bool load(ImageFile& file);
+		void disassemble(Profile* profile = NULL);
+		WORD getStackUsage(WORD address, WORD size);
+		WORD getMaxStackUsage();
+		inline size_t getMemorySize() { return memorySize; };
+		inline void setMemorySize(size_t bytes) { memorySize = bytes; };
 
 	private:
 		vector<WORD> image;
+		vector<ImageSymbol> symbols;
+		vector<WORD> relocations;
+		vector<LineEntry> lines;
+		uint64_t sourceHash = 0;
+		size_t memorySize = 0;
 		WORD emitAddress = 0;
 		void prepareSpace(WORD wordsCount);
 		void prepareSpace(WORD address, WORD wordsCount);
-		WORD printMnemomic(WORD address);
+		WORD printMnemomic(WORD address, Profile* profile = NULL);
+	};
+
+
+	//-------------------------------------------------------------------------
+	// Immutable code segment shared by virtual machines (reference counted)
+	//-------------------------------------------------------------------------
+	class CodeSegment {
+	public:
+		CodeSegment(ExecutableImage& image);                  // Copies executable image code
+		CodeSegment(const char* filename);                    // Maps compiled image file
+		CodeSegment(const WORD* code, WORD size);             // Copies code words
+		~CodeSegment();                                       // Releases code
+		inline bool isValid() { return code != NULL; };       // Is code loaded
+		inline const WORD* getCode() { return code; };        // Code words
+		inline WORD getSize() { return size; };               // Code size in words
+		void append(ExecutableImage& image, WORD from);       // Appends lazily compiled code
+		void writeWord(WORD address, WORD value);             // Patches lazy stubs and calls
+	private:
+		vector<WORD> words;                                   // Copied code
+		ImageFile* file;                                      // Mapped image file
+		WORD* code;                                           // Code words
+		WORD size;                                            // Code size in words
+	};
+
+
+	// Resolves function stub by index, returns function address or -1
+	typedef function<WORD(WORD)> TrapHandler;
+
+
+	enum class FaultKind {
+		NONE,                                                 // No hardware fault
+		STACK_OVERFLOW,                                       // Guard page below memory or fiber stack accessed
+		MEMORY_ACCESS,                                        // Guard page above memory accessed
+		DIVISION                                              // Division by zero or overflow
+	};
+
+
+	enum class ExecutionStatus {
+		HALTED,                                               // Main fiber halted
+		WAITING,                                              // All fibers wait for input
+		PAUSED,                                               // Paused at checkpoint
+		EXHAUSTED,                                            // Fuel budget exhausted (resumable)
+		INTERRUPTED,                                          // Interrupted by host (resumable)
+		ERROR                                                 // Runtime error
+	};
+
+
+	//-------------------------------------------------------------------------
+	// Thread safe input queue fed by host, fibers reading empty queue park
+	//-------------------------------------------------------------------------
+	class InputQueue {
+	public:
+		InputQueue();
+		void push(WORD value);                                // Adds input value
+		void close();                                         // No more input (reads return 0)
+		bool pop(WORD& value);                                // Takes value, false if empty
+		bool isReady();                                       // Has values or closed
+	private:
+		mutex lock;
+		deque<WORD> values;
+		bool closed;
+	};
+
+
+	//-------------------------------------------------------------------------
+	// Memory shared by threads, accessed by atomic operations only
+	//-------------------------------------------------------------------------
+	class SharedMemory {
+	public:
+		SharedMemory(WORD size = SHARED_MEMORY_SIZE);        // Allocates zeroed words
+		~SharedMemory();                                      // Releases words
+		inline atomic<WORD>* getWords() { return words; };    // Shared words
+		inline WORD getSize() { return size; };               // Size in words
+	private:
+		atomic<WORD>* words;
+		WORD size;
+	};
+
+
+	enum class FiberState { READY, RUNNING, WAITING_INPUT, JOINING, DONE };
+
+	//-------------------------------------------------------------------------
+	// Green thread: registers and its own stack region in VM memory
+	//-------------------------------------------------------------------------
+	class Fiber {
+	public:
+		WORD ip = 0, sp = 0, fp = 0, lp = 0;                  // Saved registers
+		WORD stackTop = 0;                                    // Stack region top (exclusive)
+		WORD region = -1;                                     // Stack region index (-1 main)
+		FiberState state = FiberState::READY;                 // Scheduling state
+		WORD result = 0;                                      // Function return value
+		vector<WORD> joiners;                                 // Fibers waiting for completion
 	};
 
 
 	class VirtualMachine {
 	public:
-		VirtualMachine(WORD memorySize = 0xFFFF);             // Allocates VM memory in bytes
+		VirtualMachine(size_t memorySize = DEFAULT_MEMORY_SIZE); // Reserves VM stack and data memory in bytes
 		~VirtualMachine();                                    // Desctructor
-		bool loadImage(ExecutableImage& image);               // Load executable image
-		void execute();                                       // Runs image from address 0
+		bool loadImage(ExecutableImage& image, WORD from = 0);// Load private copy of image (lazy: from address)
+		bool loadCode(shared_ptr<CodeSegment> segment);       // Load shared code segment
+		void setTrapHandler(TrapHandler handler);             // Set function stub trap handler
+		void setInput(istream* input);                        // Set system calls input stream
+		void setOutput(ostream* output);                      // Set system calls output stream
+		inline istream* getInput() { return input; };         // Get system calls input stream
+		inline ostream* getOutput() { return output; };       // Get system calls output stream
+		inline void setVerbose(bool verbose) { this->verbose = verbose; }; // Print runtime banner
+		ExecutionStatus execute();                            // Runs image from address 0
+		ExecutionStatus resume();                             // Resumes paused or waiting machine
+		ExecutionStatus call(WORD address, WORD argument);    // Runs function(argument) as main fiber
+		void reset();                                         // Clears state of previous run for reuse
+		inline WORD getResult() { return memory[sp]; };       // Top of stack after halt
+		inline ExecutionStatus getStatus() { return status; }; // Get last execution status
+		inline FaultKind getFault() { return fault; };        // Hardware fault of last error
+		inline WORD getFaultAddress() { return faultAddress; }; // Opcode address at fault
+		void setInputQueue(shared_ptr<InputQueue> queue);     // Read input from queue (NULL - stream)
+		void setFuel(int64_t fuel);                           // Backward jumps and calls budget
+		inline int64_t getFuel() { return fuel < 0 ? fuel : fuel + (fuelSlice > 0 ? fuelSlice : 0); }; // Remaining fuel
+		inline void setProfile(Profile* profile) { this->profile = profile; }; // Count executed instructions (NULL - off)
+		inline Profile* getProfile() { return profile; };     // Attached profile
+		inline void setPerfCounters(PerfCounters* counters) { perf = counters; }; // Count host CPU events (NULL - off)
+		inline uint64_t getInstructionsCount() { return retired; }; // VM instructions counted with perf counters or metrics
+		void setMetrics(Metrics* metrics);                    // Publish live metrics (NULL - off)
+		inline Metrics* getMetrics() { return metrics; };     // Attached metrics block
+		void setTracer(Tracer* tracer);                       // Trace calls (CVM_TRACING builds, NULL - off)
+		inline void interrupt() { interrupted.store(true, memory_order_relaxed); }; // Stop (any thread)
+		inline void setFiberStackSize(WORD words) { fiberStackSize = words; }; // Spawned stacks size
+		inline size_t getFibersCount() { return fibers.size(); }; // Fibers spawned since start
+		inline WORD getMaxStackDepth() { return maxStackDepth; }; // Deepest stack in words (last run)
+		inline WORD getMaxCallDepth() { return maxCallDepth; }; // Most nested live calls (last run, 0 if plain)
+		inline WORD getMinSP() { return maxAddress - maxStackDepth; }; // Main stack high water address
+		size_t recommendMemorySize(WORD frameWords);          // Memory for last run stacks and deepest frame
+		inline void setSharedMemory(shared_ptr<SharedMemory> memory) { shared = memory; }; // Set shared memory
+		inline shared_ptr<SharedMemory> getSharedMemory() { return shared; }; // Get shared memory
+		WORD attachChannel(shared_ptr<Channel> channel);      // Attach channel, returns its index
+		inline void detachChannels() { channels.clear(); };   // Detach all channels
 		void printState();                                    // Print current VM state
 		inline WORD getMaxAddress() { return maxAddress; };   // Get max address in WORDS
 		inline WORD* getMemory() { return memory; };          // Returns pointer to VM RAM
+		inline shared_ptr<CodeSegment> getCode() { return segment; }; // Returns code segment
 		inline WORD getIP() { return ip; };                   // Get Instruction Pointer address
 		inline WORD getSP() { return sp; };                   // Get Stack Pointer address
 		inline WORD getFP() { return fp; };                   // Get Frame Pointer address
 		inline WORD getLP() { return lp; };                   // Get Locals Pointer address
 	private:
-		WORD* memory;                                         // Random access memory array
+		friend class Snapshot;
+		friend class Sampler;
+		shared_ptr<CodeSegment> segment;                      // Code segment (shared)
+		const WORD* code;                                     // Code segment words
+		WORD* memory;                                         // Stack and data memory array
 		WORD  ip;                                             // Instruction pointer
 		WORD  sp;                                             // Stack pointer
 		WORD  fp;                                             // Frame pointer
 		WORD  lp;                                             // Local variables pointer
 		WORD  maxAddress;                                     // Highest address in words
-		void sysCall(WORD n);                                 // System call
+		size_t memoryBytes;                                   // Memory mapping size in bytes
+		size_t guardBytes;                                    // Guard pages size on each side
+		TrapHandler trapHandler;                              // Function stub trap handler
+		istream* input;                                       // System calls input stream
+		ostream* output;                                      // System calls output stream
+		bool  verbose;                                        // Print runtime banner
+		ExecutionStatus status;                               // Last execution status
+		FaultKind fault;                                      // Hardware fault of last error
+		WORD  faultAddress;                                   // Opcode address at fault
+		shared_ptr<InputQueue> inputQueue;                    // Host fed input (NULL - stream)
+		vector<Fiber> fibers;                                 // Fibers, index is fiber id
+		deque<WORD> runQueue;                                 // Ready fibers (round robin)
+		deque<WORD> inputWaiters;                             // Fibers parked on input
+		vector<WORD> freeRegions;                             // Released stack regions
+		WORD  regionsCount;                                   // Allocated stack regions
+		WORD  guardedWords;                                   // Lower memory with region guard pages
+		WORD  fiberStackSize;                                 // Spawned fiber stack in words
+		WORD  current;                                        // Running fiber id
+		shared_ptr<SharedMemory> shared;                      // Memory shared with threads
+		shared_ptr<mutex> ioLock;                             // Input/output lock of threads
+		vector<thread> threads;                               // Spawned threads
+		vector<VirtualMachine*> children;                     // Spawned threads machines
+		vector<shared_ptr<Channel>> channels;                 // Attached channels
+		int64_t fuel;                                         // Fuel not in slice (-1 unlimited)
+		WORD  fuelSlice;                                      // Charges left before refuel
+		atomic<bool> interrupted;                             // Interrupt requested by host
+		Profile* profile;                                     // Execution profile (NULL - off)
+		PerfCounters* perf;                                   // Hardware counters (NULL - off)
+		uint64_t retired;                                     // Instructions of counting dispatch
+		uint64_t callsCount;                                  // Calls of counting dispatch
+		uint64_t syscallsCount;                               // System calls of counting dispatch
+		WORD  maxStackDepth;                                  // Stack depth at deepest call
+		bool  memoryClean;                                    // No pages touched since reserve or reset
+		bool  countPages;                                     // Touched pages are of this run only
+		WORD  callDepth;                                      // Live calls of all fibers
+		WORD  maxCallDepth;                                   // Most live calls
+		Metrics* metrics;                                     // Live metrics block (NULL - off)
+		uint64_t publishedRetired;                            // Counters at last metrics publish
+		uint64_t publishedCalls;
+		uint64_t publishedSyscalls;
+		int64_t publishedTime;                                // Steady clock ns at last publish
+		Tracer* tracer;                                       // Call tracer (NULL - off)
+		TraceBuffer* trace;                                   // Trace events buffer of machine
+		ExecutionStatus start(Fiber& main);                   // Resets fibers and runs main fiber
+		ExecutionStatus run();                                // Dispatch loop with fault traps
+		ExecutionStatus dispatchVariant();                    // Runs profiling / counting variant
+		template <bool profiling, bool counting>
+		ExecutionStatus dispatch();                           // Dispatch loop
+		ExecutionStatus trapFault(FaultKind kind);            // Reports hardware fault
+		WORD findInstruction(WORD address);                   // Instruction containing code address
+		bool sysCall(WORD n);                                 // System call, false - stop loop
+		bool refuel();                                        // Checks interrupt, takes fuel slice
+		void publishMetrics();                                // Adds counters increments to metrics
+		void sampleStack();                                   // Raises max stack depth to current
+		WORD getTouchedStackDepth();                          // Main stack depth of resident pages
+		inline bool tracksCalls() { return profile != NULL || perf != NULL || metrics != NULL; }; // Dispatch variant tracks calls
+		WORD spawnFiber(WORD address, WORD argument);         // Creates fiber calling function
+		bool finishFiber();                                   // Completes running fiber
+		bool joinFiber(WORD id);                              // Waits for fiber result
+		Fiber makeFiber(WORD address, WORD argument, WORD top, WORD region); // Fiber calling function
+		WORD getRegionWords();                                // Fiber stack region with guard page
+		void guardRegion(WORD region);                        // Protects region guard page
+		void unguardRegions();                                // Unprotects all guard pages
+		WORD spawnThread(WORD address, WORD argument);        // Runs function on child machine thread
+		WORD joinThread(WORD id);                             // Waits for thread result
+		void joinThreads();                                   // Waits for all threads
+		bool checkShared(WORD address);                       // Validates shared memory address
+		bool channelCall(WORD n);                             // Channel system call (blocks or parks)
+		bool tryChannelCall(WORD n, Channel* channel, WORD& result); // Non blocking channel call
+		bool readInput();                                     // Reads input or parks fiber
+		void deliverInput();                                  // Wakes fibers parked on input
+		bool switchFiber();                                   // Runs next ready fiber
+		void saveFiber();                                     // Saves registers to fiber
 	};
 
 
@@ -0,0 +1,114 @@
+/*============================================================================
+*
+*  Virtual Machine benchmark program generator implementation
+*
+*  (C) Bolat Basheyev 2021
+*
+============================================================================*/
+#include <sstream>
+#include "ProgramGenerator.h"
+
+using namespace std;
+using namespace vm;
+
+static const char* OPERATORS[] = { "+", "-", "*", "&", "|", "^", "<<", ">>" };
+static const size_t OPERATORS_COUNT = sizeof(OPERATORS) / sizeof(OPERATORS[0]);
+
+//-----------------------------------------------------------------------------
+// Generator is deterministic: same options give same program
+//-----------------------------------------------------------------------------
+ProgramGenerator::ProgramGenerator(const GeneratorOptions& options) {
+	this->options = options;
+	if (this->options.locals == 0) this->options.locals = 1;
+	lines = 0;
+	seed = 1;
+}
+
+string ProgramGenerator::generate() {
+	ostringstream out;
+	generate(out);
+	return out.str();
+}
+
+//-----------------------------------------------------------------------------
+// Writes functions f0..fN-1 and main calling the last one
+//-----------------------------------------------------------------------------
+void ProgramGenerator::generate(ostream& out) {
+	lines = 0;
+	seed = 1;
+	for (size_t i = 0; i < options.functions; i++) generateFunction(out, i);
+	line(out, 0, "int main() {");
+	line(out, 1, "int result;");
+	if (options.functions > 0) line(out, 1, "result = f" + to_string(options.functions - 1) + "(1, 2);");
+	else line(out, 1, "result = 0;");
+	line(out, 1, "return 0;");
+	line(out, 0, "}");
+}
+
+void ProgramGenerator::line(ostream& out, size_t indent, const string& text) {
+	out << string(indent * 4, ' ') << text << '\n';
+	lines++;
+}
+
+//-----------------------------------------------------------------------------
+// Function with locals, nested statements and call of previous function
+//-----------------------------------------------------------------------------
+void ProgramGenerator::generateFunction(ostream& out, size_t index) {
+	line(out, 0, "int f" + to_string(index) + "(int a, int b) {");
+	string declaration = "int ";
+	for (size_t i = 0; i < options.locals; i++) declaration += (i ? ", " : "") + variable(0) + "v" + to_string(i);
+	line(out, 1, declaration + ";");
+	for (size_t i = 0; i < options.locals; i++) line(out, 1, variable(0) + "v" + to_string(i) + " = " + expression(0) + ";");
+	generateBlock(out, index, 1);
+	if (index > 0) line(out, 1, "return f" + to_string(index - 1) + "(" + variable(0) + "v0, b) + " + expression(0) + ";");
+	else line(out, 1, "return " + expression(0) + ";");
+	line(out, 0, "}");
+	line(out, 0, "");
+}
+
+//-----------------------------------------------------------------------------
+// Nested while (odd levels) or if-else (even levels) with own locals
+//-----------------------------------------------------------------------------
+void ProgramGenerator::generateBlock(ostream& out, size_t index, size_t level) {
+	if (level > options.depth) return;
+	string counter = variable(level - 1) + "v0";
+	if (level % 2) line(out, level, "while (" + counter + " < " + to_string(level * 3) + ") {");
+	else line(out, level, "if (" + expression(level - 1) + " > " + counter + ") {");
+	string declaration = "int ";
+	for (size_t i = 0; i < options.locals; i++) declaration += (i ? ", " : "") + variable(level) + "v" + to_string(i);
+	line(out, level + 1, declaration + ";");
+	for (size_t i = 0; i < options.locals; i++) line(out, level + 1, variable(level) + "v" + to_string(i) + " = " + expression(level) + ";");
+	generateBlock(out, index, level + 1);
+	line(out, level + 1, counter + " = " + counter + " + 1;");
+	if (level % 2) line(out, level, "}");
+	else {
+		line(out, level, "} else {");
+		line(out, level + 1, counter + " = " + expression(level - 1) + ";");
+		line(out, level, "}");
+	}
+}
+
+//-----------------------------------------------------------------------------
+// Expression of variables visible at level, arguments and constants
+//-----------------------------------------------------------------------------
+string ProgramGenerator::expression(size_t level) {
+	string text;
+	for (size_t i = 0; i <= options.expression; i++) {
+		seed = seed * 1103515245 + 12345;
+		size_t r = (seed >> 16) & 0x7FFF;
+		if (i > 0) text += string(" ") + OPERATORS[r % OPERATORS_COUNT] + " ";
+		switch (r % 4) {
+		case 0: text += (r & 1) ? "a" : "b"; break;
+		case 1: text += to_string(r % 100 + 1); break;
+		default: text += variable(r % (level + 1)) + "v" + to_string(r % options.locals); break;
+		}
+	}
+	return text;
+}
+
+//-----------------------------------------------------------------------------
+// Locals name prefix of scope level
+//-----------------------------------------------------------------------------
+string ProgramGenerator::variable(size_t level) {
+	return "s" + to_string(level);
+}
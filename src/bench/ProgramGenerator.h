@@ -0,0 +1,47 @@
+/*============================================================================
+*
+*  Virtual Machine benchmark program generator header
+*
+*  Generates synthetic CVM programs of given shape for compiler scalability
+*  benchmarks: functions count, statements nesting depth, locals declared
+*  per scope and binary operators per expression. Every function calls
+*  previous one, so calls, symbols lookups and jumps grow with size.
+*  Programs are meant for compilation benchmarks, loops are not bounded.
+*
+*  (C) Bolat Basheyev 2021
+*
+============================================================================*/
+#pragma once
+
+#include <string>
+#include <ostream>
+
+namespace vm {
+
+	class GeneratorOptions {
+	public:
+		size_t functions = 64;                                // Functions count
+		size_t depth = 3;                                     // Nested while/if statements depth
+		size_t locals = 4;                                    // Locals declared per scope
+		size_t expression = 8;                                // Binary operators per expression
+	};
+
+
+	class ProgramGenerator {
+	public:
+		ProgramGenerator(const GeneratorOptions& options);
+		void generate(std::ostream& out);                     // Writes program source
+		std::string generate();                               // Returns program source
+		inline size_t getLinesCount() { return lines; };      // Lines of last generated program
+	private:
+		GeneratorOptions options;
+		size_t lines;
+		size_t seed;
+		void line(std::ostream& out, size_t indent, const std::string& text);
+		void generateFunction(std::ostream& out, size_t index);
+		void generateBlock(std::ostream& out, size_t index, size_t level);
+		std::string expression(size_t level);
+		std::string variable(size_t level);
+	};
+
+}
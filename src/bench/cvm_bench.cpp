@@ -0,0 +1,503 @@
+/*============================================================================
+*
+*  Virtual Machine benchmark harness
+*
+*  Runs benchmark programs (.cvm files of bench directory by default) and
+*  times compilation phases (lexing, parsing, code generation) and execution
+*  separately. Every program is run warmup times, then repeat times
+*  measured. Program output is discarded, input is empty.
+*
+*  Scale mode compiles generated programs of doubling functions count (up to
+*  --functions) and reports compile phases times and peak memory against
+*  program size, time per line should stay flat if compiler is linear.
+*  Every step runs in forked process, so its peak memory is its own.
+*
+*  Usage: cvm_bench [--warmup <n>] [--repeat <n>] [--json <file | ->]
+*                   [<filename.cvm | directory>...]
+*         cvm_bench --scale [<shape>] [--repeat <n>] [--json <file | ->]
+*         cvm_bench --generate <filename.cvm> [<shape>]
+*  Shape: [--functions <n>] [--depth <n>] [--locals <n>] [--expression <n>]
+*
+*  (C) Bolat Basheyev 2021
+*
+============================================================================*/
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <filesystem>
+#include <algorithm>
+#include <iomanip>
+#include <cmath>
+#include <chrono>
+#include <cstring>
+#include <vector>
+#include <string>
+
+#include "runtime/VirtualMachine.h"
+#include "compiler/SourceParser.h"
+#include "compiler/CodeGenerator.h"
+#include "ProgramGenerator.h"
+
+#ifndef _WIN32
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#endif
+
+using namespace std;
+using namespace vm;
+
+constexpr const char* BENCH_DIRECTORY = "bench";
+constexpr const char* SOURCE_FILE_EXTENSION = ".cvm";
+constexpr size_t PHASES_COUNT = 5;
+constexpr const char* PHASES[PHASES_COUNT] = { "lex", "parse", "codegen", "execute", "total" };
+constexpr size_t SCALE_START = 16;                // Functions count of first scale step
+constexpr size_t SCALE_FUNCTIONS = 8192;          // Default functions count of last scale step
+
+
+// Phase timings statistics in seconds
+class PhaseStats {
+public:
+	double min, median, p99, mean, max;
+};
+
+
+// Benchmark program results
+class BenchResult {
+public:
+	string name;
+	string file;
+	string status;
+	WORD result;
+	size_t codeSize;
+	vector<double> samples[PHASES_COUNT];
+	PhaseStats stats[PHASES_COUNT];
+};
+
+
+// Computes statistics of samples
+PhaseStats computeStats(vector<double> samples) {
+	PhaseStats stats = {};
+	if (samples.empty()) return stats;
+	sort(samples.begin(), samples.end());
+	size_t count = samples.size();
+	double total = 0;
+	for (double s : samples) total += s;
+	stats.min = samples.front();
+	stats.max = samples.back();
+	stats.mean = total / count;
+	stats.median = (count % 2) ? samples[count / 2] : (samples[count / 2 - 1] + samples[count / 2]) / 2;
+	stats.p99 = samples[min(count - 1, (size_t) ceil(count * 0.99) - 1)];
+	return stats;
+}
+
+
+// Compiles and runs program once, adds phases timings to result if measured
+bool runOnce(const string& source, BenchResult& result, bool measure) {
+	typedef chrono::steady_clock Clock;
+	ostream discard(nullptr);
+	auto input = make_shared<InputQueue>();
+	input->close();
+
+	SourceParser parser(source.c_str());
+	if (parser.getSyntaxTree() == NULL) {
+		result.status = "parser error";
+		return false;
+	}
+	auto parsed = Clock::now();
+	ExecutableImage image;
+	CodeGenerator generator;
+	if (!generator.generateCode(&image, &parser)) {
+		result.status = "code generator error";
+		return false;
+	}
+	auto generated = Clock::now();
+	VirtualMachine machine;
+	machine.setVerbose(false);
+	machine.setOutput(&discard);
+	machine.setInputQueue(input);
+	machine.loadImage(image);
+	auto loaded = Clock::now();
+	ExecutionStatus status = machine.execute();
+	auto executed = Clock::now();
+	if (status != ExecutionStatus::HALTED) {
+		result.status = "runtime error";
+		return false;
+	}
+
+	result.result = machine.getResult();
+	result.codeSize = image.getSize();
+	if (!measure) return true;
+	double lex = parser.getLexTime();
+	double parse = parser.getParseTime();
+	double codegen = chrono::duration<double>(generated - parsed).count();
+	double execute = chrono::duration<double>(executed - loaded).count();
+	double timings[PHASES_COUNT] = { lex, parse, codegen, execute, lex + parse + codegen + execute };
+	for (size_t i = 0; i < PHASES_COUNT; i++) result.samples[i].push_back(timings[i]);
+	return true;
+}
+
+
+// Runs benchmark program warmup and repeat times
+BenchResult runBenchmark(const string& file, unsigned warmup, unsigned repeat) {
+	BenchResult result;
+	result.file = file;
+	result.name = filesystem::path(file).stem().string();
+	result.status = "ok";
+	result.result = 0;
+	result.codeSize = 0;
+	ifstream stream(file, ios::in | ios::binary);
+	if (!stream.is_open()) {
+		result.status = "can not open file";
+		return result;
+	}
+	stringstream text;
+	text << stream.rdbuf();
+	string source = text.str();
+	for (unsigned i = 0; i < warmup + repeat; i++) {
+		if (!runOnce(source, result, i >= warmup)) return result;
+	}
+	for (size_t i = 0; i < PHASES_COUNT; i++) result.stats[i] = computeStats(result.samples[i]);
+	return result;
+}
+
+
+// Escapes string for JSON
+string jsonString(const string& value) {
+	string escaped = "\"";
+	for (char c : value) {
+		if (c == '"' || c == '\\') escaped += '\\';
+		if ((unsigned char) c < 0x20) escaped += ' ';
+		else escaped += c;
+	}
+	return escaped + "\"";
+}
+
+
+// Prints results as JSON document
+void printJson(ostream& out, vector<BenchResult>& results, unsigned warmup, unsigned repeat) {
+	out.precision(9);
+	out << "{" << endl;
+	out << "  \"warmup\": " << warmup << "," << endl;
+	out << "  \"repeat\": " << repeat << "," << endl;
+	out << "  \"benchmarks\": [" << endl;
+	for (size_t i = 0; i < results.size(); i++) {
+		BenchResult& r = results[i];
+		out << "    {" << endl;
+		out << "      \"name\": " << jsonString(r.name) << "," << endl;
+		out << "      \"file\": " << jsonString(r.file) << "," << endl;
+		out << "      \"status\": " << jsonString(r.status) << "," << endl;
+		out << "      \"result\": " << r.result << "," << endl;
+		out << "      \"codeSize\": " << r.codeSize << "," << endl;
+		out << "      \"phases\": {" << endl;
+		for (size_t p = 0; p < PHASES_COUNT; p++) {
+			PhaseStats& s = r.stats[p];
+			out << "        " << jsonString(PHASES[p]) << ": { ";
+			out << "\"min\": " << s.min << ", \"median\": " << s.median << ", \"p99\": " << s.p99;
+			out << ", \"mean\": " << s.mean << ", \"max\": " << s.max << " }";
+			out << (p + 1 < PHASES_COUNT ? "," : "") << endl;
+		}
+		out << "      }" << endl;
+		out << "    }" << (i + 1 < results.size() ? "," : "") << endl;
+	}
+	out << "  ]" << endl;
+	out << "}" << endl;
+}
+
+
+// Prints results table (medians and p99 in milliseconds)
+void printTable(ostream& out, vector<BenchResult>& results) {
+	out << left << setw(16) << "benchmark";
+	for (size_t p = 0; p < PHASES_COUNT; p++) out << right << setw(20) << string(PHASES[p]) + " med/p99";
+	out << endl;
+	out << fixed << setprecision(3);
+	for (BenchResult& r : results) {
+		out << left << setw(16) << r.name;
+		if (r.status != "ok") {
+			out << r.status << endl;
+			continue;
+		}
+		for (size_t p = 0; p < PHASES_COUNT; p++) {
+			ostringstream cell;
+			cell << fixed << setprecision(3) << r.stats[p].median * 1000 << "/" << r.stats[p].p99 * 1000;
+			out << right << setw(20) << cell.str();
+		}
+		out << endl;
+	}
+	out << "(milliseconds)" << endl;
+}
+
+
+// Compiler scalability step results
+class ScaleResult {
+public:
+	size_t functions;
+	size_t lines;
+	size_t bytes;
+	double lex, parse, codegen, total;  // Median seconds
+	size_t peakMemory;                  // Step peak resident memory in bytes
+	bool ok;
+};
+
+
+// Returns process peak resident memory in bytes (0 if not supported)
+size_t getPeakMemory() {
+#ifndef _WIN32
+	struct rusage usage;
+	if (getrusage(RUSAGE_SELF, &usage) != 0) return 0;
+#ifdef __APPLE__
+	return (size_t) usage.ru_maxrss;
+#else
+	return (size_t) usage.ru_maxrss * 1024;
+#endif
+#else
+	return 0;
+#endif
+}
+
+
+// Returns process resident memory in bytes (0 if not supported)
+size_t getResidentMemory() {
+#ifdef __linux__
+	ifstream statm("/proc/self/statm");
+	size_t pages = 0, resident = 0;
+	if (!(statm >> pages >> resident)) return 0;
+	return resident * (size_t) sysconf(_SC_PAGESIZE);
+#else
+	return 0;
+#endif
+}
+
+
+// Compiles generated program repeat times (peak memory is process peak)
+ScaleResult measureScaleStep(GeneratorOptions& options, unsigned repeat) {
+	typedef chrono::steady_clock Clock;
+	ProgramGenerator generator(options);
+	string source = generator.generate();
+	ScaleResult result = {};
+	result.functions = options.functions;
+	result.lines = generator.getLinesCount();
+	result.bytes = source.size();
+	result.ok = true;
+	vector<double> samples[4];
+	for (unsigned i = 0; i < repeat && result.ok; i++) {
+		SourceParser parser(source.c_str());
+		if (parser.getSyntaxTree() == NULL) {
+			result.ok = false;
+			break;
+		}
+		ExecutableImage image;
+		CodeGenerator codeGenerator;
+		auto start = Clock::now();
+		result.ok = codeGenerator.generateCode(&image, &parser);
+		double codegen = chrono::duration<double>(Clock::now() - start).count();
+		samples[0].push_back(parser.getLexTime());
+		samples[1].push_back(parser.getParseTime());
+		samples[2].push_back(codegen);
+		samples[3].push_back(parser.getLexTime() + parser.getParseTime() + codegen);
+	}
+	result.lex = computeStats(samples[0]).median;
+	result.parse = computeStats(samples[1]).median;
+	result.codegen = computeStats(samples[2]).median;
+	result.total = computeStats(samples[3]).median;
+	result.peakMemory = getPeakMemory();
+	return result;
+}
+
+
+// Runs step in forked child process, so step peak memory is not peak of
+// earlier steps: child peak resident memory above its resident memory at
+// start (pages shared with parent are not counted). Without fork step
+// runs in process and process peak memory is reported
+ScaleResult runScaleStep(GeneratorOptions& options, unsigned repeat) {
+#ifndef _WIN32
+	int fds[2];
+	if (pipe(fds) == 0) {
+		cout.flush();
+		pid_t child = fork();
+		if (child == 0) {
+			close(fds[0]);
+			size_t start = getResidentMemory();
+			ScaleResult result = measureScaleStep(options, repeat);
+			result.peakMemory = result.peakMemory > start ? result.peakMemory - start : 0;
+			bool sent = write(fds[1], &result, sizeof(result)) == (ssize_t) sizeof(result);
+			_exit(sent ? 0 : 1);
+		}
+		close(fds[1]);
+		ScaleResult result;
+		bool received = child > 0 && read(fds[0], &result, sizeof(result)) == (ssize_t) sizeof(result);
+		close(fds[0]);
+		if (child > 0) waitpid(child, NULL, 0);
+		if (received) return result;
+	}
+#endif
+	return measureScaleStep(options, repeat);
+}
+
+
+// Prints scalability results as JSON document
+void printScaleJson(ostream& out, vector<ScaleResult>& results, GeneratorOptions& options, unsigned repeat) {
+	out.precision(9);
+	out << "{" << endl;
+	out << "  \"repeat\": " << repeat << "," << endl;
+	out << "  \"depth\": " << options.depth << "," << endl;
+	out << "  \"locals\": " << options.locals << "," << endl;
+	out << "  \"expression\": " << options.expression << "," << endl;
+	out << "  \"steps\": [" << endl;
+	for (size_t i = 0; i < results.size(); i++) {
+		ScaleResult& r = results[i];
+		out << "    { \"functions\": " << r.functions << ", \"lines\": " << r.lines << ", \"bytes\": " << r.bytes;
+		out << ", \"ok\": " << (r.ok ? "true" : "false");
+		out << ", \"lex\": " << r.lex << ", \"parse\": " << r.parse << ", \"codegen\": " << r.codegen;
+		out << ", \"total\": " << r.total << ", \"peakMemory\": " << r.peakMemory << " }";
+		out << (i + 1 < results.size() ? "," : "") << endl;
+	}
+	out << "  ]" << endl;
+	out << "}" << endl;
+}
+
+
+// Prints scalability table, time per line of largest and smallest steps
+void printScaleTable(ostream& out, vector<ScaleResult>& results) {
+	out << right << setw(10) << "functions" << setw(10) << "lines" << setw(12) << "lex ms";
+	out << setw(12) << "parse ms" << setw(12) << "codegen ms" << setw(12) << "total ms";
+	out << setw(12) << "ns/line" << setw(12) << "peak MB" << endl;
+	for (ScaleResult& r : results) {
+		out << setw(10) << r.functions << setw(10) << r.lines;
+		if (!r.ok) {
+			out << "  compilation error" << endl;
+			continue;
+		}
+		out << fixed << setprecision(3);
+		out << setw(12) << r.lex * 1000 << setw(12) << r.parse * 1000 << setw(12) << r.codegen * 1000;
+		out << setw(12) << r.total * 1000 << setprecision(1) << setw(12) << r.total * 1e9 / r.lines;
+		out << setw(12) << r.peakMemory / 1048576.0 << endl;
+	}
+	if (results.size() > 1 && results.front().ok && results.back().ok) {
+		double first = results.front().total / results.front().lines;
+		double last = results.back().total / results.back().lines;
+		out << setprecision(2) << "Time per line growth: " << last / first << "x over ";
+		out << (double) results.back().lines / results.front().lines << "x lines (1.00x - linear)" << endl;
+	}
+}
+
+
+// Compiles generated programs of doubling size
+int runScale(GeneratorOptions options, unsigned repeat, string jsonPath) {
+	size_t maxFunctions = options.functions;
+	vector<ScaleResult> results;
+	for (size_t functions = min(SCALE_START, maxFunctions); ; functions = min(functions * 2, maxFunctions)) {
+		options.functions = functions;
+		results.push_back(runScaleStep(options, repeat));
+		if (jsonPath != "-") {
+			ScaleResult& r = results.back();
+			cerr << "\r" << r.functions << " functions, " << r.lines << " lines compiled" << flush;
+		}
+		if (functions >= maxFunctions) break;
+	}
+	if (jsonPath != "-") cerr << endl;
+	if (jsonPath == "-") printScaleJson(cout, results, options, repeat);
+	else {
+		printScaleTable(cout, results);
+		if (!jsonPath.empty()) {
+			ofstream json(jsonPath, ios::out | ios::trunc);
+			if (json.is_open()) printScaleJson(json, results, options, repeat);
+			else cout << "Can not write: " << jsonPath << endl;
+		}
+	}
+	for (ScaleResult& r : results) if (!r.ok) return 1;
+	return 0;
+}
+
+
+// Prints command line usage
+void printUsage() {
+	puts("Usage: cvm_bench [--warmup <n>] [--repeat <n>] [--json <file | ->] [<filename.cvm | directory>...]");
+	puts("       cvm_bench --scale [<shape>] [--repeat <n>] [--json <file | ->]");
+	puts("       cvm_bench --generate <filename.cvm> [<shape>]");
+	puts("Shape: [--functions <n>] [--depth <n>] [--locals <n>] [--expression <n>]");
+}
+
+
+int main(int argc, char* argv[]) {
+	unsigned warmup = 2;
+	int repeat = 0;
+	bool scale = false;
+	string generatePath;
+	string jsonPath;
+	vector<string> paths;
+	GeneratorOptions options;
+	options.functions = 0;
+	for (int i = 1; i < argc; i++) {
+		if (strcmp(argv[i], "--warmup") == 0 && i + 1 < argc) warmup = atoi(argv[++i]);
+		else if (strcmp(argv[i], "--repeat") == 0 && i + 1 < argc) repeat = max(1, atoi(argv[++i]));
+		else if (strcmp(argv[i], "--json") == 0 && i + 1 < argc) jsonPath = argv[++i];
+		else if (strcmp(argv[i], "--scale") == 0) scale = true;
+		else if (strcmp(argv[i], "--generate") == 0 && i + 1 < argc) generatePath = argv[++i];
+		else if (strcmp(argv[i], "--functions") == 0 && i + 1 < argc) options.functions = atoll(argv[++i]);
+		else if (strcmp(argv[i], "--depth") == 0 && i + 1 < argc) options.depth = atoll(argv[++i]);
+		else if (strcmp(argv[i], "--locals") == 0 && i + 1 < argc) options.locals = atoll(argv[++i]);
+		else if (strcmp(argv[i], "--expression") == 0 && i + 1 < argc) options.expression = atoll(argv[++i]);
+		else if (strncmp(argv[i], "--", 2) == 0) {
+			if (strcmp(argv[i], "--help") != 0) cout << "Unknown option or missing value: " << argv[i] << endl;
+			printUsage();
+			return strcmp(argv[i], "--help") == 0 ? 0 : 1;
+		}
+		else paths.push_back(argv[i]);
+	}
+
+	if (!generatePath.empty()) {
+		if (options.functions == 0) options.functions = GeneratorOptions().functions;
+		ofstream out(generatePath, ios::out | ios::trunc);
+		if (!out.is_open()) {
+			cout << "Can not write: " << generatePath << endl;
+			return 1;
+		}
+		ProgramGenerator generator(options);
+		generator.generate(out);
+		cout << "Generated " << generator.getLinesCount() << " lines: " << generatePath << endl;
+		return 0;
+	}
+	if (scale) {
+		if (options.functions == 0) options.functions = SCALE_FUNCTIONS;
+		return runScale(options, repeat ? repeat : 3, jsonPath);
+	}
+	if (repeat == 0) repeat = 10;
+	if (paths.empty()) paths.push_back(BENCH_DIRECTORY);
+
+	// directories are expanded to their programs in name order
+	vector<string> files;
+	for (string& path : paths) {
+		if (!filesystem::is_directory(path)) {
+			files.push_back(path);
+			continue;
+		}
+		vector<string> programs;
+		for (auto& entry : filesystem::directory_iterator(path)) {
+			if (entry.path().extension() == SOURCE_FILE_EXTENSION) programs.push_back(entry.path().string());
+		}
+		sort(programs.begin(), programs.end());
+		files.insert(files.end(), programs.begin(), programs.end());
+	}
+	if (files.empty()) {
+		puts("No benchmark programs found.");
+		printUsage();
+		return 1;
+	}
+
+	vector<BenchResult> results;
+	for (string& file : files) results.push_back(runBenchmark(file, warmup, repeat));
+
+	bool failed = false;
+	for (BenchResult& r : results) failed |= (r.status != "ok");
+	if (jsonPath == "-") printJson(cout, results, warmup, repeat);
+	else {
+		printTable(cout, results);
+		if (!jsonPath.empty()) {
+			ofstream json(jsonPath, ios::out | ios::trunc);
+			if (json.is_open()) printJson(json, results, warmup, repeat);
+			else cout << "Can not write: " << jsonPath << endl;
+		}
+	}
+	return failed ? 1 : 0;
+}
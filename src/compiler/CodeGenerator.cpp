@@ -33,11 +33,19 @@ CodeGenerator::~CodeGenerator() {
 bool CodeGenerator::generateCode(ExecutableImage* img, TreeNode* rootNode) {
     try {
         img->clear();                        // clear executable image
+        linkedRelocations = 0;               // reset relocations and reuse counters
+        reusedCount = 0;
+        globals = rootNode->getSymbolTable();
+        functionOrdinals.clear();
+        for (size_t i = 0; i < globals->getSymbolsCount(); i++) {
+            Symbol* symbol = globals->getSymbolAt(i);
+            functionOrdinals[symbol->name] = symbol->localIndex;
+        }
         img->setEmitAddress(4);              // reserve 4 memory cells to call main() entry point
         emitModule(img, rootNode);           // emit module code starting from address [4]
+        linkRelocations(img);                // replace function ordinals with addresses
         // Lookup entry point address
-        SymbolTable* global = rootNode->getSymbolTable();
-        Symbol* main = global->lookupSymbol("main", SymbolType::FUNCTION);
+        Symbol* main = globals->lookupSymbol("main", SymbolType::FUNCTION);
         if (main == NULL || main->argCount != 0) {
             raiseError("No entry point found - int main() function missing.");
         } else {
@@ -55,19 +63,155 @@ bool CodeGenerator::generateCode(ExecutableImage* img, TreeNode* rootNode) {
 }
 
 
+bool CodeGenerator::generateCode(ExecutableImage* img, SourceParser* parser) {
+    this->parser = parser;
+    return generateCode(img, parser->getSyntaxTree());
+}
+
+
+//-----------------------------------------------------------------------------
+// Parses and emits lazily skipped function body at the end of image
+// Returns compiled function address or -1 if compilation failed
+//-----------------------------------------------------------------------------
+WORD CodeGenerator::resolveStub(ExecutableImage* img, WORD index) {
+    try {
+        if (parser == NULL || index < 0 || index >= (WORD) parser->getFunctionCount()) {
+            raiseError("Unknown function stub.");
+        }
+        FunctionSource& source = parser->getFunction(index);
+        Symbol* symbol = source.scope->lookupSymbol(source.function->getToken());
+        WORD stubAddress = symbol->address;
+        if (img->readWord(stubAddress) != OP_TRAP) return stubAddress;
+        if (parser->parseFunctionBody(index) == NULL) raiseError("Can not parse function body.");
+        img->setEmitAddress(img->getSize());
+        emitFunction(img, source.function, source.fingerprint);
+        linkRelocations(img);
+        // patch stub to jump to compiled function (relative to jump operand)
+        img->writeWord(stubAddress, OP_JMP);
+        img->writeWord(stubAddress + 1, symbol->address - stubAddress - 1);
+        return symbol->address;
+    } catch (CodeGeneratorException& e) {
+        cout << "CODE GENERATION ERROR: ";
+        cout << e.error << endl;
+    }
+    return -1;
+}
+
+
+//-----------------------------------------------------------------------------
+// Sets previously generated image which unchanged functions code is reused
+//-----------------------------------------------------------------------------
+void CodeGenerator::setPreviousImage(ExecutableImage* previous) {
+    this->previous = previous;
+    previousFunctions.clear();
+    previousAddresses.clear();
+    if (previous == NULL) return;
+    for (size_t i = 0; i < previous->getSymbolCount(); i++) {
+        ImageSymbol& symbol = previous->getSymbol(i);
+        previousFunctions[symbol.name] = i;
+        previousAddresses[symbol.address] = i;
+    }
+}
+
+
 void CodeGenerator::emitModule(ExecutableImage* img, TreeNode* rootNode) {
+    WORD functionIndex = 0;
     for (int i = 0; i < rootNode->getChildCount(); i++) {
         TreeNode* node = rootNode->getChild(i);
         if (node->getType() == TreeNodeType::FUNCTION) {
-            // emit function code
-            emitFunction(img, node);
+            uint64_t fingerprint = 0;
+            if (parser != NULL) fingerprint = parser->getFunction(functionIndex).fingerprint;
+            // reuse unchanged function code from previous image
+            if (reuseFunction(img, node, fingerprint)) {
+                functionIndex++;
+                continue;
+            }
+            // changed functions are compiled right away in incremental build
+            if (node->getChildCount() <= 2 && previous != NULL) {
+                if (parser->parseFunctionBody(functionIndex) == NULL) {
+                    raiseError("Can not parse function body.");
+                }
+            }
+            // emit function code or stub if function body is not parsed yet
+            if (node->getChildCount() > 2) emitFunction(img, node, fingerprint);
+            else emitStub(img, node, functionIndex);
+            functionIndex++;
+        }
+    }
+}
+
+
+//-----------------------------------------------------------------------------
+// Copies function code from previous image if its fingerprint is the same
+// (call targets are converted back to function ordinals for relinking)
+//-----------------------------------------------------------------------------
+bool CodeGenerator::reuseFunction(ExecutableImage* img, TreeNode* node, uint64_t fingerprint) {
+    if (previous == NULL || fingerprint == 0) return false;
+    Symbol* symbol = node->getSymbolTable()->lookupSymbol(node->getToken());
+    auto entry = previousFunctions.find(symbol->name);
+    if (entry == previousFunctions.end()) return false;
+    ImageSymbol& old = previous->getSymbol(entry->second);
+    if (old.fingerprint != fingerprint || old.size <= 0) return false;
+
+    ExecutableImage funCode;
+    funCode.writeData(0, previous->getImage() + old.address, old.size * sizeof(WORD));
+    for (WORD offset : old.relocations) {
+        auto callee = previousAddresses.find(funCode.readWord(offset));
+        if (callee == previousAddresses.end()) return false;
+        auto ordinal = functionOrdinals.find(previous->getSymbol(callee->second).name);
+        if (ordinal == functionOrdinals.end()) return false;
+        funCode.writeWord(offset, ordinal->second);
+        funCode.addRelocation(offset);
+    }
+    // source lines are shifted as much as function declaration moved
+    const LineEntry* first = previous->findLine(old.address);
+    if (first != NULL && first->address == old.address) {
+        WORD shift = node->getToken().row - first->row;
+        for (LineEntry& line : previous->getLines()) {
+            if (line.address < old.address || line.address >= old.address + old.size) continue;
+            funCode.addLine(line.address - old.address, line.row + shift, line.col);
         }
     }
+
+    symbol->address = img->getEmitAddress();
+    img->emit(funCode);
+    ImageSymbol& imageSymbol = img->addSymbol(symbol->name, symbol->address, symbol->argCount);
+    imageSymbol.size = old.size;
+    imageSymbol.fingerprint = fingerprint;
+    imageSymbol.relocations = old.relocations;
+    reusedCount++;
+    return true;
+}
+
+
+void CodeGenerator::emitStub(ExecutableImage* img, TreeNode* node, WORD index) {
+    if (parser == NULL) raiseError("Function body is not parsed.");
+    // function address points to stub which traps into compiler on first call
+    Symbol* symbol = node->getSymbolTable()->lookupSymbol(node->getToken());
+    symbol->address = img->getEmitAddress();
+    img->addSymbol(symbol->name, symbol->address, symbol->argCount).size = 2;
+    img->emit(OP_TRAP, index);
+}
+
+
+//-----------------------------------------------------------------------------
+// Replaces function ordinals at not yet linked relocations with addresses
+//-----------------------------------------------------------------------------
+void CodeGenerator::linkRelocations(ExecutableImage* img) {
+    vector<WORD>& relocations = img->getRelocations();
+    for (; linkedRelocations < relocations.size(); linkedRelocations++) {
+        WORD address = relocations[linkedRelocations];
+        WORD ordinal = img->readWord(address);
+        if (ordinal < 0 || ordinal >= (WORD) globals->getSymbolsCount()) raiseError("Unknown function relocation.");
+        Symbol* func = globals->getSymbolAt(ordinal);
+        if (func->type != SymbolType::FUNCTION) raiseError("Relocation target is not a function.");
+        img->writeWord(address, func->address);
+    }
 }
 
 
  
-void CodeGenerator::emitFunction(ExecutableImage* img, TreeNode* node) {
+void CodeGenerator::emitFunction(ExecutableImage* img, TreeNode* node, uint64_t fingerprint) {
     // set function address in symbols table
     Token tkn = node->getToken();
     Symbol* symbol = node->getSymbolTable()->lookupSymbol(tkn);
@@ -79,6 +223,7 @@ void CodeGenerator::emitFunction(ExecutableImage* img, TreeNode* node) {
     ExecutableImage funCode;
 
     // elevate all variable declaration to the function beginning
+    funCode.addLine(tkn.row, tkn.col);
     emitDeclaration(&funCode, body);
 
     emitBlock(&funCode, body);
@@ -89,17 +234,28 @@ void CodeGenerator::emitFunction(ExecutableImage* img, TreeNode* node) {
     } else funCode.emit(OP_RET);
     img->emit(funCode);
 
+    // function code range and call relocations allow reusing it in next build
+    ImageSymbol& imageSymbol = img->addSymbol(symbol->name, symbol->address, symbol->argCount);
+    imageSymbol.size = funCode.getSize();
+    imageSymbol.fingerprint = fingerprint;
+    imageSymbol.relocations = funCode.getRelocations();
+
 }
 
 
 
 void CodeGenerator::emitStatement(ExecutableImage* img, TreeNode* statement) {
+    // line table maps statement code to its first token position
+    TreeNodeType type = statement->getType();
+    if (type != TreeNodeType::TYPE && type != TreeNodeType::BLOCK) {
+        img->addLine(statement->getToken().row, statement->getToken().col);
+    }
     switch (statement->getType()) {
     case TreeNodeType::TYPE:       break; // skip because already emitted
     case TreeNodeType::ASSIGNMENT: emitAssignment(img, statement); break;
     case TreeNodeType::IF_ELSE:    emitIfElse(img, statement); break;
     case TreeNodeType::WHILE:      emitWhile(img, statement); break;
-    case TreeNodeType::CALL:       emitCall(img, statement); break;
+    case TreeNodeType::CALL:       emitCallStatement(img, statement); break;
     case TreeNodeType::BLOCK:      emitBlock(img, statement); break;
     case TreeNodeType::RETURN:     emitReturn(img, statement); break;
     case TreeNodeType::BREAK:      emitBreak(img, statement); break;
@@ -150,18 +306,29 @@ void CodeGenerator::emitCall(ExecutableImage* img, TreeNode* node) {
         emitExpression(img, node->getChild(i));
     }
         
-    // todo make proper system call labeling in syntax tree
     // system function
-    if (funcToken.length == 4 && strncmp(funcToken.text, "iput", 4) == 0) img->emit(OP_SYSCALL, 0x21); else
-    if (funcToken.length == 4 && strncmp(funcToken.text, "iget", 4) == 0) img->emit(OP_SYSCALL, 0x22); 
-    else {
+    const SystemFunction* system = lookupSystemFunction(funcToken);
+    if (system != NULL) {
+        if (system->opcode == OP_SYSCALL) img->emit(OP_SYSCALL, system->sysCall);
+        else img->emit(system->opcode);
+    } else {
         // user function
-        WORD funcAddress = func->address;
-        img->emit(OP_CALL, funcAddress, (WORD) node->getChildCount());
+        // call target is function ordinal replaced with address while linking
+        WORD callAddress = img->emit(OP_CALL, func->localIndex, (WORD) node->getChildCount());
+        img->addRelocation(callAddress + 1);
     }
 }
 
 
+void CodeGenerator::emitCallStatement(ExecutableImage* img, TreeNode* node) {
+    // drop unused function result, so calls in loops do not grow the stack
+    emitCall(img, node);
+    Token funcToken = node->getToken();
+    const SystemFunction* system = lookupSystemFunction(funcToken);
+    if (system == NULL || system->returnsValue) img->emit(OP_DROP);
+}
+
+
 void CodeGenerator::emitIfElse(ExecutableImage* img, TreeNode* node) {
     TreeNode* condition = node->getChild(0);
     TreeNode* thenBlock = node->getChild(1);
@@ -227,6 +394,7 @@ void CodeGenerator::emitWhile(ExecutableImage* img, TreeNode* node) {
     // calculate relative offset to beginning of condition expression 
     WORD jumpBackOffset = -(whileCode.getSize() + conditionCode.getSize() + JUMP_OFFSET + 1);
     // Emit unconditional jump to 
+    img->addLine(node->getToken().row, node->getToken().col);
     img->emit(OP_JMP, jumpBackOffset);      
 }
 
@@ -302,11 +470,28 @@ void CodeGenerator::emitSymbol(ExecutableImage* img, TreeNode* node) {
     if (entry != NULL) {
         if (entry->type == SymbolType::ARGUMENT) img->emit(OP_ARG, entry->localIndex);
         else if (entry->type == SymbolType::VARIABLE) img->emit(OP_LOAD, entry->localIndex);
+        else if (entry->type == SymbolType::FUNCTION) {
+            // function address is function ordinal replaced with address while linking
+            if (lookupSystemFunction(token) != NULL) raiseError("System function has no address.");
+            WORD constAddress = img->emit(OP_CONST, entry->localIndex);
+            img->addRelocation(constAddress + 1);
+        }
         else raiseError("Variable or argument expected.");
     } else raiseError("Symbol not declared.");
 }
 
 
+const SystemFunction* CodeGenerator::lookupSystemFunction(Token& token) {
+    for (int i = 0; i < SYSTEM_FUNCTIONS_COUNT; i++) {
+        const SystemFunction& function = SYSTEM_FUNCTIONS[i];
+        if (strlen(function.name) == (size_t) token.length && strncmp(token.text, function.name, token.length) == 0) {
+            return &function;
+        }
+    }
+    return NULL;
+}
+
+
 WORD CodeGenerator::emitOpcode(ExecutableImage* img, Token& token) {
     switch (token.type) {
     case TokenType::PLUS:      img->emit(OP_ADD);     break;
@@ -7,14 +7,37 @@
 ============================================================================*/
 #include <filesystem>
 #include <fstream>
+#include <iostream>
+#include <cstring>
 
 #include "compiler/SourceFile.h"
+#include "runtime/ImageFile.h"
 
 using namespace std;
 using namespace vm;
 
+//-----------------------------------------------------------------------------
+// Opens source file: maps it to memory if mapping is NULL terminated
+// (file size is not page aligned), otherwise reads it to memory buffer.
+// Filename "-" opens standard input as stream of chunks.
+//-----------------------------------------------------------------------------
 SourceFile::SourceFile(const char* filename) {
 	data = NULL;
+	mapping = NULL;
+	stream = NULL;
+	chunkIndex = 0;
+	if (strcmp(filename, "-") == 0) {
+		stream = &cin;
+		return;
+	}
+	mapping = new MappedFile(filename);
+	if (mapping->isOpen() && mapping->getSize() % MappedFile::getPageSize() != 0) {
+		// bytes after end of file up to page boundary are zero filled
+		data = mapping->getData();
+		return;
+	}
+	delete mapping;
+	mapping = NULL;
 	ios_base::openmode openmode = ios::ate | ios::in | ios::binary;
 	ifstream file(filename, openmode);
 	if (file.is_open()) {
@@ -30,12 +53,82 @@ SourceFile::SourceFile(const char* filename) {
 }
 
 SourceFile::~SourceFile() {
-	if (data != NULL) {
+	for (char* chunk : chunks) delete[] chunk;
+	chunks.clear();
+	if (mapping != NULL) {
+		delete mapping;
+		mapping = NULL;
+	} else if (data != NULL) {
 		delete[] data;
-		data = NULL;
 	}
+	data = NULL;
+}
+
+bool SourceFile::isOpen() {
+	return data != NULL || stream != NULL;
 }
 
+//-----------------------------------------------------------------------------
+// Returns whole source code (NULL for streamed input)
+//-----------------------------------------------------------------------------
 char* SourceFile::getData() {
 	return data;
 }
+
+//-----------------------------------------------------------------------------
+// Returns next NULL terminated chunk of source code or NULL at the end.
+// Streamed chunks end at line boundary, so no token spans two chunks.
+// Chunks stay allocated until source file is destroyed (tokens point into
+// them), so streaming bounds size of one allocation, not memory in total.
+//-----------------------------------------------------------------------------
+char* SourceFile::nextChunk() {
+	if (stream == NULL) return chunkIndex++ == 0 ? data : NULL;
+	if (chunkIndex < chunks.size()) return chunks[chunkIndex++];
+	if (tail.empty() && !stream->good()) return NULL;
+	size_t capacity = tail.size() + SOURCE_CHUNK_SIZE;
+	char* chunk = new char[capacity + 1];
+	size_t size = tail.size();
+	memcpy(chunk, tail.data(), size);
+	tail.clear();
+	while (stream->good()) {
+		if (size == capacity) {
+			// line is longer than chunk - grow chunk buffer
+			char* larger = new char[capacity * 2 + 1];
+			memcpy(larger, chunk, size);
+			delete[] chunk;
+			chunk = larger;
+			capacity *= 2;
+		}
+		stream->read(chunk + size, capacity - size);
+		size_t count = (size_t) stream->gcount();
+		char* lastNewLine = NULL;
+		for (size_t i = size + count; i > size; i--) {
+			if (chunk[i - 1] == '\n') { lastNewLine = chunk + i - 1; break; }
+		}
+		size += count;
+		if (lastNewLine != NULL) {
+			// carry incomplete last line over to the next chunk
+			char* end = lastNewLine + 1;
+			tail.assign(end, chunk + size - end);
+			size = end - chunk;
+			break;
+		}
+	}
+	chunk[size] = 0;
+	chunks.push_back(chunk);
+	chunkIndex++;
+	return chunk;
+}
+
+//-----------------------------------------------------------------------------
+// Returns source code hash (streamed input is read to the end and
+// chunks are returned again from the beginning)
+//-----------------------------------------------------------------------------
+uint64_t SourceFile::getHash() {
+	uint64_t hash = HASH_SEED;
+	char* chunk;
+	chunkIndex = 0;
+	while ((chunk = nextChunk()) != NULL) hash = hashData(chunk, strlen(chunk), hash);
+	chunkIndex = 0;
+	return hash;
+}
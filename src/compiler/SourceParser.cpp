@@ -16,11 +16,9 @@
 *  <while>       ::= 'while' '(' <condition> ')' <statement>
 *  <jump>        ::= 'return' <expression> ';' | 'break' ';'
 *  <assign>      ::= <identifier> = <expression> ';'
-*  <logical>     ::= <comparison> {( && | '||') <comparison>}
-*  <comparison>  ::= <expression> {( == | != | > | >= | < | <= ) <expression>}
-*  <expression>  ::= <term> {(+|-) <term>}
-*  <term>        ::= <bitwise> {(*|/) <bitwise>}
-*  <bitwise>     ::= <factor> {( & | '|' | ^ | << | >> ) <factor>}
+*  <expression>  ::= <factor> {<binary-op> <factor>}
+*  <binary-op>   ::= '||' | && | '|' | ^ | & | == | != | > | >= | < | <= | << | >> | + | - | * | /
+*                    (C-like precedence from lowest to highest, see OPERATORS table)
 *  <factor>      ::= ({~|!|-|+} <number>) | <identifer> | <call>
 *
 *
@@ -28,30 +26,51 @@
 *
 ============================================================================*/
 #include <iostream>
+#include <chrono>
 #include "compiler/SourceParser.h"
+#include "runtime/ImageFile.h"
 
 using namespace vm;
 
 //-----------------------------------------------------------------------------
 // Constructor - builds source code abstract syntax tree
+// In lazy mode function bodies are only pre-scanned and parsed on demand
 //-----------------------------------------------------------------------------
-SourceParser::SourceParser(const char* sourceCode) {
+SourceParser::SourceParser(const char* sourceCode, bool lazy) {
+    this->lazy = lazy;
     try {
+        auto start = std::chrono::steady_clock::now();
         parseToTokens(sourceCode);
+        auto lexed = std::chrono::steady_clock::now();
         buildSyntaxTree();
+        lexTime = std::chrono::duration<double>(lexed - start).count();
+        parseTime = std::chrono::duration<double>(std::chrono::steady_clock::now() - lexed).count();
     }
     catch (ParserException e) {
-        TokenType type = e.token.type;
-        cout << "PARSER EXCEPTION: " << e.msg << endl;
-        cout << "Token at row=" << e.token.row << " col=" << e.token.col;
-        if (type == TokenType::IDENTIFIER || 
-            type == TokenType::CONST_INTEGER || 
-            type == TokenType::CONST_STRING) {
-            cout << " '";
-            cout.write(e.token.text, e.token.length);
-            cout << "'" << endl;
+        printError(e);
+    }
+}
+
+
+//-----------------------------------------------------------------------------
+// Constructor - tokenizes source file chunk by chunk and builds syntax tree
+//-----------------------------------------------------------------------------
+SourceParser::SourceParser(SourceFile& source, bool lazy) {
+    this->lazy = lazy;
+    try {
+        char* chunk;
+        int row = 1;
+        auto start = std::chrono::steady_clock::now();
+        while ((chunk = source.nextChunk()) != NULL) {
+            row = parseToTokens(chunk, row);
         }
-        else cout << "  '" << TOKEN_TYPE_MNEMONIC[(int)type] << "'" << endl;
+        auto lexed = std::chrono::steady_clock::now();
+        buildSyntaxTree();
+        lexTime = std::chrono::duration<double>(lexed - start).count();
+        parseTime = std::chrono::duration<double>(std::chrono::steady_clock::now() - lexed).count();
+    }
+    catch (ParserException e) {
+        printError(e);
     }
 }
 
@@ -65,13 +84,49 @@ SourceParser::~SourceParser() {
 
 
 //-----------------------------------------------------------------------------
-// Parses source code to tokens
+// Prints parser exception message and token position
 //-----------------------------------------------------------------------------
-void SourceParser::parseToTokens(const char* sourceCode) {
+void SourceParser::printError(ParserException& e) {
+    TokenType type = e.token.type;
+    cout << "PARSER EXCEPTION: " << e.msg << endl;
+    cout << "Token at row=" << e.token.row << " col=" << e.token.col;
+    if (type == TokenType::IDENTIFIER ||
+        type == TokenType::CONST_INTEGER ||
+        type == TokenType::CONST_STRING) {
+        cout << " '";
+        cout.write(e.token.text, e.token.length);
+        cout << "'" << endl;
+    }
+    else cout << "  '" << TOKEN_TYPE_MNEMONIC[(int)type] << "'" << endl;
+}
+
+
+//-----------------------------------------------------------------------------
+// Parses lazily skipped function body (returns NULL on syntax error)
+//-----------------------------------------------------------------------------
+TreeNode* SourceParser::parseFunctionBody(size_t index) {
+    FunctionSource& source = functions.at(index);
+    if (source.function->getChildCount() > 2) return source.function->getChild(2);
+    try {
+        currentToken = source.bodyToken;
+        TreeNode* functionBody = parseBlock(source.scope, true, false);
+        source.function->addChild(functionBody);
+        return functionBody;
+    }
+    catch (ParserException e) {
+        printError(e);
+    }
+    return NULL;
+}
+
+
+//-----------------------------------------------------------------------------
+// Parses source code (starting at specified row) to tokens, returns last row
+//-----------------------------------------------------------------------------
+int SourceParser::parseToTokens(const char* sourceCode, int row) {
 
-    tokens.clear();                                                        // clear tokens vector
     int length;                                                            // token length variable
-    int row = 1, col = 1;                                                  // reset current row, col counter
+    int col = 1;                                                           // reset current col counter
     char* cursor = (char*)sourceCode;                                      // set cursor to source beginning
     char* newLine = cursor;                                                // new line pointer
     char* start = cursor;                                                  // start new token from cursor
@@ -126,6 +181,7 @@ void SourceParser::parseToTokens(const char* sourceCode) {
         length = (int)(cursor - start);                                    // if there is a last token
         if (length > 0) pushToken(start, length, row, col);                // push last token to vector
     }
+    return row;
 }
 
 
@@ -200,17 +256,39 @@ TokenType SourceParser::validateString(char* text, int length) {
 void SourceParser::buildSyntaxTree() {
     currentToken = 0;
 
-    // add iput system function to symbols table (write int to std out)
-    Token iput = { TokenType::IDENTIFIER, "iput", 4, 0,0 };
-    rootSymbolTable.addSymbol(iput, SymbolType::FUNCTION);
-    rootSymbolTable.lookupSymbol(iput)->argCount = 1;
-
-    // add iget system function to symbols table (read int from std in)
-    Token iget = { TokenType::IDENTIFIER, "iget", 4, 0,0 };
-    rootSymbolTable.addSymbol(iget, SymbolType::FUNCTION);
-    rootSymbolTable.lookupSymbol(iget)->argCount = 1;
+    // add system functions to symbols table
+    for (int i = 0; i < SYSTEM_FUNCTIONS_COUNT; i++) {
+        const SystemFunction& function = SYSTEM_FUNCTIONS[i];
+        Token token = { TokenType::IDENTIFIER, function.name, (int) strlen(function.name), 0,0 };
+        rootSymbolTable.addSymbol(token, SymbolType::FUNCTION);
+        rootSymbolTable.lookupSymbol(token)->argCount = function.argCount;
+    }
     
     root = parseModule(&rootSymbolTable);
+    buildFingerprints();
+}
+
+
+//---------------------------------------------------------------------------
+// Hashes each function tokens (without positions) and all module function
+// signatures, so function code can be reused while fingerprint is the same
+//---------------------------------------------------------------------------
+void SourceParser::buildFingerprints() {
+    uint64_t signatures = HASH_SEED;
+    for (size_t i = 0; i < rootSymbolTable.getSymbolsCount(); i++) {
+        Symbol* symbol = rootSymbolTable.getSymbolAt(i);
+        signatures = hashData(symbol->name.data(), symbol->name.size(), signatures);
+        signatures = hashData(&symbol->argCount, sizeof(symbol->argCount), signatures);
+    }
+    for (FunctionSource& source : functions) {
+        uint64_t hash = signatures;
+        for (size_t i = source.firstToken; i <= source.lastToken; i++) {
+            Token& token = tokens[i];
+            hash = hashData(&token.type, sizeof(token.type), hash);
+            hash = hashData(token.text, token.length, hash);
+        }
+        source.fingerprint = hash;
+    }
 }
 
 
@@ -256,6 +334,8 @@ TreeNode* SourceParser::parseDeclaration(SymbolTable* scope) {
 // <function> ::= <type> <identifier> '(' <argument> {, <argument>}* ')' <block>
 //---------------------------------------------------------------------------
 TreeNode* SourceParser::parseFunction(SymbolTable* scope) {
+    FunctionSource source;
+    source.firstToken = currentToken;
     Token dataType = getToken();
     if (!isDataType(dataType.type)) raiseError("Function return data type expected");
     TreeNode* returnType = new TreeNode(dataType, TreeNodeType::TYPE, scope); next();
@@ -282,11 +362,16 @@ TreeNode* SourceParser::parseFunction(SymbolTable* scope) {
     Symbol* func = scope->lookupSymbol(function->getToken());
     func->argCount = (WORD) arguments->getChildCount();
 
-    TreeNode* functionBody = parseBlock(blockSymbols, true, false);
+    source.function = function;
+    source.scope = blockSymbols;
+    source.bodyToken = currentToken;
 
     function->addChild(returnType);
     function->addChild(arguments);
-    function->addChild(functionBody);
+    if (lazy) skipBlock(); else function->addChild(parseBlock(blockSymbols, true, false));
+
+    source.lastToken = currentToken;
+    functions.push_back(source);
     return function;
 }
 
@@ -332,6 +417,22 @@ TreeNode* SourceParser::parseBlock(SymbolTable* scope, bool isFunction, bool whi
 
 
 
+//---------------------------------------------------------------------------
+// Skips '{' ... '}' block tokens without parsing (lazy function body)
+//---------------------------------------------------------------------------
+void SourceParser::skipBlock() {
+    checkToken(TokenType::OP_BRACES, "Opening braces '{' expected.");
+    size_t depth = 1;
+    while (next()) {
+        if (isTokenType(TokenType::OP_BRACES)) depth++; else
+        if (isTokenType(TokenType::CL_BRACES) && --depth == 0) return;
+    }
+    currentToken = getTokenCount() - 1;
+    raiseError("Closing braces '}' expected.");
+}
+
+
+
 //---------------------------------------------------------------------------
 // <statement> ::= <block> | <declration> | <assign> | <if-else> | <while> | <jump> | <call>
 //---------------------------------------------------------------------------
@@ -406,7 +507,7 @@ TreeNode* SourceParser::parseIfElse(SymbolTable* scope, bool whileBlock) {
     next();
     checkToken(TokenType::OP_PARENTHESES, "Opening parentheses '(' expected");
     next();	
-    ifblock->addChild(parseLogical(scope));
+    ifblock->addChild(parseExpression(scope));
     checkToken(TokenType::CL_PARENTHESES, "Closing parentheses ')' expected");
     next();	
     ifblock->addChild(parseStatement(scope, whileBlock));
@@ -426,7 +527,7 @@ TreeNode* SourceParser::parseWhile(SymbolTable* scope) {
     next();
     checkToken(TokenType::OP_PARENTHESES, "Opening parentheses '(' expected");
     next(); 
-    whileBlock->addChild(parseLogical(scope));
+    whileBlock->addChild(parseExpression(scope));
     checkToken(TokenType::CL_PARENTHESES, "Closing parentheses ')' expected");
     next(); 
     whileBlock->addChild(parseStatement(scope, true));
@@ -447,7 +548,7 @@ TreeNode* SourceParser::parseAssignment(SymbolTable* scope) {
     TreeNode* op = new TreeNode(getToken(), TreeNodeType::ASSIGNMENT, scope); 
     next();
     TreeNode* a = new TreeNode(identifier, TreeNodeType::SYMBOL, scope);
-    TreeNode* b = parseLogical(scope);
+    TreeNode* b = parseExpression(scope);
     op->addChild(a);
     op->addChild(b);
     return op;
@@ -456,103 +557,25 @@ TreeNode* SourceParser::parseAssignment(SymbolTable* scope) {
 
 
 //---------------------------------------------------------------------------
-// *  <logical>     ::= <comparison> {( && | '||') <comparison>}
-//---------------------------------------------------------------------------
-TreeNode* SourceParser::parseLogical(SymbolTable* scope) {
-    TreeNode* operand1, * operand2, * op = NULL, * prevOp = NULL;
-    operand1 = parseComparison(scope);
-    Token token = getToken();
-    while (isLogical(token.type)) {
-        next();
-        operand2 = parseComparison(scope);
-        op = new TreeNode(token, TreeNodeType::BINARY_OP, scope);
-        if (prevOp == NULL) op->addChild(operand1); else op->addChild(prevOp);
-        op->addChild(operand2);
-        prevOp = op;
-        token = getToken();
-    }
-    return op == NULL ? operand1 : op;
-
-}
-
-//---------------------------------------------------------------------------
-// <comparison>  :: = <expression>{ (== | != | > | >= | < | <=) < expression > }
-//---------------------------------------------------------------------------
-TreeNode* SourceParser::parseComparison(SymbolTable* scope) {
-    TreeNode* operand1, * operand2, * op = NULL, * prevOp = NULL;
-    operand1 = parseExpression(scope);
-    Token token = getToken();
-    while (isComparison(token.type)) {
-        next();
-        operand2 = parseExpression(scope);
-        op = new TreeNode(token, TreeNodeType::BINARY_OP, scope);
-        if (prevOp == NULL) op->addChild(operand1); else op->addChild(prevOp);
-        op->addChild(operand2);
-        prevOp = op;
-        token = getToken();
-    }
-    return op == NULL ? operand1 : op;
-
-}
-
-
-//---------------------------------------------------------------------------
-// <expression> ::= <term> {(+|-) <term>}
-//---------------------------------------------------------------------------
-TreeNode* SourceParser::parseExpression(SymbolTable* scope) {
-    TreeNode* operand1, * operand2, * op = NULL, * prevOp = NULL;
-    operand1 = parseTerm(scope);
-    Token token = getToken();
-    while (isTokenType(TokenType::PLUS) || isTokenType(TokenType::MINUS)) {
-        next();
-        operand2 = parseTerm(scope);
-        op = new TreeNode(token, TreeNodeType::BINARY_OP, scope);
-        if (prevOp == NULL) op->addChild(operand1); else op->addChild(prevOp);
-        op->addChild(operand2);
-        prevOp = op;
-        token = getToken();
-    }
-    return op == NULL ? operand1 : op;
-}
-
-
-//---------------------------------------------------------------------------
-// <term>  ::= <bitwise> {(*|/) <bitwise>}
-//---------------------------------------------------------------------------
-TreeNode* SourceParser::parseTerm(SymbolTable* scope) {
-    TreeNode* operand1, * operand2, * op = NULL, * prevOp = NULL;
-    operand1 = parseBitwise(scope);
-    Token token = getToken();
-    while (isTokenType(TokenType::MULTIPLY) || isTokenType(TokenType::DIVIDE)) {
-        next();
-        operand2 = parseBitwise(scope);
-        op = new TreeNode(token, TreeNodeType::BINARY_OP, scope);
-        if (prevOp == NULL) op->addChild(operand1); else op->addChild(prevOp);
-        op->addChild(operand2);
-        prevOp = op;
-        token = getToken(currentToken);
-    }
-    return op == NULL ? operand1 : op;
-}
-
-
-//---------------------------------------------------------------------------
-// <bitwise>  ::= <factor> {( & | '|' | ^ | << | >> ) <factor>}
+// <expression> ::= <factor> {<binary-op> <factor>}
+// Precedence climbing: parses operators binding tighter than minPrecedence
 //---------------------------------------------------------------------------
-TreeNode* SourceParser::parseBitwise(SymbolTable* scope) {
-    TreeNode* operand1, * operand2, * op = NULL, * prevOp = NULL;
+TreeNode* SourceParser::parseExpression(SymbolTable* scope, int minPrecedence) {
+    TreeNode* operand1, * operand2, * op;
     operand1 = parseFactor(scope);
     Token token = getToken();
-    while (isBitwise(token.type)) {
+    int precedence = getPrecedence(token.type);
+    while (precedence >= minPrecedence) {
         next();
-        operand2 = parseFactor(scope);
+        operand2 = parseExpression(scope, precedence + 1);
         op = new TreeNode(token, TreeNodeType::BINARY_OP, scope);
-        if (prevOp == NULL) op->addChild(operand1); else op->addChild(prevOp);
+        op->addChild(operand1);
         op->addChild(operand2);
-        prevOp = op;
+        operand1 = op;
         token = getToken();
+        precedence = getPrecedence(token.type);
     }
-    return op == NULL ? operand1 : op;
+    return operand1;
 }
 
 
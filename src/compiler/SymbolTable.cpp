@@ -65,6 +65,8 @@ size_t SymbolTable::getChildCount() {
 
 void SymbolTable::clearSymbols() {
     symbols.clear();
+    symbolsIndex.clear();
+    for (int& index : nextIndex) index = 0;
 }
 
 
@@ -79,6 +81,8 @@ bool SymbolTable::addSymbol(Token& token, SymbolType type) {
     entry.type = type;
     entry.localIndex = (int) getNextIndex(type);
     entry.address = NULL;
+    symbolsIndex[entry.name] = symbols.size();
+    nextIndex[(int) type]++;
     symbols.push_back(entry);
     return true;
 }
@@ -90,17 +94,9 @@ Symbol* SymbolTable::getSymbolAt(size_t index) {
 
 
 Symbol* SymbolTable::lookupSymbol(Token& token) {
-    Symbol entry;
-    size_t count = getSymbolsCount();
-    size_t length;
-    // Search symbol in current scope
-    for (int i = 0; i < count; i++) {
-        entry = symbols.at(i);
-        if (entry.name.size() == token.length) {
-            length = token.length;
-            if (strncmp(entry.name.c_str(), token.text, length)==0) return &symbols.at(i);
-        }
-    }
+    // Search symbol in current scope (hashed by name, names are unique in scope)
+    auto found = symbolsIndex.find(string(token.text, token.length));
+    if (found != symbolsIndex.end()) return &symbols[found->second];
     // Search symbol in parent scope
     if (parent != NULL) {
         Symbol* entry = parent->lookupSymbol(token);
@@ -111,19 +107,9 @@ Symbol* SymbolTable::lookupSymbol(Token& token) {
 
 
 Symbol* SymbolTable::lookupSymbol(char* name, SymbolType type) {
-    Symbol entry;
-    size_t count = getSymbolsCount();
-    size_t length = strlen(name);
-    bool equalName;
     // Search symbol in current scope
-    for (int i = 0; i < count; i++) {
-        entry = symbols.at(i);
-        if (entry.name.size() == length) {
-            equalName = strncmp(entry.name.c_str(), name, length) == 0;
-            if (equalName && entry.type==type) return &symbols.at(i);
-            
-        }
-    }
+    auto found = symbolsIndex.find(name);
+    if (found != symbolsIndex.end() && symbols[found->second].type == type) return &symbols[found->second];
     // Search symbol in parent scope
     if (parent != NULL) {
         Symbol* entry = parent->lookupSymbol(name, type);
@@ -134,14 +120,7 @@ Symbol* SymbolTable::lookupSymbol(char* name, SymbolType type) {
 }
 
 int SymbolTable::getNextIndex(SymbolType type) {
-    Symbol entry;
-    size_t count = getSymbolsCount();
-    int index = 0;
-    for (int i = 0; i < count; i++) {
-        entry = symbols.at(i);
-        if (entry.type == type) index++;
-    }
-    return index;
+    return nextIndex[(int) type];
 }
 
 void SymbolTable::printSymbols() {
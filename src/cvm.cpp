@@ -5,84 +5,747 @@
 #include <filesystem>
 #include <fstream>
 #include <chrono>
+#include <cstring>
+#include <sstream>
+#include <vector>
+#include <thread>
+#include <atomic>
+#include <functional>
+#include <algorithm>
+#include <iomanip>
+#include <cmath>
 
 #include "runtime/VirtualMachine.h"
+#include "runtime/Executor.h"
+#include "runtime/Channel.h"
+#include "runtime/Snapshot.h"
+#include "runtime/ImageFile.h"
+#include "runtime/Profile.h"
+#include "runtime/Sampler.h"
+#include "runtime/PerfCounters.h"
+#include "runtime/Tracer.h"
+#include "runtime/Metrics.h"
+#include "runtime/BufferedOutput.h"
 #include "compiler/SourceParser.h"
 #include "compiler/CodeGenerator.h"
 #include "compiler/SourceFile.h"
 
+#ifdef __linux__
+#include <sched.h>
+#endif
+
 
 using namespace std;
 using namespace vm;
 
 
-// todo refactor it
-void compileRun(string filepath, bool showTree, bool showSymbols, bool disassemble, bool run) {
+constexpr const char* IMAGE_FILE_EXTENSION = ".cvmi";
+constexpr const char* CHECKPOINT_FILE_EXTENSION = ".cvms";
+constexpr unsigned METRICS_INTERVAL = 1000;               // Live metrics print interval in ms
+
+
+// Options of compiling and running single file
+class RunOptions {
+public:
+	bool showTree = true;                                 // Print syntax tree
+	bool showSymbols = true;                              // Print symbols table
+	bool disassemble = true;                              // Print disassembly
+	bool run = true;                                      // Run compiled code
+	bool quiet = false;                                   // Program output and errors only
+	bool buffered = true;                                 // Program output written in blocks
+	bool lazy = false;                                    // Compile functions on first call
+	bool useCache = false;                                // Run unchanged sources from images cache
+	string savePath;                                      // Compiled image file
+	string checkpointPath;                                // Snapshot file of checkpoint()
+	bool recordMemory = false;                            // Record memory size to given images too
+	bool profiling = false;                               // Instructions profile
+	string samplePath;                                    // Sampled call stacks file
+	unsigned sampleRate = SAMPLER_FREQUENCY;              // Samples per second
+	bool perf = false;                                    // Hardware performance counters
+	string tracePath;                                     // Call trace file
+	bool live = false;                                    // Live metrics
+	unsigned benchRuns = 0;                               // Measured benchmark runs (0 - no benchmark)
+	unsigned warmup = 2;                                  // Benchmark warmup runs
+	int cpu = -1;                                         // Benchmark CPU (-1 - not pinned)
+};
+
+
+// Prints live metrics line to standard error every interval until done
+// (runs on monitoring thread while machines run)
+void monitorMetrics(function<MetricsReport()> read, atomic<bool>& done) {
+	unsigned elapsed = 0;
+	while (!done.load(memory_order_relaxed)) {
+		this_thread::sleep_for(chrono::milliseconds(10));
+		elapsed += 10;
+		if (elapsed < METRICS_INTERVAL) continue;
+		elapsed = 0;
+		MetricsReport report = read();
+		cerr << "[metrics] instructions=" << report.instructions << " calls=" << report.calls;
+		cerr << " syscalls=" << report.syscalls << " stack=" << report.stackDepth << "/" << report.maxStackDepth;
+		cerr << " running=" << report.running << " time=" << report.seconds << "s" << endl;
+	}
+}
+
+
+// Runs loaded virtual machine and prints execution time. Machine paused
+// at checkpoint() is saved to checkpoint file (if given) and resumed.
+// Sampler (if given) samples machine call stack while it runs, attached
+// metrics are printed by monitoring thread while it runs
+void runMachine(VirtualMachine* machine, RunOptions& options, bool resume = false, Sampler* sampler = NULL) {
+	if (sampler != NULL && !sampler->start(*machine, options.sampleRate)) {
+		cout << "Sampling profiler is not supported." << endl;
+	}
+	atomic<bool> done(false);
+	thread monitor;
+	Metrics* metrics = machine->getMetrics();
+	if (metrics != NULL) monitor = thread(monitorMetrics, [metrics] { return metrics->read(); }, ref(done));
+	string checkpointPath = options.lazy ? "" : options.checkpointPath; // lazy code has stubs
+	auto start = std::chrono::high_resolution_clock::now();
+	ExecutionStatus status = resume ? machine->resume() : machine->execute();
+	while (status == ExecutionStatus::PAUSED) {
+		if (!checkpointPath.empty()) {
+			Snapshot snapshot(*machine);
+			machine->getOutput()->flush();
+			if (!snapshot.save(checkpointPath.c_str())) cout << "Can not save checkpoint: " << checkpointPath << endl;
+			else if (!options.quiet) cout << "Checkpoint saved: " << checkpointPath << endl;
+		}
+		status = machine->resume();
+	}
+	auto end = std::chrono::high_resolution_clock::now();
+	if (sampler != NULL) sampler->stop();
+	done = true;
+	if (monitor.joinable()) monitor.join();
+	machine->getOutput()->flush();
+	auto ms_int = chrono::duration_cast<chrono::nanoseconds>(end - start).count();
+	if (!options.quiet) cout << "Execution time: " << ms_int / 1000000000.0 << "s" << endl;
+}
+
+
+// Prints disassembly annotated with instructions executions counts,
+// opcodes profile and hottest source lines (source text is optional)
+void printProfile(Profile& profile, ExecutableImage& img, const char* source) {
+	img.disassemble(&profile);
+	profile.printOpcodes(cout);
+	profile.printLines(img, cout, source);
+}
+
+
+// Writes call stack samples as folded stacks (flame graph input)
+void writeSamples(Sampler& sampler, ExecutableImage& img, string samplePath) {
+	ofstream file(samplePath, ios::out | ios::trunc);
+	sampler.writeFolded(img, file);
+	file.close();
+	if (file.fail()) cout << "Can not write samples: " << samplePath << endl;
+	else {
+		cout << "Samples: " << sampler.getSamplesCount() << " (dropped " << sampler.getDroppedCount();
+		cout << ") written to " << samplePath << endl;
+	}
+}
+
+
+// Prints stack usage of last run and records recommended memory size to
+// image files (recorded size only grows, so the deepest run is covered).
+// Images given by user are passed only with --record-memory
+void recordMemorySize(VirtualMachine* machine, WORD stackWords, size_t recorded, vector<string> imagePaths, 
+	RunOptions& options) {
+	size_t recommended = max(machine->recommendMemorySize(stackWords), recorded);
+	if (!options.quiet) {
+		cout << "Memory: stack " << machine->getMaxStackDepth() << " words (min SP " << machine->getMinSP() << ")";
+		if (machine->getMaxCallDepth() > 0) cout << ", call depth " << machine->getMaxCallDepth(); // profiled or counted runs
+		cout << ", code " << machine->getCode()->getSize();
+		cout << " words, recommended " << recommended << " bytes" << endl;
+	}
+	if (recommended == recorded) return;
+	for (string& path : imagePaths) {
+		if (path.empty()) continue;
+		if (!ImageFile::writeMemorySize(path.c_str(), recommended)) cout << "Can not update image: " << path << endl;
+	}
+}
+
+
+// Opens call trace file for machine running image (NULL if not possible)
+Tracer* openTrace(string tracePath, ExecutableImage& img) {
+	if (tracePath.empty()) return NULL;
+	if (!TRACING_ENABLED) {
+		cout << "Tracing is not built in (configure with -DCVM_TRACING=ON)." << endl;
+		return NULL;
+	}
+	Tracer* tracer = new Tracer(tracePath.c_str());
+	if (!tracer->isOpen()) {
+		cout << "Can not write trace: " << tracePath << endl;
+		delete tracer;
+		return NULL;
+	}
+	tracer->setSymbols(img);
+	return tracer;
+}
+
+
+// Completes call trace file
+void closeTrace(Tracer* tracer, string tracePath) {
+	if (tracer == NULL) return;
+	tracer->close();
+	cout << "Trace: " << tracer->getEventsCount() << " events (dropped " << tracer->getDroppedCount();
+	cout << ") written to " << tracePath << endl;
+	delete tracer;
+}
+
+
+// Restores machine from checkpoint file and resumes it
+bool runCheckpointFile(string filepath, RunOptions& options) {
+	Snapshot snapshot(filepath.c_str());
+	if (!snapshot.isValid()) return false;
+	BufferedOutput output(cout);
+	VirtualMachine* machine = snapshot.fork();
+	if (machine == NULL) return false;
+	if (options.buffered) machine->setOutput(&output);
+	machine->setVerbose(!options.quiet);
+	if (!options.quiet) cout << "Restored checkpoint: " << filepath << endl;
+	runMachine(machine, options, true);
+	delete machine;
+	return true;
+}
+
+
+// Runs compiled image file code right from file mapping (no compilation),
+// image of cache is owned by cvm and gets recorded memory size
+bool runImageFile(string filepath, RunOptions& options, bool cached = false) {
+	ImageFile file(filepath.c_str());
+	if (!file.isValid()) return false;
+	ExecutableImage img;
+	if (options.disassemble || options.profiling || !options.samplePath.empty() || !options.tracePath.empty()) img.load(file);
+	if (options.disassemble) img.disassemble();
+	if (options.run) {
+		Profile profile;
+		Sampler sampler;
+		PerfCounters counters;
+		Metrics metrics;
+		BufferedOutput output(cout);
+		size_t memorySize = file.getMemorySize();
+		if (memorySize > 0 && !options.quiet) cout << "Memory size: " << memorySize << " bytes (recorded by previous runs)" << endl;
+		VirtualMachine* machine = new VirtualMachine(memorySize > 0 ? memorySize : DEFAULT_MEMORY_SIZE);
+		if (options.buffered) machine->setOutput(&output);
+		machine->setVerbose(!options.quiet);
+		if (options.live) machine->setMetrics(&metrics);
+		if (options.profiling) machine->setProfile(&profile);
+		if (options.perf) machine->setPerfCounters(&counters);
+		Tracer* tracer = openTrace(options.tracePath, img);
+		machine->setTracer(tracer);
+		if (machine->loadCode(make_shared<CodeSegment>(filepath.c_str()))) {
+			runMachine(machine, options, false, options.samplePath.empty() ? NULL : &sampler);
+			recordMemorySize(machine, file.getMaxStackUsage(), memorySize, 
+				{ cached || options.recordMemory ? filepath : "" }, options);
+		} else cout << "Can not load image code segment." << endl;
+		delete machine;
+		closeTrace(tracer, options.tracePath);
+		if (options.perf) counters.read().print(cout);
+		if (options.live) metrics.read().print(cout);
+		if (options.profiling) printProfile(profile, img, NULL);
+		if (!options.samplePath.empty()) writeSamples(sampler, img, options.samplePath);
+	}
+	return true;
+}
+
+
+// Compiles source file (or runs image or checkpoint file) and runs it
+void compileRun(string filepath, RunOptions& options) {
 
-	// Read source code file
+	// Compiled image files are run without compilation
+	if (filesystem::path(filepath).extension() == IMAGE_FILE_EXTENSION) {
+		if (!runImageFile(filepath, options)) cout << "Invalid image file." << endl;
+		return;
+	}
+
+	// Checkpoint files resume saved execution state
+	if (filesystem::path(filepath).extension() == CHECKPOINT_FILE_EXTENSION) {
+		if (!runCheckpointFile(filepath, options)) cout << "Invalid checkpoint file." << endl;
+		return;
+	}
+
+	// Open source code file ("-" streams standard input)
 	SourceFile source(filepath.c_str());
-	cout << "Current path: " << filesystem::current_path() << endl;
-	if (source.getData()==NULL) {
+	if (!options.quiet) cout << "Current path: " << filesystem::current_path() << endl;
+	if (!source.isOpen()) {
 		cout << "File not open." << endl;
 		return;
 	}
+
+	// Unchanged sources run from compiled images cache (lazy images have stubs)
+	string cachePath, lastBuildPath;
+	uint64_t sourceHash = 0;
+	if (options.useCache && !options.lazy) {
+		ImageCache cache;
+		if (!cache.isValid()) cout << "Images cache directory is not owned by user, not used: " << cache.getDirectory() << endl;
+		else {
+			sourceHash = source.getHash();
+			cachePath = cache.getPath(sourceHash);
+			if (ImageCache::isOwned(cachePath)) {
+				ImageFile cached(cachePath.c_str());
+				if (cached.isValid() && cached.getHeader()->sourceHash == sourceHash) {
+					if (!options.quiet) cout << "Using cached image: " << cachePath << endl;
+					runImageFile(cachePath, options, true);
+					return;
+				}
+			}
+			if (filepath != "-") lastBuildPath = cache.getLastBuildPath(filepath);
+		}
+	}
+
+	// Previous build of the source is reused for incremental compilation
+	ExecutableImage* previous = NULL;
+	if (!options.lazy) {
+		string previousPath = options.savePath.empty() ? lastBuildPath : options.savePath;
+		previous = new ExecutableImage();
+		bool foreign = (previousPath == lastBuildPath) && !ImageCache::isOwned(previousPath);
+		if (previousPath.empty() || foreign || !previous->load(previousPath.c_str())) {
+			delete previous;
+			previous = NULL;
+		}
+	}
 	
-	// Parse source code
+	// Parse source code (function bodies are parsed on first call in lazy mode
+	// or when function changed since previous build in incremental mode)
 	ExecutableImage* img = new ExecutableImage();
-	SourceParser* parser = new SourceParser(source.getData());
+	SourceParser* parser = new SourceParser(source, options.lazy || previous != NULL);
 	TreeNode *root = parser->getSyntaxTree();
 	if (root == NULL) {
 		cout << "Parser error. Can not parse source code.";
 		delete parser;
+		delete img;
+		delete previous;
 		return;
-	} else {
-		if (showTree) root->print();
-		// Generate executable image
-		CodeGenerator* codeGenerator = new CodeGenerator();
-		if (!codeGenerator->generateCode(img, parser->getSyntaxTree())) {
-			cout << "Code generator error. Can not generate code.";
-			delete codeGenerator;
-			delete img;
-			return;
-		} else {
-			if (showSymbols) parser->getSymbolTable().printSymbols();
-			if (disassemble) img->disassemble();
-			delete codeGenerator;
-			delete parser;
+	}
+
+	// Generate executable image
+	CodeGenerator* codeGenerator = new CodeGenerator();
+	codeGenerator->setPreviousImage(previous);
+	if (!codeGenerator->generateCode(img, parser)) {
+		cout << "Code generator error. Can not generate code.";
+		delete codeGenerator;
+		delete parser;
+		delete img;
+		delete previous;
+		return;
+	}
+	if (previous != NULL) {
+		if (!options.quiet) {
+			cout << "Incremental build: reused " << codeGenerator->getReusedCount();
+			cout << " of " << parser->getFunctionCount() << " functions" << endl;
 		}
+		codeGenerator->setPreviousImage(NULL);
+		delete previous;
 	}
+	if (options.showTree) root->print();
+	if (options.showSymbols) parser->getSymbolTable().printSymbols();
+	if (options.disassemble) img->disassemble();
 
-	;
+	// Save compiled image
+	img->setSourceHash(sourceHash);
+	if (!cachePath.empty() && !img->save(cachePath.c_str())) {
+		cout << "Can not save image to cache: " << cachePath << endl;
+	}
+	if (!lastBuildPath.empty()) img->save(lastBuildPath.c_str());
+	if (!options.savePath.empty()) {
+		if (options.lazy) cout << "Lazy compiled image can not be saved." << endl;
+		else if (!img->save(options.savePath.c_str())) cout << "Can not save image: " << options.savePath << endl;
+	}
 	
 	// Run executable image
-	if (run) {
+	if (options.run) {
+		Profile profile;
+		Sampler sampler;
+		PerfCounters counters;
+		Metrics metrics;
+		BufferedOutput output(cout);
 		VirtualMachine* machine = new VirtualMachine();
+		if (options.buffered) machine->setOutput(&output);
+		machine->setVerbose(!options.quiet);
+		if (options.live) machine->setMetrics(&metrics);
+		if (options.profiling) machine->setProfile(&profile);
+		if (options.perf) machine->setPerfCounters(&counters);
+		Tracer* tracer = openTrace(options.tracePath, *img);
+		machine->setTracer(tracer);
 		machine->loadImage(*img);
-		auto start = std::chrono::high_resolution_clock::now();
-		machine->execute();
-		auto end = std::chrono::high_resolution_clock::now();
-		auto ms_int = chrono::duration_cast<chrono::nanoseconds>(end - start).count();
-		cout << "Execution time: " << ms_int / 1000000000.0 << "s" << endl;
+		if (options.lazy) machine->setTrapHandler([&](WORD index) {
+			WORD codeEnd = img->getSize();
+			WORD address = codeGenerator->resolveStub(img, index);
+			if (address >= 0) machine->loadImage(*img, codeEnd);
+			if (tracer != NULL) tracer->setSymbols(*img);
+			return address;
+		});
+		runMachine(machine, options, false, options.samplePath.empty() ? NULL : &sampler);
+		recordMemorySize(machine, img->getMaxStackUsage(), 0, 
+			{ cachePath, lastBuildPath, options.lazy || !options.recordMemory ? "" : options.savePath }, options);
 		delete machine;
+		closeTrace(tracer, options.tracePath);
+		if (options.perf) counters.read().print(cout);
+		if (options.live) metrics.read().print(cout);
+		if (options.profiling) printProfile(profile, *img, source.getData());
+		if (!options.samplePath.empty()) writeSamples(sampler, *img, options.samplePath);
 	}
 	
+	delete codeGenerator;
+	delete parser;
 	delete img;
 
 }
 
 
+// Loads image file or compiles source file to code segment (no output)
+shared_ptr<CodeSegment> loadCodeSegment(string filepath) {
+	if (filesystem::path(filepath).extension() == IMAGE_FILE_EXTENSION) {
+		auto segment = make_shared<CodeSegment>(filepath.c_str());
+		return segment->isValid() ? segment : NULL;
+	}
+	SourceFile source(filepath.c_str());
+	if (!source.isOpen()) return NULL;
+	SourceParser parser(source);
+	if (parser.getSyntaxTree() == NULL) return NULL;
+	ExecutableImage img;
+	CodeGenerator codeGenerator;
+	if (!codeGenerator.generateCode(&img, &parser)) return NULL;
+	return make_shared<CodeSegment>(img);
+}
+
+
+// Runs every file repeat times on pool of virtual machines, standard input
+// is read once and passed to every job, outputs are printed in files order.
+// With snapshots files run until checkpoint() once, jobs resume snapshots.
+// With time slice jobs are preempted after slice fuel is spent
+void runBatch(vector<string>& files, unsigned workers, unsigned repeat, bool useSnapshots, int64_t timeSlice, bool live) {
+	vector<shared_ptr<CodeSegment>> segments;
+	vector<shared_ptr<Snapshot>> snapshots;
+	for (string& file : files) {
+		auto segment = loadCodeSegment(file);
+		if (segment == NULL) {
+			cout << "Can not load: " << file << endl;
+			return;
+		}
+		segments.push_back(segment);
+		snapshots.push_back(NULL);
+		if (!useSnapshots) continue;
+		VirtualMachine machine;
+		ostringstream initOutput;
+		machine.setVerbose(false);
+		machine.setOutput(&initOutput);
+		machine.setInputQueue(make_shared<InputQueue>());
+		machine.loadCode(segment);
+		auto start = std::chrono::high_resolution_clock::now();
+		if (machine.execute() == ExecutionStatus::PAUSED) snapshots.back() = make_shared<Snapshot>(machine);
+		auto end = std::chrono::high_resolution_clock::now();
+		auto ms_int = chrono::duration_cast<chrono::nanoseconds>(end - start).count();
+		cout << "[" << file << " initialization]" << endl << initOutput.str();
+		cout << (snapshots.back() ? "Snapshot after " : "No checkpoint, ran ") << ms_int / 1000000000.0 << "s" << endl;
+	}
+	stringstream input;
+	input << cin.rdbuf();
+	string inputText = input.str();
+
+	Executor executor(workers);
+	executor.setTimeSlice(timeSlice);
+	executor.setMetricsEnabled(live);
+	atomic<bool> done(false);
+	thread monitor;
+	if (live) monitor = thread(monitorMetrics, [&executor] { return executor.getMetrics(); }, ref(done));
+	vector<ostringstream> outputs(segments.size() * repeat);
+	for (unsigned r = 0; r < repeat; r++) {
+		for (size_t i = 0; i < segments.size(); i++) {
+			ostream* output = &outputs[r * segments.size() + i];
+			if (snapshots[i] != NULL) executor.submit(snapshots[i], inputText, output);
+			else executor.submit(segments[i], inputText, output);
+		}
+	}
+	executor.wait();
+	done = true;
+	if (monitor.joinable()) monitor.join();
+
+	for (size_t j = 0; j < outputs.size(); j++) {
+		cout << "[" << files[j % files.size()] << "]" << endl << outputs[j].str();
+	}
+	cout << "-----------------------------------------------------" << endl;
+	cout << "Workers: " << executor.getWorkersCount() << endl;
+	executor.getStats().print(cout);
+	if (live) executor.getMetrics().print(cout);
+}
+
+
+// Runs files as pipeline stages on own threads: stage reads channel 0
+// (previous stage output) and writes channel 1 (next stage input).
+// Last stage output words are printed, stage outputs are printed in order.
+// Threads spawned by stage share its channels, so they need MPMC channels
+void runPipeline(vector<string>& files, ChannelType type) {
+	size_t count = files.size();
+	vector<shared_ptr<CodeSegment>> segments;
+	for (string& file : files) {
+		auto segment = loadCodeSegment(file);
+		if (segment == NULL) {
+			cout << "Can not load: " << file << endl;
+			return;
+		}
+		segments.push_back(segment);
+	}
+	vector<shared_ptr<Channel>> channels;
+	for (size_t i = 0; i <= count; i++) channels.push_back(Channel::create(type));
+	channels[0]->close();
+
+	auto start = std::chrono::high_resolution_clock::now();
+	vector<ostringstream> outputs(count);
+	vector<thread> stages;
+	for (size_t i = 0; i < count; i++) {
+		stages.emplace_back([&, i] {
+			VirtualMachine machine;
+			machine.setVerbose(false);
+			machine.setOutput(&outputs[i]);
+			machine.loadCode(segments[i]);
+			machine.attachChannel(channels[i]);
+			machine.attachChannel(channels[i + 1]);
+			machine.execute();
+			channels[i + 1]->close();
+		});
+	}
+
+	WORD words[256];
+	WORD received;
+	vector<WORD> results;
+	Channel* last = channels[count].get();
+	for (;;) {
+		received = last->receive(words, 256);
+		if (received == 0 && last->isClosed()) received = last->receive(words, 256);
+		if (received == 0 && last->isClosed()) break;
+		if (received == 0) this_thread::yield();
+		results.insert(results.end(), words, words + received);
+	}
+	for (thread& stage : stages) stage.join();
+	auto end = std::chrono::high_resolution_clock::now();
+
+	for (size_t i = 0; i < count; i++) cout << "[" << files[i] << "]" << endl << outputs[i].str();
+	cout << "[pipeline]" << endl;
+	for (WORD value : results) cout << value << endl;
+	auto ms_int = chrono::duration_cast<chrono::nanoseconds>(end - start).count();
+	cout << "Execution time: " << ms_int / 1000000000.0 << "s" << endl;
+}
+
+
+// Benchmark timings statistics in seconds
+class BenchStats {
+public:
+	double min, median, mean, p99, max, stddev;
+};
+
+
+// Computes statistics of run times
+BenchStats computeStats(vector<double> samples) {
+	BenchStats stats = {};
+	if (samples.empty()) return stats;
+	sort(samples.begin(), samples.end());
+	size_t count = samples.size();
+	double total = 0, deviation = 0;
+	for (double s : samples) total += s;
+	stats.min = samples.front();
+	stats.max = samples.back();
+	stats.mean = total / count;
+	stats.median = (count % 2) ? samples[count / 2] : (samples[count / 2 - 1] + samples[count / 2]) / 2;
+	stats.p99 = samples[min(count - 1, (size_t) ceil(count * 0.99) - 1)];
+	for (double s : samples) deviation += (s - stats.mean) * (s - stats.mean);
+	stats.stddev = (count > 1) ? sqrt(deviation / (count - 1)) : 0;
+	return stats;
+}
+
+
+// Pins calling thread (machines run on it) to CPU
+bool pinToCpu(int cpu) {
+#ifdef __linux__
+	cpu_set_t set;
+	CPU_ZERO(&set);
+	CPU_SET(cpu, &set);
+	return sched_setaffinity(0, sizeof(set), &set) == 0;
+#else
+	return false;
+#endif
+}
+
+
+// Runs file on fresh machine with input and discarded output, returns
+// execution time in seconds (-1 if program failed). Instructions (with
+// spawned threads) are counted if metrics block is given
+double runBenchmarkOnce(shared_ptr<CodeSegment> segment, vector<WORD>& input, WORD& result, Metrics* metrics = NULL) {
+	ostream discard(nullptr);
+	auto queue = make_shared<InputQueue>();
+	for (WORD value : input) queue->push(value);
+	queue->close();
+	VirtualMachine machine;
+	machine.setVerbose(false);
+	machine.setOutput(&discard);
+	machine.setInputQueue(queue);
+	machine.setMetrics(metrics);
+	machine.loadCode(segment);
+	auto start = std::chrono::high_resolution_clock::now();
+	ExecutionStatus status = machine.execute();
+	while (status == ExecutionStatus::PAUSED) status = machine.resume();
+	auto end = std::chrono::high_resolution_clock::now();
+	if (status != ExecutionStatus::HALTED) return -1;
+	result = machine.getResult();
+	return chrono::duration<double>(end - start).count();
+}
+
+
+// Compiles file once and runs it warmup times, then benchmark runs times
+// on fresh machines. Standard input is read once and passed to every run.
+// Measured runs dispatch without counting, instructions count is taken
+// from one extra counting run
+void runBenchmark(string filepath, RunOptions& options) {
+	auto segment = loadCodeSegment(filepath);
+	if (segment == NULL) {
+		cout << "Can not load: " << filepath << endl;
+		return;
+	}
+	if (options.cpu >= 0 && !pinToCpu(options.cpu)) cout << "Can not pin to CPU " << options.cpu << endl;
+	vector<WORD> input;
+	WORD value;
+	if (filepath != "-") while (cin >> value) input.push_back(value);
+
+	WORD result = 0;
+	Metrics metrics;
+	for (unsigned i = 0; i < options.warmup; i++) runBenchmarkOnce(segment, input, result);
+	if (runBenchmarkOnce(segment, input, result, &metrics) < 0) {
+		cout << "Runtime error: " << filepath << endl;
+		return;
+	}
+	uint64_t instructions = metrics.read().instructions;
+	vector<double> samples;
+	for (unsigned i = 0; i < options.benchRuns; i++) {
+		double seconds = runBenchmarkOnce(segment, input, result);
+		if (seconds < 0) {
+			cout << "Runtime error: " << filepath << endl;
+			return;
+		}
+		samples.push_back(seconds);
+	}
+
+	BenchStats stats = computeStats(samples);
+	cout << "-----------------------------------------------------" << endl;
+	cout << "Benchmark: " << filepath << endl;
+	cout << "-----------------------------------------------------" << endl;
+	cout << left << setw(24) << "runs" << right << setw(16) << options.benchRuns;
+	cout << " (warmup " << options.warmup << ")" << endl;
+	cout << left << setw(24) << "CPU" << right << setw(16);
+	if (options.cpu >= 0) cout << options.cpu << endl; else cout << "not pinned" << endl;
+	cout << left << setw(24) << "result" << right << setw(16) << result << endl;
+	cout << left << setw(24) << "VM instructions" << right << setw(16) << instructions << endl;
+	cout << fixed << setprecision(3);
+	cout << left << setw(24) << "min" << right << setw(16) << stats.min * 1000 << " ms" << endl;
+	cout << left << setw(24) << "median" << right << setw(16) << stats.median * 1000 << " ms" << endl;
+	cout << left << setw(24) << "mean" << right << setw(16) << stats.mean * 1000 << " ms" << endl;
+	cout << left << setw(24) << "p99" << right << setw(16) << stats.p99 * 1000 << " ms" << endl;
+	cout << left << setw(24) << "max" << right << setw(16) << stats.max * 1000 << " ms" << endl;
+	cout << left << setw(24) << "stddev" << right << setw(16) << stats.stddev * 1000 << " ms";
+	if (stats.mean > 0) cout << " (" << setprecision(1) << stats.stddev * 100 / stats.mean << "%)";
+	cout << endl << setprecision(0);
+	if (stats.median > 0) {
+		cout << left << setw(24) << "instructions/s median" << right << setw(16) << instructions / stats.median << endl;
+		cout << left << setw(24) << "instructions/s best" << right << setw(16) << instructions / stats.min << endl;
+	}
+	cout << defaultfloat << setprecision(6);
+}
+
+
+
+// Sets listings to print from comma separated list of ast, symbols,
+// disasm, all and none
+bool parseShow(string list, RunOptions& options) {
+	options.showTree = options.showSymbols = options.disassemble = false;
+	stringstream stream(list);
+	string item;
+	while (getline(stream, item, ',')) {
+		if (item == "ast") options.showTree = true;
+		else if (item == "symbols") options.showSymbols = true;
+		else if (item == "disasm") options.disassemble = true;
+		else if (item == "all") options.showTree = options.showSymbols = options.disassemble = true;
+		else if (item != "none") return false;
+	}
+	return true;
+}
+
+
+// Prints command line usage
+void printUsage() {
+	puts("Usage: cvm [-q | --quiet] [--show <ast,symbols,disasm | all | none>] [--no-run] [--unbuffered]");
+	puts("           [--lazy] [--cache] [--profile] [--perf] [--metrics] [--save <image.cvmi>] [--checkpoint <state.cvms>]");
+	puts("           [--sample <stacks.folded>] [--sample-rate <hz>] [--trace <trace.json>] [--record-memory]");
+	puts("           <filename.cvm | image.cvmi | state.cvms | ->");
+	puts("       cvm [--workers <n>] [--repeat <n>] [--snapshot] [--slice <fuel>] [--metrics] <filename.cvm | image.cvmi>...");
+	puts("       cvm --pipeline [--mpmc] <filename.cvm | image.cvmi>...");
+	puts("       cvm --bench <runs> [--warmup <n>] [--cpu <n>] <filename.cvm | image.cvmi>...");
+}
+
+
 int main(int argc, char* argv[]) {
 	
-	if (argc < 2) {
+	vector<string> files;
+	RunOptions options;
+	string show;
+	bool batch = false;
+	bool pipeline = false;
+	bool mpmc = false;
+	bool useSnapshots = false;
+	unsigned workers = 0;
+	unsigned repeat = 1;
+	int64_t timeSlice = FUEL_UNLIMITED;
+	for (int i = 1; i < argc; i++) {
+		if (strcmp(argv[i], "--lazy") == 0) options.lazy = true;
+		else if (strcmp(argv[i], "--cache") == 0) options.useCache = true;
+		else if (strcmp(argv[i], "--profile") == 0) options.profiling = true;
+		else if (strcmp(argv[i], "--perf") == 0) options.perf = true;
+		else if (strcmp(argv[i], "--metrics") == 0) options.live = true;
+		else if (strcmp(argv[i], "-q") == 0 || strcmp(argv[i], "--quiet") == 0) options.quiet = true;
+		else if (strcmp(argv[i], "--show") == 0 && i + 1 < argc) show = argv[++i];
+		else if (strcmp(argv[i], "--no-run") == 0) options.run = false;
+		else if (strcmp(argv[i], "--unbuffered") == 0) options.buffered = false;
+		else if (strcmp(argv[i], "--trace") == 0 && i + 1 < argc) options.tracePath = argv[++i];
+		else if (strcmp(argv[i], "--sample") == 0 && i + 1 < argc) options.samplePath = argv[++i];
+		else if (strcmp(argv[i], "--sample-rate") == 0 && i + 1 < argc) options.sampleRate = max(1, atoi(argv[++i]));
+		else if (strcmp(argv[i], "--save") == 0 && i + 1 < argc) options.savePath = argv[++i];
+		else if (strcmp(argv[i], "--checkpoint") == 0 && i + 1 < argc) options.checkpointPath = argv[++i];
+		else if (strcmp(argv[i], "--record-memory") == 0) options.recordMemory = true;
+		else if (strcmp(argv[i], "--workers") == 0 && i + 1 < argc) { workers = atoi(argv[++i]); batch = true; }
+		else if (strcmp(argv[i], "--slice") == 0 && i + 1 < argc) { timeSlice = atoll(argv[++i]); batch = true; }
+		else if (strcmp(argv[i], "--pipeline") == 0) pipeline = true;
+		else if (strcmp(argv[i], "--mpmc") == 0) mpmc = true;
+		else if (strcmp(argv[i], "--snapshot") == 0) { useSnapshots = true; batch = true; }
+		else if (strcmp(argv[i], "--repeat") == 0 && i + 1 < argc) { repeat = max(1, atoi(argv[++i])); batch = true; }
+		else if (strcmp(argv[i], "--bench") == 0 && i + 1 < argc) options.benchRuns = max(1, atoi(argv[++i]));
+		else if (strcmp(argv[i], "--warmup") == 0 && i + 1 < argc) options.warmup = atoi(argv[++i]);
+		else if (strcmp(argv[i], "--cpu") == 0 && i + 1 < argc) options.cpu = atoi(argv[++i]);
+		else if (argv[i][0] == '-' && argv[i][1] != 0) {     // "-" is standard input
+			if (strcmp(argv[i], "--help") != 0) cout << "Unknown option or missing value: " << argv[i] << endl;
+			printUsage();
+			return strcmp(argv[i], "--help") == 0 ? 0 : 1;
+		}
+		else files.push_back(argv[i]);
+	}
+
+	// Quiet runs print no listings unless asked
+	if (options.quiet) parseShow("none", options);
+	if (!show.empty() && !parseShow(show, options)) {
+		cout << "Unknown listing in --show: " << show << endl;
+		return 1;
+	}
+
+	if (files.empty()) {
 		puts("No filename was given.");
+		printUsage();
 		return 1;
 	}
-	
-	compileRun(argv[1], true, true, true, true);
+
+	if (options.benchRuns > 0) for (string& file : files) runBenchmark(file, options);
+	else if (pipeline) runPipeline(files, mpmc ? ChannelType::MPMC : ChannelType::SPSC);
+	else if (batch || files.size() > 1) runBatch(files, workers, repeat, useSnapshots, timeSlice, options.live);
+	else compileRun(files[0], options);
 	    
-	//compileRun("../../../test/factorial.cvm", true, true, true, true);
-	//compileRun("../../../test/primenumber.cvm", true, true, true, true);
-	//compileRun("../../../test/combinatorics.cvm", true, true, true, true);
-	//compileRun("../../../test/scope.cvm", true, true, true, true);
+	//RunOptions test;
+	//compileRun("../../../test/factorial.cvm", test);
+	//compileRun("../../../test/primenumber.cvm", test);
+	//compileRun("../../../test/combinatorics.cvm", test);
+	//compileRun("../../../test/scope.cvm", test);
 	return 0;
 }
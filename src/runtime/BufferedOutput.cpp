@@ -0,0 +1,51 @@
+/*============================================================================
+*
+*  Virtual Machine buffered output stream implementation
+*
+*  (C) Bolat Basheyev 2021
+*
+============================================================================*/
+#include "runtime/BufferedOutput.h"
+
+using namespace std;
+using namespace vm;
+
+BlockBuffer::BlockBuffer(ostream& target, size_t size) : target(target) {
+	block.resize(size > 0 ? size : 1);
+	setp(block.data(), block.data() + block.size());
+}
+
+//-----------------------------------------------------------------------------
+// Passes collected output to target stream and restarts block
+//-----------------------------------------------------------------------------
+bool BlockBuffer::writeBlock() {
+	ptrdiff_t count = pptr() - pbase();
+	if (count > 0) target.write(pbase(), count);
+	setp(block.data(), block.data() + block.size());
+	return !target.fail();
+}
+
+int BlockBuffer::overflow(int c) {
+	if (!writeBlock()) return traits_type::eof();
+	if (traits_type::eq_int_type(c, traits_type::eof())) return traits_type::not_eof(c);
+	*pptr() = traits_type::to_char_type(c);
+	pbump(1);
+	return c;
+}
+
+int BlockBuffer::sync() {
+	if (!writeBlock()) return -1;
+	target.flush();
+	return target.fail() ? -1 : 0;
+}
+
+//-----------------------------------------------------------------------------
+// Stream buffer is member, so it is attached after it is constructed
+//-----------------------------------------------------------------------------
+BufferedOutput::BufferedOutput(ostream& target, size_t size) : ostream(NULL), buffer(target, size) {
+	rdbuf(&buffer);
+}
+
+BufferedOutput::~BufferedOutput() {
+	flush();
+}
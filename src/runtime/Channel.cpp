@@ -0,0 +1,133 @@
+/*============================================================================
+*
+*  Virtual Machine lock-free channels implementation
+*
+*  (C) Bolat Basheyev 2021
+*
+============================================================================*/
+#include <cstring>
+#include <algorithm>
+#include "runtime/Channel.h"
+
+using namespace std;
+using namespace vm;
+
+//-----------------------------------------------------------------------------
+// Rounds capacity up to power of two
+//-----------------------------------------------------------------------------
+static uint32_t roundCapacity(WORD capacity) {
+	uint32_t size = 2;
+	while (size < (uint32_t) capacity && size < 0x40000000) size <<= 1;
+	return size;
+}
+
+//-----------------------------------------------------------------------------
+// Creates channel of given type
+//-----------------------------------------------------------------------------
+shared_ptr<Channel> Channel::create(ChannelType type, WORD capacity) {
+	if (type == ChannelType::SPSC) return make_shared<SPSCChannel>(capacity);
+	return make_shared<MPMCChannel>(capacity);
+}
+
+//-----------------------------------------------------------------------------
+// Single producer single consumer ring buffer
+//-----------------------------------------------------------------------------
+SPSCChannel::SPSCChannel(WORD capacity) {
+	uint32_t size = roundCapacity(capacity);
+	buffer = new WORD[size];
+	mask = size - 1;
+}
+
+SPSCChannel::~SPSCChannel() {
+	delete[] buffer;
+}
+
+//-----------------------------------------------------------------------------
+// Copies as many words as fit (up to two blocks) and publishes them at once
+//-----------------------------------------------------------------------------
+WORD SPSCChannel::send(const WORD* data, WORD count) {
+	if (count <= 0 || isClosed()) return 0;
+	uint32_t t = tail.load(memory_order_relaxed);
+	uint32_t h = head.load(memory_order_acquire);
+	uint32_t n = min((uint32_t) count, mask + 1 - (t - h));
+	if (n == 0) return 0;
+	uint32_t start = t & mask;
+	uint32_t first = min(n, mask + 1 - start);
+	memcpy(buffer + start, data, first * sizeof(WORD));
+	memcpy(buffer, data + first, (n - first) * sizeof(WORD));
+	tail.store(t + n, memory_order_release);
+	return (WORD) n;
+}
+
+//-----------------------------------------------------------------------------
+// Copies as many words as available (up to two blocks) and releases them
+//-----------------------------------------------------------------------------
+WORD SPSCChannel::receive(WORD* data, WORD count) {
+	if (count <= 0) return 0;
+	uint32_t h = head.load(memory_order_relaxed);
+	uint32_t t = tail.load(memory_order_acquire);
+	uint32_t n = min((uint32_t) count, t - h);
+	if (n == 0) return 0;
+	uint32_t start = h & mask;
+	uint32_t first = min(n, mask + 1 - start);
+	memcpy(data, buffer + start, first * sizeof(WORD));
+	memcpy(data + first, buffer, (n - first) * sizeof(WORD));
+	head.store(h + n, memory_order_release);
+	return (WORD) n;
+}
+
+//-----------------------------------------------------------------------------
+// Multiple producers multiple consumers ring buffer (slot sequence numbers)
+//-----------------------------------------------------------------------------
+MPMCChannel::MPMCChannel(WORD capacity) {
+	uint32_t size = roundCapacity(capacity);
+	slots = new Slot[size];
+	mask = size - 1;
+	for (uint32_t i = 0; i < size; i++) slots[i].sequence.store(i, memory_order_relaxed);
+}
+
+MPMCChannel::~MPMCChannel() {
+	delete[] slots;
+}
+
+//-----------------------------------------------------------------------------
+// Claims free slots one by one while channel is not full
+//-----------------------------------------------------------------------------
+WORD MPMCChannel::send(const WORD* data, WORD count) {
+	if (count <= 0 || isClosed()) return 0;
+	WORD sent = 0;
+	uint32_t pos = tail.load(memory_order_relaxed);
+	while (sent < count) {
+		Slot& slot = slots[pos & mask];
+		int32_t diff = (int32_t)(slot.sequence.load(memory_order_acquire) - pos);
+		if (diff == 0) {
+			if (!tail.compare_exchange_weak(pos, pos + 1, memory_order_relaxed)) continue;
+			slot.value = data[sent++];
+			slot.sequence.store(pos + 1, memory_order_release);
+			pos++;
+		} else if (diff < 0) break;                           // channel is full
+		else pos = tail.load(memory_order_relaxed);           // other producer took slot
+	}
+	return sent;
+}
+
+//-----------------------------------------------------------------------------
+// Claims filled slots one by one while channel is not empty
+//-----------------------------------------------------------------------------
+WORD MPMCChannel::receive(WORD* data, WORD count) {
+	if (count <= 0) return 0;
+	WORD received = 0;
+	uint32_t pos = head.load(memory_order_relaxed);
+	while (received < count) {
+		Slot& slot = slots[pos & mask];
+		int32_t diff = (int32_t)(slot.sequence.load(memory_order_acquire) - (pos + 1));
+		if (diff == 0) {
+			if (!head.compare_exchange_weak(pos, pos + 1, memory_order_relaxed)) continue;
+			data[received++] = slot.value;
+			slot.sequence.store(pos + mask + 1, memory_order_release);
+			pos++;
+		} else if (diff < 0) break;                           // channel is empty
+		else pos = head.load(memory_order_relaxed);           // other consumer took slot
+	}
+	return received;
+}
@@ -0,0 +1,74 @@
+/*============================================================================
+*
+*  Virtual Machine code segment class implementation
+*
+*  Code segment is immutable once loaded, so many virtual machines may run
+*  the same code segment concurrently. Only lazily compiled segments are
+*  appended and patched, they must not be shared until all stubs resolved.
+*
+*  (C) Bolat Basheyev 2021
+*
+============================================================================*/
+#include <cstring>
+#include "runtime/VirtualMachine.h"
+#include "runtime/ImageFile.h"
+
+using namespace std;
+using namespace vm;
+
+//-----------------------------------------------------------------------------
+// Copies executable image code to code segment
+//-----------------------------------------------------------------------------
+CodeSegment::CodeSegment(ExecutableImage& image) {
+	file = NULL;
+	words.assign(image.getImage(), image.getImage() + image.getSize());
+	code = words.data();
+	size = (WORD) words.size();
+}
+
+//-----------------------------------------------------------------------------
+// Maps compiled image file, code is executed right from the mapping
+//-----------------------------------------------------------------------------
+CodeSegment::CodeSegment(const char* filename) {
+	file = new ImageFile(filename);
+	code = NULL;
+	size = 0;
+	if (!file->isValid()) return;
+	code = file->getCode();
+	size = file->getSize();
+}
+
+//-----------------------------------------------------------------------------
+// Copies code words (code segment restored from checkpoint file)
+//-----------------------------------------------------------------------------
+CodeSegment::CodeSegment(const WORD* code, WORD size) {
+	file = NULL;
+	words.assign(code, code + size);
+	this->code = words.data();
+	this->size = size;
+}
+
+CodeSegment::~CodeSegment() {
+	if (file != NULL) delete file;
+	file = NULL;
+	code = NULL;
+}
+
+//-----------------------------------------------------------------------------
+// Appends executable image code starting from address (lazy compilation)
+//-----------------------------------------------------------------------------
+void CodeSegment::append(ExecutableImage& image, WORD from) {
+	if (file != NULL) return;
+	words.resize(image.getSize());
+	memcpy(words.data() + from, image.getImage() + from, (image.getSize() - from) * sizeof(WORD));
+	code = words.data();
+	size = (WORD) words.size();
+}
+
+//-----------------------------------------------------------------------------
+// Patches code word (lazy stubs and call targets only)
+//-----------------------------------------------------------------------------
+void CodeSegment::writeWord(WORD address, WORD value) {
+	if (file != NULL || address < 0 || address >= size) return;
+	words[address] = value;
+}
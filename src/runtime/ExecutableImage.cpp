@@ -9,7 +9,13 @@
 #include <cstring>
 #include <iostream>
 #include <iomanip>
+#include <fstream>
+#include <filesystem>
+#include <random>
+#include <algorithm>
 #include "runtime/VirtualMachine.h"
+#include "runtime/ImageFile.h"
+#include "runtime/Profile.h"
 
 using namespace std;
 using namespace vm;
@@ -29,6 +35,11 @@ ExecutableImage::~ExecutableImage() {
 //-----------------------------------------------------------------------------
 void ExecutableImage::clear() {
 	image.clear();
+	symbols.clear();
+	relocations.clear();
+	lines.clear();
+	sourceHash = 0;
+	memorySize = 0;
 	emitAddress = 0;
 }
 
@@ -104,11 +115,55 @@ WORD ExecutableImage::emit(ExecutableImage& img) {
 	WORD wordsCount = img.getSize();
 	prepareSpace(wordsCount);
 	memcpy(image.data() + emitAddress, img.getImage(), wordsCount * sizeof(WORD));
+	for (WORD address : img.getRelocations()) relocations.push_back(startAddress + address);
+	for (LineEntry& line : img.getLines()) addLine(startAddress + line.address, line.row, line.col);
 	emitAddress += wordsCount;
 	return startAddress;
 }
 
 
+//-----------------------------------------------------------------------------
+// Marks word at specified address as function address to be relocated
+//-----------------------------------------------------------------------------
+void ExecutableImage::addRelocation(WORD address) {
+	relocations.push_back(address);
+}
+
+
+//-----------------------------------------------------------------------------
+// Marks code emitted from current EmitAddress as generated from source line
+//-----------------------------------------------------------------------------
+void ExecutableImage::addLine(WORD row, WORD col) {
+	addLine(emitAddress, row, col);
+}
+
+
+//-----------------------------------------------------------------------------
+// Adds line table entry (entries are added in address order, entry without
+// code is replaced, entry of the same position as previous is skipped)
+//-----------------------------------------------------------------------------
+void ExecutableImage::addLine(WORD address, WORD row, WORD col) {
+	if (!lines.empty()) {
+		LineEntry& last = lines.back();
+		if (address < last.address || (last.row == row && last.col == col)) return;
+		if (last.address == address) lines.pop_back();
+		if (!lines.empty() && lines.back().row == row && lines.back().col == col) return;
+	}
+	lines.push_back({ address, row, col });
+}
+
+
+//-----------------------------------------------------------------------------
+// Returns line table entry of instruction at address (NULL if unknown)
+//-----------------------------------------------------------------------------
+const LineEntry* ExecutableImage::findLine(WORD address) {
+	auto it = upper_bound(lines.begin(), lines.end(), address,
+		[](WORD value, const LineEntry& line) { return value < line.address; });
+	if (it == lines.begin()) return NULL;
+	return &*(it - 1);
+}
+
+
 //-----------------------------------------------------------------------------
 // Write WORD to specified memory address
 //-----------------------------------------------------------------------------
@@ -156,9 +211,110 @@ WORD ExecutableImage::getSize() {
 
 
 //-----------------------------------------------------------------------------
-// Disassembles executable image to console
+// Adds function symbol (lazily compiled functions have stub and body entries)
+//-----------------------------------------------------------------------------
+ImageSymbol& ExecutableImage::addSymbol(string name, WORD address, WORD argCount) {
+	ImageSymbol symbol;
+	symbol.name = name;
+	symbol.address = address;
+	symbol.argCount = argCount;
+	symbols.push_back(symbol);
+	return symbols.back();
+}
+
+
+//-----------------------------------------------------------------------------
+// Saves executable image to file (written to temporary file and renamed)
+//-----------------------------------------------------------------------------
+bool ExecutableImage::save(const char* filename) {
+	ImageHeader header;
+	memset(&header, 0, sizeof(header));
+	header.magic = IMAGE_MAGIC;
+	header.version = IMAGE_VERSION;
+	header.headerSize = sizeof(ImageHeader);
+	header.sourceHash = sourceHash;
+	header.codeOffset = sizeof(ImageHeader);
+	header.codeSize = (uint32_t) image.size();
+	header.symbolsOffset = (uint32_t) (header.codeOffset + image.size() * sizeof(WORD));
+	header.symbolsCount = (uint32_t) symbols.size();
+	header.linesCount = (uint32_t) lines.size();
+	header.entryPoint = 0;
+	header.stackWords = (uint32_t) getMaxStackUsage();
+	header.memoryWords = (uint32_t) (memorySize / sizeof(WORD));
+
+	// serialize code, symbols and line table sections
+	vector<char> data(header.symbolsOffset);
+	memcpy(data.data() + header.codeOffset, image.data(), image.size() * sizeof(WORD));
+	for (ImageSymbol& symbol : symbols) {
+		WORD record[IMAGE_SYMBOL_WORDS] = { 
+			symbol.address, symbol.argCount, symbol.size, 
+			(WORD) symbol.fingerprint, (WORD) (symbol.fingerprint >> 32),
+			(WORD) symbol.relocations.size(), (WORD) symbol.name.size() };
+		size_t nameSize = (symbol.name.size() + sizeof(WORD) - 1) / sizeof(WORD) * sizeof(WORD);
+		size_t relocationsSize = symbol.relocations.size() * sizeof(WORD);
+		size_t offset = data.size();
+		data.resize(offset + sizeof(record) + nameSize + relocationsSize);
+		char* cursor = data.data() + offset;
+		memcpy(cursor, record, sizeof(record));
+		memcpy(cursor + sizeof(record), symbol.name.data(), symbol.name.size());
+		memcpy(cursor + sizeof(record) + nameSize, symbol.relocations.data(), relocationsSize);
+	}
+	header.linesOffset = (uint32_t) data.size();
+	data.resize(data.size() + lines.size() * IMAGE_LINE_WORDS * sizeof(WORD));
+	for (size_t i = 0; i < lines.size(); i++) {
+		WORD record[IMAGE_LINE_WORDS] = { lines[i].address, lines[i].row, lines[i].col };
+		memcpy(data.data() + header.linesOffset + i * sizeof(record), record, sizeof(record));
+	}
+	memcpy(data.data(), &header, sizeof(header));
+	((ImageHeader*) data.data())->checksum = imageChecksum(data.data(), data.size());
+
+	string temporary = string(filename) + ".tmp" + to_string(random_device{}());
+	ofstream file(temporary, ios::out | ios::binary | ios::trunc);
+	if (!file.is_open()) return false;
+	file.write(data.data(), data.size());
+	file.close();
+	error_code error;
+	if (file.fail()) {
+		filesystem::remove(temporary, error);
+		return false;
+	}
+	filesystem::rename(temporary, filename, error);
+	if (error) filesystem::remove(temporary, error);
+	return !error;
+}
+
+
+//-----------------------------------------------------------------------------
+// Loads executable image from file
 //-----------------------------------------------------------------------------
-void ExecutableImage::disassemble() {
+bool ExecutableImage::load(const char* filename) {
+	ImageFile file(filename);
+	return load(file);
+}
+
+
+bool ExecutableImage::load(ImageFile& file) {
+	clear();
+	if (!file.isValid()) return false;
+	image.assign(file.getCode(), file.getCode() + file.getSize());
+	sourceHash = file.getHeader()->sourceHash;
+	memorySize = file.getMemorySize();
+	emitAddress = (WORD) image.size();
+	if (!file.readSymbols(symbols)) return false;
+	if (!file.readLines(lines)) return false;
+	for (ImageSymbol& symbol : symbols) {
+		for (WORD offset : symbol.relocations) relocations.push_back(symbol.address + offset);
+	}
+	return true;
+}
+
+
+//-----------------------------------------------------------------------------
+// Disassembles executable image to console (with profile each instruction
+// is annotated with executions count and percentage of all executions,
+// conditional jumps with taken / not taken counts, lines with source row)
+//-----------------------------------------------------------------------------
+void ExecutableImage::disassemble(Profile* profile) {
 	cout << "-----------------------------------------------------" << endl;
 	cout << "Virtual machine executable image disassembly" << endl;
 	cout << "-----------------------------------------------------" << endl;
@@ -166,11 +322,18 @@ void ExecutableImage::disassemble() {
 	WORD opcode;
 	WORD previousOp = -1;
 	WORD ip = 0;
+	size_t line = 0;
 	do {
+		if (profile != NULL) {
+			while (line < lines.size() && lines[line].address < ip) line++;
+			if (line < lines.size() && lines[line].address == ip) {
+				cout << "; line " << lines[line].row << ":" << lines[line].col << endl;
+			}
+		}
 		opcode = image[ip];
-		if (opcode != OP_HALT) ip += printMnemomic(ip);
+		if (opcode != OP_HALT) ip += printMnemomic(ip, profile);
 		else {
-			if (previousOp != OP_HALT) printMnemomic(ip);
+			if (previousOp != OP_HALT) printMnemomic(ip, profile);
 			ip++;
 		}
 		previousOp = opcode;
@@ -181,10 +344,16 @@ void ExecutableImage::disassemble() {
 //-----------------------------------------------------------------------------
 // Prints instruction mnemonic
 //-----------------------------------------------------------------------------
-WORD ExecutableImage::printMnemomic(WORD address) {
+WORD ExecutableImage::printMnemomic(WORD address, Profile* profile) {
 	WORD ip = address;
 	WORD opcode = image[ip++];
 	cout << "[" << setw(6) << address << "]    ";
+	if (profile != NULL) {
+		uint64_t count = profile->getCount(address);
+		double percent = profile->getTotal() > 0 ? count * 100.0 / profile->getTotal() : 0;
+		cout << setw(12) << count << setw(8) << fixed << setprecision(2) << percent << "%    ";
+		cout << defaultfloat << setprecision(6);
+	}
 	switch (opcode) {
 		//------------------------------------------------------------------------
 		// STACK OPERATIONS
@@ -192,6 +361,7 @@ WORD ExecutableImage::printMnemomic(WORD address) {
 		case OP_CONST:	cout << "iconst  " << image[ip++]; break;
 		case OP_PUSH:   cout << "ipush   [" << image[ip++] << "]"; break;
 		case OP_POP:    cout << "ipop    [" << image[ip++] << "]"; break;
+		case OP_DROP:   cout << "idrop   "; break;
 		//------------------------------------------------------------------------
 		// ARITHMETIC OPERATIONS
 		//------------------------------------------------------------------------
@@ -229,6 +399,7 @@ WORD ExecutableImage::printMnemomic(WORD address) {
 		case OP_CALL:   cout << "call    [" << image[ip++] << "], " << image[ip++]; break;
 		case OP_RET:    cout << "ret     "; break;
 		case OP_SYSCALL:cout << "syscall 0x" << setbase(16) << image[ip++] << setbase(10); break;
+		case OP_TRAP:   cout << "trap    #" << image[ip++]; break;
 		case OP_HALT: 	cout << "---- halt ----"; break;
 		//------------------------------------------------------------------------
 		// LOCAL VARIABLES AND ARGUMENTS ACCESS OPERATIONS
@@ -236,10 +407,102 @@ WORD ExecutableImage::printMnemomic(WORD address) {
 		case OP_LOAD:	cout << "iload   #" << image[ip++]; break;
 		case OP_STORE:	cout << "istore  #" << image[ip++]; break;
 		case OP_ARG:	cout << "iarg    #" << image[ip++]; break;
+		//------------------------------------------------------------------------
+		// SHARED MEMORY ATOMIC OPERATIONS
+		//------------------------------------------------------------------------
+		case OP_AFADD:  cout << "afadd   "; break;
+		case OP_ACAS:   cout << "acas    "; break;
+		case OP_ALOAD:  cout << "aload   "; break;
+		case OP_ASTORE: cout << "astore  "; break;
 	default:
 		cout << "0x" << setbase(16) << opcode << setbase(10);
 	}
+	if (profile != NULL && opcode == OP_IFZERO && profile->getCount(address) > 0) {
+		cout << "    taken " << profile->getTaken(address) << ", not taken " << profile->getNotTaken(address);
+	}
 	cout << endl;
 	return ip - address;
 }
 
+
+
+//-----------------------------------------------------------------------------
+// Words pushed (positive) or popped (negative) by system call
+//-----------------------------------------------------------------------------
+static WORD sysCallStackEffect(WORD n) {
+	switch (n) {
+	case SYS_READ_INT:
+	case SYS_CHECKPOINT:         return 1;
+	case SYS_PRINT_STRING:
+	case SYS_PRINT_INT:
+	case SYS_FIBER_SPAWN:
+	case SYS_THREAD_SPAWN:
+	case SYS_CHANNEL_SEND:
+	case SYS_CHANNEL_CLOSE:      return -1;
+	case SYS_CHANNEL_SEND_BLOCK:
+	case SYS_CHANNEL_RECV_BLOCK: return -2;
+	}
+	return 0;
+}
+
+
+//-----------------------------------------------------------------------------
+// Returns maximum stack words used by function code (locals and operands,
+// called functions frames excluded): stack depth is propagated along jumps
+// from function entry, code generator leaves the same depth on every path
+// to an instruction
+//-----------------------------------------------------------------------------
+WORD ExecutableImage::getStackUsage(WORD address, WORD size) {
+	if (address < 0 || size <= 0 || address + size > (WORD) image.size()) return 0;
+	vector<WORD> depths(size, -1);
+	vector<WORD> pending = { 0 };
+	WORD usage = 0;
+	depths[0] = 0;
+	auto follow = [&](WORD target, WORD depth) {
+		target -= address;
+		if (target < 0 || target >= size || depths[target] >= 0) return;
+		depths[target] = depth;
+		pending.push_back(target);
+	};
+	while (!pending.empty()) {
+		WORD offset = pending.back();
+		pending.pop_back();
+		WORD ip = address + offset;
+		WORD depth = depths[offset];
+		switch (image[ip]) {
+		case OP_CONST:
+		case OP_PUSH:
+		case OP_LOAD:
+		case OP_ARG:     depth++; follow(ip + 2, depth); break;
+		case OP_POP:
+		case OP_STORE:   depth--; follow(ip + 2, depth); break;
+		case OP_JMP:     follow(ip + 1 + image[ip + 1], depth); break;
+		case OP_IFZERO:  depth--; follow(ip + 2, depth); follow(ip + 1 + image[ip + 1], depth); break;
+		case OP_CALL:    depth += 1 - image[ip + 2]; follow(ip + 3, depth); break;
+		case OP_SYSCALL: depth += sysCallStackEffect(image[ip + 1]); follow(ip + 2, depth); break;
+		case OP_NOT:
+		case OP_LNOT:
+		case OP_ALOAD:   follow(ip + 1, depth); break;
+		case OP_ACAS:    depth -= 2; follow(ip + 1, depth); break;
+		case OP_ASTORE:  depth -= 2; follow(ip + 1, depth); break;
+		case OP_RET:
+		case OP_TRAP:
+		case OP_HALT:    break;
+		default:         depth--; follow(ip + 1, depth); break; // binary operations, drop
+		}
+		usage = max(usage, max(depth, depths[offset])); // results are pushed after operands are popped
+	}
+	return usage;
+}
+
+
+//-----------------------------------------------------------------------------
+// Returns maximum stack usage of image functions
+//-----------------------------------------------------------------------------
+WORD ExecutableImage::getMaxStackUsage() {
+	WORD usage = 0;
+	for (ImageSymbol& symbol : symbols) {
+		if (symbol.size > 0) usage = max(usage, getStackUsage(symbol.address, symbol.size));
+	}
+	return usage;
+}
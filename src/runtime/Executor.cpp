@@ -0,0 +1,376 @@
+/*============================================================================
+*
+*  Virtual Machine pool executor implementation
+*
+*  (C) Bolat Basheyev 2021
+*
+============================================================================*/
+#include <sstream>
+#include <algorithm>
+#include "runtime/Executor.h"
+
+using namespace std;
+using namespace vm;
+
+//-----------------------------------------------------------------------------
+// Starts worker threads and creates one virtual machine per worker
+//-----------------------------------------------------------------------------
+Executor::Executor(unsigned workersCount, size_t memorySize) {
+	if (workersCount == 0) workersCount = thread::hardware_concurrency();
+	if (workersCount == 0) workersCount = 1;
+	this->memorySize = memorySize;
+	nextId = 0;
+	machinesCount = 0;
+	parkedCount = 0;
+	queued = 0;
+	pending = 0;
+	stopping = false;
+	nextWorker = 0;
+	stolen = 0;
+	preempted = 0;
+	timeSlice = FUEL_UNLIMITED;
+	metricsEnabled = false;
+	for (unsigned i = 0; i < workersCount; i++) {
+		VirtualMachine* machine = new VirtualMachine(memorySize);
+		machine->setVerbose(false);
+		idleMachines.push_back(machine);
+		machinesCount++;
+		workers.push_back(new Worker());
+	}
+	for (unsigned i = 0; i < workersCount; i++) {
+		workers[i]->worker = thread(&Executor::run, this, i);
+	}
+}
+
+//-----------------------------------------------------------------------------
+// Closes inputs of interactive jobs, completes jobs, stops and releases
+//-----------------------------------------------------------------------------
+Executor::~Executor() {
+	vector<uint64_t> ids;
+	{
+		lock_guard<mutex> guard(lock);
+		for (auto& input : inputs) ids.push_back(input.first);
+	}
+	for (uint64_t id : ids) closeInput(id);
+	wait();
+	{
+		lock_guard<mutex> guard(lock);
+		stopping = true;
+	}
+	jobsAvailable.notify_all();
+	for (Worker* w : workers) {
+		w->worker.join();
+		delete w;
+	}
+	workers.clear();
+	for (VirtualMachine* machine : idleMachines) delete machine;
+	idleMachines.clear();
+}
+
+//-----------------------------------------------------------------------------
+// Submits job running code segment from the start
+//-----------------------------------------------------------------------------
+uint64_t Executor::submit(shared_ptr<CodeSegment> code, const string& input, ostream* output,
+	bool interactive, const vector<shared_ptr<Channel>>& channels) {
+	Job job;
+	job.code = code;
+	job.channels = channels;
+	job.output = output;
+	return submitJob(job, input, interactive);
+}
+
+//-----------------------------------------------------------------------------
+// Submits job resuming snapshot (copy-on-write fork of paused machine)
+//-----------------------------------------------------------------------------
+uint64_t Executor::submit(shared_ptr<Snapshot> snapshot, const string& input, ostream* output,
+	bool interactive, const vector<shared_ptr<Channel>>& channels) {
+	Job job;
+	job.code = snapshot->getCode();
+	job.snapshot = snapshot;
+	job.channels = channels;
+	job.output = output;
+	return submitJob(job, input, interactive);
+}
+
+//-----------------------------------------------------------------------------
+// Submits job to workers deques in round robin order. Input integers are
+// queued to job input, input of interactive job is open until closed
+//-----------------------------------------------------------------------------
+uint64_t Executor::submitJob(Job& job, const string& input, bool interactive) {
+	job.input = make_shared<InputQueue>();
+	if (job.output == NULL) job.discard = make_shared<ostream>(nullptr);
+	job.machine = NULL;
+	job.submitted = chrono::steady_clock::now();
+	istringstream values(input);
+	WORD value;
+	while (values >> value) job.input->push(value);
+	if (!interactive) job.input->close();
+	unsigned index;
+	{
+		lock_guard<mutex> guard(lock);
+		if (pending == 0 && latencies.empty()) started = job.submitted;
+		nextWorker = (nextWorker + 1) % workers.size();
+		index = nextWorker;
+		job.id = nextId++;
+		inputs[job.id] = job.input;
+		pending++;
+	}
+	uint64_t id = job.id;
+	pushJob(index, job);
+	return id;
+}
+
+//-----------------------------------------------------------------------------
+// Feeds input value to interactive job and wakes it if parked
+//-----------------------------------------------------------------------------
+void Executor::feed(uint64_t id, WORD value) {
+	shared_ptr<InputQueue> input;
+	{
+		lock_guard<mutex> guard(lock);
+		auto it = inputs.find(id);
+		if (it == inputs.end()) return;
+		input = it->second;
+	}
+	input->push(value);
+	wakeJob(id);
+}
+
+//-----------------------------------------------------------------------------
+// Closes input of interactive job (further reads return 0)
+//-----------------------------------------------------------------------------
+void Executor::closeInput(uint64_t id) {
+	shared_ptr<InputQueue> input;
+	{
+		lock_guard<mutex> guard(lock);
+		auto it = inputs.find(id);
+		if (it == inputs.end()) return;
+		input = it->second;
+	}
+	input->close();
+	wakeJob(id);
+}
+
+//-----------------------------------------------------------------------------
+// Moves parked job back to deques (no-op if job is queued or running,
+// worker checks input before parking under the same lock)
+//-----------------------------------------------------------------------------
+void Executor::wakeJob(uint64_t id) {
+	Job job;
+	unsigned index;
+	{
+		lock_guard<mutex> guard(lock);
+		auto it = parked.find(id);
+		if (it == parked.end()) return;
+		job = move(it->second);
+		parked.erase(it);
+		nextWorker = (nextWorker + 1) % workers.size();
+		index = nextWorker;
+	}
+	pushJob(index, job);
+}
+
+//-----------------------------------------------------------------------------
+// Pushes job to the back (or front) of worker deque and signals workers
+//-----------------------------------------------------------------------------
+void Executor::pushJob(unsigned index, Job& job, bool front) {
+	Worker* w = workers[index];
+	{
+		lock_guard<mutex> guard(w->lock);
+		if (front) w->jobs.push_front(move(job));
+		else w->jobs.push_back(move(job));
+	}
+	{
+		lock_guard<mutex> guard(lock);
+		queued++;
+	}
+	jobsAvailable.notify_one();
+}
+
+//-----------------------------------------------------------------------------
+// Waits until all submitted jobs are completed
+//-----------------------------------------------------------------------------
+void Executor::wait() {
+	unique_lock<mutex> guard(lock);
+	jobsDone.wait(guard, [this] { return pending == 0; });
+}
+
+//-----------------------------------------------------------------------------
+// Takes job from the back of own deque or steals from the front of others
+//-----------------------------------------------------------------------------
+bool Executor::takeJob(unsigned index, Job& job) {
+	Worker* own = workers[index];
+	{
+		lock_guard<mutex> guard(own->lock);
+		if (!own->jobs.empty()) {
+			job = move(own->jobs.back());
+			own->jobs.pop_back();
+			return true;
+		}
+	}
+	size_t count = workers.size();
+	for (size_t i = 1; i < count; i++) {
+		Worker* victim = workers[(index + i) % count];
+		lock_guard<mutex> guard(victim->lock);
+		if (!victim->jobs.empty()) {
+			job = move(victim->jobs.front());
+			victim->jobs.pop_front();
+			stolen++;
+			return true;
+		}
+	}
+	return false;
+}
+
+//-----------------------------------------------------------------------------
+// Worker thread loop: runs jobs until stopped
+//-----------------------------------------------------------------------------
+void Executor::run(unsigned index) {
+	Job job;
+	for (;;) {
+		{
+			unique_lock<mutex> guard(lock);
+			jobsAvailable.wait(guard, [this] { return queued > 0 || stopping; });
+			if (queued == 0 && stopping) return;
+		}
+		if (!takeJob(index, job)) continue;
+		{
+			lock_guard<mutex> guard(lock);
+			queued--;
+		}
+		runJob(index, job);
+	}
+}
+
+//-----------------------------------------------------------------------------
+// Starts job on idle virtual machine or resumes parked job on its machine.
+// Job waiting for input is parked, preempted job is requeued to the front
+// (other jobs of worker run first), completed job releases its machine
+//-----------------------------------------------------------------------------
+void Executor::runJob(unsigned index, Job& job) {
+	ExecutionStatus status;
+	if (job.machine != NULL) job.machine->setFuel(timeSlice);
+	if (job.machine != NULL) job.machine->setMetrics(metricsEnabled ? &workers[index]->metrics : NULL);
+	if (job.machine == NULL) {
+		{
+			lock_guard<mutex> guard(lock);
+			if (!idleMachines.empty()) {
+				job.machine = idleMachines.back();
+				idleMachines.pop_back();
+			}
+		}
+		if (job.machine == NULL) {
+			job.machine = new VirtualMachine(memorySize);
+			job.machine->setVerbose(false);
+			lock_guard<mutex> guard(lock);
+			machinesCount++;
+		}
+		if (job.snapshot != NULL && !job.snapshot->restore(*job.machine)) {
+			// snapshot of other memory size is forked to new machine
+			VirtualMachine* fork = job.snapshot->fork();
+			if (fork != NULL) {
+				fork->setVerbose(false);
+				lock_guard<mutex> guard(lock);
+				idleMachines.push_back(job.machine);
+				job.machine = fork;
+			}
+		}
+		job.machine->setInputQueue(job.input);
+		for (auto& channel : job.channels) job.machine->attachChannel(channel);
+		job.machine->setOutput(job.output == NULL ? job.discard.get() : job.output);
+		job.machine->setFuel(timeSlice);
+		job.machine->setMetrics(metricsEnabled ? &workers[index]->metrics : NULL);
+		if (job.snapshot != NULL && job.machine->getStatus() == ExecutionStatus::PAUSED) {
+			status = job.machine->resume();
+		} else if (job.snapshot == NULL && job.machine->loadCode(job.code)) {
+			status = job.machine->execute();
+		} else {
+			*job.machine->getOutput() << "Runtime error - invalid code segment" << endl;
+			status = ExecutionStatus::ERROR;
+		}
+	} else status = job.machine->resume();
+
+	if (status == ExecutionStatus::WAITING) {
+		unique_lock<mutex> guard(lock);
+		if (!job.input->isReady()) {
+			parked[job.id] = move(job);
+			parkedCount++;
+			return;
+		}
+		guard.unlock();
+		pushJob(index, job);
+		return;
+	}
+
+	if (status == ExecutionStatus::EXHAUSTED) {
+		preempted++;
+		pushJob(index, job, true);
+		return;
+	}
+
+	job.machine->setInputQueue(NULL);
+	job.machine->setOutput(NULL);
+	job.machine->setFuel(FUEL_UNLIMITED);
+	job.machine->reset();
+	TimePoint now = chrono::steady_clock::now();
+	double latency = chrono::duration<double>(now - job.submitted).count();
+	lock_guard<mutex> guard(lock);
+	if ((size_t) job.machine->getMaxAddress() == min(memorySize, MAX_MEMORY_SIZE) / sizeof(WORD)) idleMachines.push_back(job.machine);
+	else delete job.machine;
+	inputs.erase(job.id);
+	latencies.push_back(latency);
+	finished = now;
+	if (--pending == 0) jobsDone.notify_all();
+}
+
+//-----------------------------------------------------------------------------
+// Returns throughput and latency statistics of completed jobs
+//-----------------------------------------------------------------------------
+ExecutorStats Executor::getStats() {
+	ExecutorStats stats = {};
+	vector<double> sorted;
+	{
+		lock_guard<mutex> guard(lock);
+		sorted = latencies;
+		if (!sorted.empty()) stats.seconds = chrono::duration<double>(finished - started).count();
+		stats.parked = parkedCount;
+		stats.machines = machinesCount;
+	}
+	stats.stolen = stolen;
+	stats.preempted = preempted;
+	stats.jobs = sorted.size();
+	if (sorted.empty()) return stats;
+	sort(sorted.begin(), sorted.end());
+	double total = 0;
+	for (double l : sorted) total += l;
+	stats.throughput = stats.seconds > 0 ? stats.jobs / stats.seconds : 0;
+	stats.latencyMin = sorted.front();
+	stats.latencyAvg = total / sorted.size();
+	stats.latencyP50 = sorted[sorted.size() / 2];
+	stats.latencyP99 = sorted[min(sorted.size() - 1, sorted.size() * 99 / 100)];
+	stats.latencyMax = sorted.back();
+	return stats;
+}
+
+//-----------------------------------------------------------------------------
+// Returns live metrics aggregated over workers
+//-----------------------------------------------------------------------------
+MetricsReport Executor::getMetrics() {
+	MetricsReport report = {};
+	for (Worker* worker : workers) report.add(worker->metrics.read());
+	return report;
+}
+
+MetricsReport Executor::getWorkerMetrics(unsigned index) {
+	return workers[index]->metrics.read();
+}
+
+//-----------------------------------------------------------------------------
+// Prints executor statistics
+//-----------------------------------------------------------------------------
+void ExecutorStats::print(ostream& out) {
+	out << "Jobs: " << jobs << " (stolen " << stolen << ", parked " << parked << ", preempted " << preempted << ")";
+	out << " in " << seconds << "s, " << throughput << " jobs/s" << endl;
+	out << "Latency: min=" << latencyMin << "s avg=" << latencyAvg << "s";
+	out << " p50=" << latencyP50 << "s p99=" << latencyP99 << "s max=" << latencyMax << "s" << endl;
+	out << "Virtual machines: " << machines << endl;
+}
@@ -0,0 +1,237 @@
+/*============================================================================
+*
+*  Virtual Machine compiled executable image file implementation
+*
+*  (C) Bolat Basheyev 2021
+*
+============================================================================*/
+#include <cstring>
+#include <cstddef>
+#include <cstdlib>
+#include <filesystem>
+#include <sstream>
+#include <iomanip>
+#include <fstream>
+#include <random>
+
+#include "runtime/ImageFile.h"
+
+#ifndef _WIN32
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+using namespace std;
+using namespace vm;
+
+//-----------------------------------------------------------------------------
+// FNV-1a hash of data (pass previous hash to continue hashing)
+//-----------------------------------------------------------------------------
+uint64_t vm::hashData(const void* data, size_t size, uint64_t hash) {
+	const uint8_t* bytes = (const uint8_t*) data;
+	for (size_t i = 0; i < size; i++) {
+		hash ^= bytes[i];
+		hash *= 0x100000001B3;
+	}
+	return hash;
+}
+
+//-----------------------------------------------------------------------------
+// Checksum of image file data: header before and after checksum field and
+// all sections (data starts with header)
+//-----------------------------------------------------------------------------
+uint32_t vm::imageChecksum(const char* data, size_t size) {
+	size_t field = offsetof(ImageHeader, checksum);
+	size_t after = field + sizeof(uint32_t);
+	uint64_t hash = hashData(data, field);
+	hash = hashData(data + after, size - after, hash);
+	return (uint32_t)(hash ^ (hash >> 32));
+}
+
+//-----------------------------------------------------------------------------
+// Maps image file and validates its header, sections and checksum
+//-----------------------------------------------------------------------------
+ImageFile::ImageFile(const char* filename) : mapping(filename) {
+	header = NULL;
+	code = NULL;
+	if (!mapping.isOpen() || mapping.getSize() < sizeof(ImageHeader)) return;
+	header = (ImageHeader*) mapping.getData();
+	if (!validate()) {
+		header = NULL;
+		return;
+	}
+	code = (WORD*)(mapping.getData() + header->codeOffset);
+}
+
+ImageFile::~ImageFile() {
+	header = NULL;
+	code = NULL;
+}
+
+//-----------------------------------------------------------------------------
+// Checks image file header, sections bounds and checksum
+//-----------------------------------------------------------------------------
+bool ImageFile::validate() {
+	size_t size = mapping.getSize();
+	if (header->magic != IMAGE_MAGIC) return false;
+	if (header->version != IMAGE_VERSION) return false;
+	if (header->headerSize != sizeof(ImageHeader)) return false;
+	if (header->codeOffset % sizeof(WORD) != 0) return false;
+	if (header->codeOffset < header->headerSize || header->codeOffset > size) return false;
+	if (header->codeSize > (size - header->codeOffset) / sizeof(WORD)) return false;
+	if (header->symbolsOffset < header->codeOffset + header->codeSize * sizeof(WORD)) return false;
+	if (header->symbolsOffset > size) return false;
+	if (header->linesOffset < header->symbolsOffset || header->linesOffset > size) return false;
+	if (header->linesCount > (size - header->linesOffset) / (IMAGE_LINE_WORDS * sizeof(WORD))) return false;
+	return header->checksum == imageChecksum(mapping.getData(), size);
+}
+
+//-----------------------------------------------------------------------------
+// Reads symbols section records
+//-----------------------------------------------------------------------------
+bool ImageFile::readSymbols(vector<ImageSymbol>& symbols) {
+	if (!isValid()) return false;
+	char* cursor = mapping.getData() + header->symbolsOffset;
+	char* end = mapping.getData() + mapping.getSize();
+	WORD record[IMAGE_SYMBOL_WORDS];
+	for (uint32_t i = 0; i < header->symbolsCount; i++) {
+		if (end - cursor < (ptrdiff_t) sizeof(record)) return false;
+		memcpy(record, cursor, sizeof(record));
+		cursor += sizeof(record);
+		WORD relocationsCount = record[5];
+		WORD nameLength = record[6];
+		if (relocationsCount < 0 || nameLength < 0) return false;
+		size_t nameSize = (nameLength + sizeof(WORD) - 1) / sizeof(WORD) * sizeof(WORD);
+		size_t relocationsSize = relocationsCount * sizeof(WORD);
+		if ((size_t)(end - cursor) < nameSize + relocationsSize) return false;
+		ImageSymbol symbol;
+		symbol.address = record[0];
+		symbol.argCount = record[1];
+		symbol.size = record[2];
+		symbol.fingerprint = (uint32_t) record[3] | ((uint64_t)(uint32_t) record[4] << 32);
+		symbol.name.assign(cursor, nameLength);
+		cursor += nameSize;
+		symbol.relocations.resize(relocationsCount);
+		memcpy(symbol.relocations.data(), cursor, relocationsSize);
+		cursor += relocationsSize;
+		symbols.push_back(symbol);
+	}
+	return true;
+}
+
+
+//-----------------------------------------------------------------------------
+// Reads line table section records
+//-----------------------------------------------------------------------------
+bool ImageFile::readLines(vector<LineEntry>& lines) {
+	if (!isValid()) return false;
+	char* cursor = mapping.getData() + header->linesOffset;
+	WORD record[IMAGE_LINE_WORDS];
+	lines.clear();
+	for (uint32_t i = 0; i < header->linesCount; i++) {
+		memcpy(record, cursor, sizeof(record));
+		cursor += sizeof(record);
+		lines.push_back({ record[0], record[1], record[2] });
+	}
+	return true;
+}
+
+
+//-----------------------------------------------------------------------------
+// Updates recommended memory size in header of image file and checksum.
+// Image is written to temporary file and renamed, so machines mapping the
+// image (or reading it concurrently) never see partially written header
+//-----------------------------------------------------------------------------
+bool ImageFile::writeMemorySize(const char* filename, size_t memorySize) {
+	ifstream input(filename, ios::in | ios::binary);
+	if (!input.is_open()) return false;
+	vector<char> data((istreambuf_iterator<char>(input)), istreambuf_iterator<char>());
+	input.close();
+	if (data.size() < sizeof(ImageHeader)) return false;
+	ImageHeader* header = (ImageHeader*) data.data();
+	if (header->magic != IMAGE_MAGIC || header->version != IMAGE_VERSION) return false;
+	if (header->checksum != imageChecksum(data.data(), data.size())) return false;
+	header->memoryWords = (uint32_t) (memorySize / sizeof(WORD));
+	header->checksum = imageChecksum(data.data(), data.size());
+
+	string temporary = string(filename) + ".tmp" + to_string(random_device{}());
+	ofstream file(temporary, ios::out | ios::binary | ios::trunc);
+	if (!file.is_open()) return false;
+	file.write(data.data(), data.size());
+	file.close();
+	error_code error;
+	if (file.fail()) {
+		filesystem::remove(temporary, error);
+		return false;
+	}
+	filesystem::rename(temporary, filename, error);
+	if (error) filesystem::remove(temporary, error);
+	return !error;
+}
+
+
+//-----------------------------------------------------------------------------
+// Compiled images cache directory: per user cache location (not shared temp
+// directory), created private. Directory owned by other user is not used
+//-----------------------------------------------------------------------------
+ImageCache::ImageCache(string directory) {
+	if (directory.empty()) {
+		const char* variable = getenv("CVM_CACHE_DIR");
+		const char* xdg = getenv("XDG_CACHE_HOME");
+		const char* home = getenv("HOME");
+		if (variable != NULL && *variable) directory = variable;
+		else if (xdg != NULL && *xdg) directory = (filesystem::path(xdg) / "cvm").string();
+		else if (home != NULL && *home) directory = (filesystem::path(home) / ".cache" / "cvm").string();
+		else directory = (filesystem::current_path() / ".cvm-cache").string();
+	}
+	this->directory = directory;
+	error_code error;
+	filesystem::path parent = filesystem::path(directory).parent_path();
+	if (!parent.empty()) filesystem::create_directories(parent, error);
+#ifndef _WIN32
+	mkdir(directory.c_str(), 0700);
+	struct stat info;
+	trusted = lstat(directory.c_str(), &info) == 0 && S_ISDIR(info.st_mode) && info.st_uid == geteuid();
+	if (trusted && (info.st_mode & 0777) != 0700) trusted = chmod(directory.c_str(), 0700) == 0;
+#else
+	filesystem::create_directory(directory, error);
+	trusted = filesystem::is_directory(directory, error);
+#endif
+}
+
+//-----------------------------------------------------------------------------
+// Checks that file is regular file owned by current user, so cached image
+// planted by other user is not run
+//-----------------------------------------------------------------------------
+bool ImageCache::isOwned(const string& path) {
+#ifndef _WIN32
+	struct stat info;
+	if (lstat(path.c_str(), &info) != 0) return false;
+	return S_ISREG(info.st_mode) && info.st_uid == geteuid();
+#else
+	error_code error;
+	return filesystem::is_regular_file(path, error);
+#endif
+}
+
+//-----------------------------------------------------------------------------
+// Returns image file path for source hash (keyed by image format version)
+//-----------------------------------------------------------------------------
+string ImageCache::getPath(uint64_t sourceHash) {
+	stringstream name;
+	name << hex << setfill('0') << setw(16) << sourceHash << ".v" << dec << IMAGE_VERSION << ".cvmi";
+	return (filesystem::path(directory) / name.str()).string();
+}
+
+
+//-----------------------------------------------------------------------------
+// Returns path of the last image built from source file (incremental builds)
+//-----------------------------------------------------------------------------
+string ImageCache::getLastBuildPath(string sourcePath) {
+	error_code error;
+	string absolute = filesystem::absolute(sourcePath, error).string();
+	uint64_t pathHash = hashData(absolute.data(), absolute.size());
+	stringstream name;
+	name << hex << setfill('0') << setw(16) << pathHash << ".last.v" << dec << IMAGE_VERSION << ".cvmi";
+	return (filesystem::path(directory) / name.str()).string();
+}
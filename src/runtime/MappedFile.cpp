@@ -0,0 +1,76 @@
+/*============================================================================
+*
+*  Read-only memory mapped file class implementation
+*
+*  Files are mapped with mmap on POSIX systems and read to heap elsewhere.
+*
+*  (C) Bolat Basheyev 2021
+*
+============================================================================*/
+#include <fstream>
+#include "runtime/MappedFile.h"
+
+#ifndef _WIN32
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+using namespace std;
+using namespace vm;
+
+//-----------------------------------------------------------------------------
+// Maps whole file to memory (empty or missing files are not mapped)
+//-----------------------------------------------------------------------------
+MappedFile::MappedFile(const char* filename) {
+	data = NULL;
+	size = 0;
+#ifndef _WIN32
+	int fd = open(filename, O_RDONLY);
+	if (fd < 0) return;
+	struct stat info;
+	if (fstat(fd, &info) == 0 && info.st_size > 0) {
+		void* address = mmap(NULL, info.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+		if (address != MAP_FAILED) {
+			data = (char*) address;
+			size = info.st_size;
+		}
+	}
+	close(fd);
+#else
+	ifstream file(filename, ios::ate | ios::in | ios::binary);
+	if (!file.is_open()) return;
+	size_t fileSize = file.tellg();
+	if (fileSize == 0) return;
+	data = new char[fileSize + 1];
+	file.seekg(0, ios::beg);
+	file.read(data, fileSize);
+	data[fileSize] = 0;
+	size = fileSize;
+#endif
+}
+
+//-----------------------------------------------------------------------------
+// Unmaps file
+//-----------------------------------------------------------------------------
+MappedFile::~MappedFile() {
+	if (data == NULL) return;
+#ifndef _WIN32
+	munmap(data, size);
+#else
+	delete[] data;
+#endif
+	data = NULL;
+}
+
+//-----------------------------------------------------------------------------
+// Returns memory page size in bytes
+//-----------------------------------------------------------------------------
+size_t MappedFile::getPageSize() {
+#ifndef _WIN32
+	return (size_t) sysconf(_SC_PAGESIZE);
+#else
+	return 4096;
+#endif
+}
@@ -0,0 +1,73 @@
+/*============================================================================
+*
+*  Virtual Machine live metrics implementation
+*
+*  (C) Bolat Basheyev 2021
+*
+============================================================================*/
+#include <iomanip>
+#include <algorithm>
+#include "runtime/Metrics.h"
+
+using namespace std;
+using namespace vm;
+
+Metrics::Metrics() {
+	reset();
+}
+
+void Metrics::reset() {
+	instructions.store(0, memory_order_relaxed);
+	calls.store(0, memory_order_relaxed);
+	syscalls.store(0, memory_order_relaxed);
+	stackDepth.store(0, memory_order_relaxed);
+	maxStackDepth.store(0, memory_order_relaxed);
+	running.store(0, memory_order_relaxed);
+	nanoseconds.store(0, memory_order_relaxed);
+}
+
+//-----------------------------------------------------------------------------
+// Reads published values, counters are read separately (not a consistent
+// snapshot of all of them)
+//-----------------------------------------------------------------------------
+MetricsReport Metrics::read() {
+	MetricsReport report;
+	report.instructions = instructions.load(memory_order_relaxed);
+	report.calls = calls.load(memory_order_relaxed);
+	report.syscalls = syscalls.load(memory_order_relaxed);
+	report.stackDepth = stackDepth.load(memory_order_relaxed);
+	report.maxStackDepth = maxStackDepth.load(memory_order_relaxed);
+	report.running = running.load(memory_order_relaxed);
+	report.seconds = nanoseconds.load(memory_order_relaxed) / 1e9;
+	return report;
+}
+
+//-----------------------------------------------------------------------------
+// Adds counters of other report, stack depths are summed (current) and
+// maximized (maximum)
+//-----------------------------------------------------------------------------
+void MetricsReport::add(const MetricsReport& other) {
+	instructions += other.instructions;
+	calls += other.calls;
+	syscalls += other.syscalls;
+	stackDepth += other.stackDepth;
+	maxStackDepth = max(maxStackDepth, other.maxStackDepth);
+	running += other.running;
+	seconds += other.seconds;
+}
+
+void MetricsReport::print(ostream& out) {
+	out << "-----------------------------------------------------" << endl;
+	out << "Metrics" << endl;
+	out << "-----------------------------------------------------" << endl;
+	out << left << setw(24) << "instructions" << right << setw(16) << instructions << endl;
+	out << left << setw(24) << "calls" << right << setw(16) << calls << endl;
+	out << left << setw(24) << "system calls" << right << setw(16) << syscalls << endl;
+	out << left << setw(24) << "stack depth (words)" << right << setw(16) << stackDepth << endl;
+	out << left << setw(24) << "max stack depth" << right << setw(16) << maxStackDepth << endl;
+	out << left << setw(24) << "running machines" << right << setw(16) << running << endl;
+	out << left << setw(24) << "running time" << right << setw(15) << seconds << "s" << endl;
+	if (seconds > 0) {
+		out << left << setw(24) << "instructions/s" << right << setw(16) << (uint64_t) (instructions / seconds) << endl;
+	}
+}
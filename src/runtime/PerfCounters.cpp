@@ -0,0 +1,154 @@
+/*============================================================================
+*
+*  Virtual Machine hardware performance counters implementation
+*
+*  (C) Bolat Basheyev 2021
+*
+============================================================================*/
+#include <cstring>
+#include <iomanip>
+#include "runtime/PerfCounters.h"
+
+#ifdef __linux__
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+#endif
+
+using namespace std;
+using namespace vm;
+
+#ifdef __linux__
+//-----------------------------------------------------------------------------
+// Opens disabled user space counter of calling thread on any CPU
+//-----------------------------------------------------------------------------
+static int openEvent(uint32_t type, uint64_t config) {
+	struct perf_event_attr attr;
+	memset(&attr, 0, sizeof(attr));
+	attr.size = sizeof(attr);
+	attr.type = type;
+	attr.config = config;
+	attr.disabled = 1;
+	attr.exclude_kernel = 1;
+	attr.exclude_hv = 1;
+	attr.read_format = PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+	return (int) syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+}
+#endif
+
+PerfCounters::PerfCounters() {
+	vmInstructions = 0;
+	for (int i = 0; i < PERF_EVENTS_COUNT; i++) fds[i] = -1;
+#ifdef __linux__
+	uint64_t l1dReadMiss = PERF_COUNT_HW_CACHE_L1D | (PERF_COUNT_HW_CACHE_OP_READ << 8) |
+		(PERF_COUNT_HW_CACHE_RESULT_MISS << 16);
+	fds[PERF_CYCLES] = openEvent(PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES);
+	fds[PERF_INSTRUCTIONS] = openEvent(PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS);
+	fds[PERF_BRANCH_MISSES] = openEvent(PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_MISSES);
+	fds[PERF_L1D_MISSES] = openEvent(PERF_TYPE_HW_CACHE, l1dReadMiss);
+	fds[PERF_LLC_MISSES] = openEvent(PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES);
+#endif
+}
+
+PerfCounters::~PerfCounters() {
+#ifdef __linux__
+	for (int i = 0; i < PERF_EVENTS_COUNT; i++) if (fds[i] >= 0) close(fds[i]);
+#endif
+}
+
+bool PerfCounters::isValid() {
+	for (int i = 0; i < PERF_EVENTS_COUNT; i++) if (fds[i] >= 0) return true;
+	return false;
+}
+
+void PerfCounters::start() {
+#ifdef __linux__
+	for (int i = 0; i < PERF_EVENTS_COUNT; i++) if (fds[i] >= 0) ioctl(fds[i], PERF_EVENT_IOC_ENABLE, 0);
+#endif
+}
+
+void PerfCounters::stop(uint64_t vmInstructions) {
+#ifdef __linux__
+	for (int i = 0; i < PERF_EVENTS_COUNT; i++) if (fds[i] >= 0) ioctl(fds[i], PERF_EVENT_IOC_DISABLE, 0);
+#endif
+	this->vmInstructions += vmInstructions;
+}
+
+void PerfCounters::reset() {
+#ifdef __linux__
+	for (int i = 0; i < PERF_EVENTS_COUNT; i++) if (fds[i] >= 0) ioctl(fds[i], PERF_EVENT_IOC_RESET, 0);
+#endif
+	vmInstructions = 0;
+}
+
+//-----------------------------------------------------------------------------
+// Reads counters, values of multiplexed events are scaled by time enabled
+// to time running
+//-----------------------------------------------------------------------------
+PerfReport PerfCounters::read() {
+	PerfReport report = {};
+	report.vmInstructions = vmInstructions;
+#ifdef __linux__
+	for (int i = 0; i < PERF_EVENTS_COUNT; i++) {
+		uint64_t data[3];                                // value, time enabled, time running
+		if (fds[i] < 0 || ::read(fds[i], data, sizeof(data)) != sizeof(data)) continue;
+		report.available[i] = true;
+		report.values[i] = data[0];
+		if (data[2] > 0 && data[2] < data[1]) report.values[i] = (uint64_t)((double) data[0] * data[1] / data[2]);
+		report.seconds = data[1] / 1e9;
+	}
+#endif
+	return report;
+}
+
+//-----------------------------------------------------------------------------
+// Returns event count per VM instruction (-1 if not known)
+//-----------------------------------------------------------------------------
+double PerfReport::perInstruction(PerfEvent event) {
+	if (!available[event] || vmInstructions == 0) return -1;
+	return (double) values[event] / vmInstructions;
+}
+
+//-----------------------------------------------------------------------------
+// Prints counters and derived metrics. Every VM instruction is one dispatch,
+// counting dispatch loop adds one host instruction per VM instruction
+//-----------------------------------------------------------------------------
+void PerfReport::print(ostream& out) {
+	out << "-----------------------------------------------------" << endl;
+	out << "Performance counters" << endl;
+	out << "-----------------------------------------------------" << endl;
+	bool any = false;
+	for (int i = 0; i < PERF_EVENTS_COUNT; i++) {
+		out << left << setw(24) << PERF_EVENT_NAMES[i] << right << setw(16);
+		if (available[i]) out << values[i] << endl;
+		else out << "not available" << endl;
+		any |= available[i];
+	}
+	out << left << setw(24) << "VM instructions" << right << setw(16) << vmInstructions << endl;
+	out << left << setw(24) << "time enabled" << right << setw(15) << seconds << "s" << endl;
+	if (!any) {
+		out << "(perf_event_open is not permitted or not supported)" << endl;
+		return;
+	}
+	out << fixed << setprecision(3);
+	if (available[PERF_CYCLES] && available[PERF_INSTRUCTIONS] && values[PERF_CYCLES] > 0) {
+		out << "IPC: " << (double) values[PERF_INSTRUCTIONS] / values[PERF_CYCLES] << endl;
+	}
+	if (perInstruction(PERF_INSTRUCTIONS) >= 0) {
+		out << "Host instructions per VM instruction: " << perInstruction(PERF_INSTRUCTIONS) << endl;
+	}
+	if (perInstruction(PERF_CYCLES) >= 0) {
+		out << "Cycles per VM instruction: " << perInstruction(PERF_CYCLES) << endl;
+	}
+	if (perInstruction(PERF_BRANCH_MISSES) >= 0) {
+		out << "Branch misses per dispatch: " << perInstruction(PERF_BRANCH_MISSES) << endl;
+	}
+	if (perInstruction(PERF_L1D_MISSES) >= 0) {
+		out << "L1D misses per VM instruction: " << perInstruction(PERF_L1D_MISSES) << endl;
+	}
+	if (perInstruction(PERF_LLC_MISSES) >= 0) {
+		out << "LLC misses per VM instruction: " << perInstruction(PERF_LLC_MISSES) << endl;
+	}
+	out << defaultfloat << setprecision(6);
+}
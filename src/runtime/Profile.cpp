@@ -0,0 +1,130 @@
+/*============================================================================
+*
+*  Virtual Machine execution profile implementation
+*
+*  (C) Bolat Basheyev 2021
+*
+============================================================================*/
+#include <cstring>
+#include <iomanip>
+#include <algorithm>
+#include <map>
+#include "runtime/Profile.h"
+
+using namespace std;
+using namespace vm;
+
+static const char* const OPCODE_MNEMONIC[] = {
+	"halt", "iconst", "ipush", "ipop", "iadd", "isub", "imul", "idiv",
+	"iand", "ior", "ixor", "inot", "ishl", "ishr", "jmp", "ifzero",
+	"equal", "nequal", "greater", "grequal", "less", "lsequal", "land", "lor",
+	"lnot", "call", "ret", "syscall", "trap", "iload", "istore", "iarg",
+	"afadd", "acas", "aload", "astore", "idrop"
+};
+
+constexpr size_t OPCODE_MNEMONIC_COUNT = sizeof(OPCODE_MNEMONIC) / sizeof(OPCODE_MNEMONIC[0]);
+
+
+Profile::Profile() {
+	clear();
+}
+
+//-----------------------------------------------------------------------------
+// Resets all counters
+//-----------------------------------------------------------------------------
+void Profile::clear() {
+	counts.clear();
+	takenCounts.clear();
+	notTakenCounts.clear();
+	memset(opcodes, 0, sizeof(opcodes));
+	total = 0;
+}
+
+//-----------------------------------------------------------------------------
+// Grows counters to fit address (code is appended by lazy compilation)
+//-----------------------------------------------------------------------------
+void Profile::grow(WORD address) {
+	size_t size = max((size_t) address + 1, counts.size() * 2);
+	counts.resize(size);
+	takenCounts.resize(size);
+	notTakenCounts.resize(size);
+}
+
+uint64_t Profile::getCount(WORD address) {
+	return (size_t) address < counts.size() ? counts[address] : 0;
+}
+
+uint64_t Profile::getTaken(WORD address) {
+	return (size_t) address < takenCounts.size() ? takenCounts[address] : 0;
+}
+
+uint64_t Profile::getNotTaken(WORD address) {
+	return (size_t) address < notTakenCounts.size() ? notTakenCounts[address] : 0;
+}
+
+//-----------------------------------------------------------------------------
+// Prints executed opcodes ordered by executions count
+//-----------------------------------------------------------------------------
+void Profile::printOpcodes(ostream& out) {
+	vector<pair<uint64_t, size_t>> sorted;
+	for (size_t i = 0; i < OPCODES_COUNT; i++) {
+		if (opcodes[i] > 0) sorted.push_back({ opcodes[i], i });
+	}
+	sort(sorted.begin(), sorted.end(), greater<pair<uint64_t, size_t>>());
+	out << "-----------------------------------------------------" << endl;
+	out << "Opcodes profile (" << total << " instructions executed)" << endl;
+	out << "-----------------------------------------------------" << endl;
+	for (auto& entry : sorted) {
+		double percent = entry.first * 100.0 / total;
+		out << setw(10) << left;
+		if (entry.second < OPCODE_MNEMONIC_COUNT) out << OPCODE_MNEMONIC[entry.second];
+		else out << entry.second;
+		out << right << setw(14) << entry.first << setw(8) << fixed << setprecision(2) << percent << "%";
+		out << defaultfloat << setprecision(6) << endl;
+	}
+}
+
+//-----------------------------------------------------------------------------
+// Prints source lines which instructions executed most (instructions out
+// of line table such as entry point call are not reported)
+//-----------------------------------------------------------------------------
+void Profile::printLines(ExecutableImage& image, ostream& out, const char* source, size_t top) {
+	map<WORD, uint64_t> rows;
+	vector<LineEntry>& lines = image.getLines();
+	size_t line = 0;
+	for (size_t address = 0; address < counts.size(); address++) {
+		if (counts[address] == 0) continue;
+		while (line + 1 < lines.size() && (size_t) lines[line + 1].address <= address) line++;
+		if (line >= lines.size() || (size_t) lines[line].address > address) continue;
+		rows[lines[line].row] += counts[address];
+	}
+	vector<pair<uint64_t, WORD>> sorted;
+	for (auto& row : rows) sorted.push_back({ row.second, row.first });
+	sort(sorted.begin(), sorted.end(), [](const pair<uint64_t, WORD>& a, const pair<uint64_t, WORD>& b) {
+		return a.first != b.first ? a.first > b.first : a.second < b.second;
+	});
+	if (sorted.size() > top) sorted.resize(top);
+
+	// source lines start offsets
+	vector<const char*> starts;
+	if (source != NULL) {
+		starts.push_back(source);
+		for (const char* c = source; *c != 0; c++) if (*c == '\n') starts.push_back(c + 1);
+	}
+
+	out << "-----------------------------------------------------" << endl;
+	out << "Hottest source lines" << endl;
+	out << "-----------------------------------------------------" << endl;
+	for (auto& entry : sorted) {
+		double percent = total > 0 ? entry.first * 100.0 / total : 0;
+		out << "line " << setw(6) << left << entry.second << right << setw(14) << entry.first;
+		out << setw(8) << fixed << setprecision(2) << percent << "%" << defaultfloat << setprecision(6);
+		if (entry.second > 0 && (size_t) entry.second <= starts.size()) {
+			const char* text = starts[entry.second - 1];
+			while (*text == ' ' || *text == '\t') text++;
+			size_t length = strcspn(text, "\r\n");
+			out << "    " << string(text, length);
+		}
+		out << endl;
+	}
+}
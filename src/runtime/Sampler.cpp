@@ -0,0 +1,177 @@
+/*============================================================================
+*
+*  Virtual Machine sampling profiler implementation
+*
+*  (C) Bolat Basheyev 2021
+*
+============================================================================*/
+#include <cstring>
+#include <algorithm>
+#include <map>
+#include <mutex>
+#include "runtime/Sampler.h"
+
+#ifdef __linux__
+#include <signal.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+#endif
+
+using namespace std;
+using namespace vm;
+
+#ifdef __linux__
+static thread_local Sampler* threadSampler = NULL;
+static once_flag samplerHandlerInstalled;
+#endif
+
+//-----------------------------------------------------------------------------
+// Preallocates samples buffer (signal handler does not allocate memory)
+//-----------------------------------------------------------------------------
+Sampler::Sampler(size_t capacity) {
+	buffer.resize(capacity);
+	used = 0;
+	samples = 0;
+	dropped = 0;
+	machine = NULL;
+	active = false;
+}
+
+Sampler::~Sampler() {
+	stop();
+}
+
+//-----------------------------------------------------------------------------
+// Starts sampling machine run by calling thread: monotonic clock timer
+// signals this thread only (thread CPU clock timers expire on scheduler
+// ticks, which limits sampling rate to kernel HZ)
+//-----------------------------------------------------------------------------
+bool Sampler::start(VirtualMachine& machine, unsigned frequency) {
+#ifdef __linux__
+	if (active || frequency == 0) return false;
+	call_once(samplerHandlerInstalled, [] {
+		struct sigaction action;
+		memset(&action, 0, sizeof(action));
+		action.sa_handler = Sampler::handler;
+		action.sa_flags = SA_RESTART;                // blocking input is not interrupted
+		sigemptyset(&action.sa_mask);
+		sigaction(SIGPROF, &action, NULL);
+	});
+	struct sigevent event;
+	memset(&event, 0, sizeof(event));
+	event.sigev_notify = SIGEV_THREAD_ID;
+	event.sigev_signo = SIGPROF;
+	event._sigev_un._tid = (pid_t) syscall(SYS_gettid);
+	if (timer_create(CLOCK_MONOTONIC, &event, &timer) != 0) return false;
+	this->machine = &machine;
+	threadSampler = this;
+	active = true;
+	struct itimerspec interval;
+	memset(&interval, 0, sizeof(interval));
+	interval.it_interval.tv_sec = 0;
+	interval.it_interval.tv_nsec = max(1000000000L / (long) frequency, 1L);
+	interval.it_value = interval.it_interval;
+	if (timer_settime(timer, 0, &interval, NULL) != 0) {
+		stop();
+		return false;
+	}
+	return true;
+#else
+	return false;
+#endif
+}
+
+//-----------------------------------------------------------------------------
+// Stops sampling (signal still pending after timer deletion is ignored)
+//-----------------------------------------------------------------------------
+void Sampler::stop() {
+#ifdef __linux__
+	if (!active) return;
+	active = false;
+	timer_delete(timer);
+	if (threadSampler == this) threadSampler = NULL;
+#endif
+}
+
+//-----------------------------------------------------------------------------
+// Drops recorded samples
+//-----------------------------------------------------------------------------
+void Sampler::clear() {
+	used = 0;
+	samples = 0;
+	dropped = 0;
+}
+
+//-----------------------------------------------------------------------------
+// Timer signal handler: samples machine of interrupted thread
+//-----------------------------------------------------------------------------
+void Sampler::handler(int) {
+#ifdef __linux__
+	Sampler* sampler = threadSampler;
+	if (sampler != NULL && sampler->active.load(memory_order_relaxed)) sampler->sample();
+#endif
+}
+
+//-----------------------------------------------------------------------------
+// Records instruction pointer and return addresses of frames chain. Frame
+// of OP_CALL: [lp + 1] saved lp, [lp + 2] saved fp, [lp + 3] return address.
+// Walk stops at entry point or fiber function return (HALT_ADDRESS).
+// Registers may be sampled in the middle of instruction, so addresses are
+// checked against memory bounds only.
+//-----------------------------------------------------------------------------
+void Sampler::sample() {
+	WORD frames[SAMPLER_MAX_DEPTH];
+	WORD depth = 0;
+	WORD* memory = machine->memory;
+	WORD maxAddress = machine->maxAddress;
+	WORD lp = machine->lp;
+	frames[depth++] = machine->ip;
+	while (depth < SAMPLER_MAX_DEPTH && lp >= 0 && lp < maxAddress - 3) {
+		WORD returnAddress = memory[lp + 3];
+		if (returnAddress <= HALT_ADDRESS) break;
+		frames[depth++] = returnAddress - 1;          // inside caller's call instruction
+		lp = memory[lp + 1];
+	}
+	if (used + depth + 1 > buffer.size()) {
+		dropped++;
+		return;
+	}
+	buffer[used] = depth;
+	memcpy(buffer.data() + used + 1, frames, depth * sizeof(WORD));
+	used += depth + 1;
+	samples++;
+}
+
+//-----------------------------------------------------------------------------
+// Writes samples as folded stacks: functions from root to leaf separated
+// by semicolons and samples count. Addresses out of function symbols are
+// reported as [unknown]
+//-----------------------------------------------------------------------------
+void Sampler::writeFolded(ExecutableImage& image, ostream& out) {
+	vector<ImageSymbol*> functions;
+	for (size_t i = 0; i < image.getSymbolCount(); i++) {
+		if (image.getSymbol(i).size > 0) functions.push_back(&image.getSymbol(i));
+	}
+	sort(functions.begin(), functions.end(), [](ImageSymbol* a, ImageSymbol* b) { return a->address < b->address; });
+	auto functionName = [&](WORD address) -> const string& {
+		static const string unknown = "[unknown]";
+		auto it = upper_bound(functions.begin(), functions.end(), address,
+			[](WORD value, ImageSymbol* symbol) { return value < symbol->address; });
+		if (it == functions.begin()) return unknown;
+		ImageSymbol* symbol = *(it - 1);
+		return address < symbol->address + symbol->size ? symbol->name : unknown;
+	};
+
+	map<string, uint64_t> stacks;
+	string stack;
+	for (size_t i = 0; i < used; i += buffer[i] + 1) {
+		WORD depth = buffer[i];
+		stack.clear();
+		for (WORD j = depth; j > 0; j--) {
+			if (j < depth) stack += ';';
+			stack += functionName(buffer[i + j]);
+		}
+		stacks[stack]++;
+	}
+	for (auto& entry : stacks) out << entry.first << " " << entry.second << endl;
+}
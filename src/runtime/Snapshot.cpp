@@ -0,0 +1,387 @@
+/*============================================================================
+*
+*  Virtual Machine snapshot implementation
+*
+*  (C) Bolat Basheyev 2021
+*
+============================================================================*/
+#include <cstring>
+#include <fstream>
+#include <filesystem>
+#include <random>
+#include <algorithm>
+#include "runtime/Snapshot.h"
+#include "runtime/ImageFile.h"
+
+#ifndef _WIN32
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+using namespace std;
+using namespace vm;
+
+//-----------------------------------------------------------------------------
+// Captures machine paused at checkpoint (or preempted) to memory file or
+// memory copy
+//-----------------------------------------------------------------------------
+Snapshot::Snapshot(VirtualMachine& machine) {
+	valid = false;
+	fd = -1;
+	if (machine.segment == NULL) return;
+	if (machine.status != ExecutionStatus::PAUSED && machine.status != ExecutionStatus::EXHAUSTED &&
+		machine.status != ExecutionStatus::INTERRUPTED) return;
+
+	memoryBytes = machine.memoryBytes;
+	maxAddress = machine.maxAddress;
+	segment = machine.segment;
+	ip = machine.ip;
+	sp = machine.sp;
+	fp = machine.fp;
+	lp = machine.lp;
+	fibers = machine.fibers;
+	runQueue = machine.runQueue;
+	inputWaiters = machine.inputWaiters;
+	freeRegions = machine.freeRegions;
+	regionsCount = machine.regionsCount;
+	fiberStackSize = machine.fiberStackSize;
+	current = machine.current;
+
+#ifdef __linux__
+	// only pages of live stacks are written to sparse memory file
+	fd = memfd_create("cvm-snapshot", MFD_CLOEXEC);
+	if (fd >= 0 && ftruncate(fd, memoryBytes) == 0) {
+		char* data = (char*) machine.memory;
+		ranges = usedRanges(MappedFile::getPageSize());
+		for (MemoryRange& range : ranges) {
+			range.offset = range.address;
+			size_t written = 0;
+			while (written < range.size) {
+				ssize_t count = pwrite(fd, data + range.address + written, range.size - written, range.offset + written);
+				if (count <= 0) break;
+				written += count;
+			}
+			if (written < range.size) {
+				close(fd);
+				fd = -1;
+				break;
+			}
+		}
+	} else if (fd >= 0) {
+		close(fd);
+		fd = -1;
+	}
+#endif
+	if (fd < 0) {
+		// live stacks only, guard pages of fiber stack regions are not readable
+		ranges.clear();
+		memory.assign(memoryBytes / sizeof(WORD), 0);
+		for (MemoryRange& range : usedRanges(MappedFile::getPageSize())) {
+			memcpy((char*) memory.data() + range.address, (char*) machine.memory + range.address, range.size);
+		}
+	}
+
+	if (machine.shared != NULL) {
+		atomic<WORD>* words = machine.shared->getWords();
+		sharedWords.resize(machine.shared->getSize());
+		for (size_t i = 0; i < sharedWords.size(); i++) sharedWords[i] = words[i].load();
+	}
+	valid = true;
+}
+
+//-----------------------------------------------------------------------------
+// Loads checkpoint file saved by this or other process
+//-----------------------------------------------------------------------------
+Snapshot::Snapshot(const char* filename) {
+	fd = -1;
+	valid = load(filename);
+}
+
+//-----------------------------------------------------------------------------
+// Closes memory file (forks keep their mappings)
+//-----------------------------------------------------------------------------
+Snapshot::~Snapshot() {
+#ifndef _WIN32
+	if (fd >= 0) close(fd);
+#endif
+	fd = -1;
+}
+
+//-----------------------------------------------------------------------------
+// Creates new machine paused at snapshot checkpoint
+//-----------------------------------------------------------------------------
+VirtualMachine* Snapshot::fork() {
+	if (!valid) return NULL;
+	VirtualMachine* machine = new VirtualMachine((size_t) maxAddress * sizeof(WORD));
+	if (restore(*machine)) return machine;
+	delete machine;
+	return NULL;
+}
+
+//-----------------------------------------------------------------------------
+// Restores snapshot state to machine of the same memory size. Memory file
+// ranges are mapped over machine memory, pages are copied on first write only.
+// Channels, input queue, output and trap handler of machine are kept.
+//-----------------------------------------------------------------------------
+bool Snapshot::restore(VirtualMachine& machine) {
+	if (!valid || machine.maxAddress != maxAddress || machine.memoryBytes != memoryBytes) return false;
+	machine.joinThreads();
+	machine.unguardRegions();
+	machine.memoryClean = false;             // stack pages come from snapshot
+	machine.countPages = false;
+#ifndef _WIN32
+	if (fd >= 0) {
+		// memory not covered by ranges is replaced with zero pages
+		char* base = (char*) machine.memory;
+		void* address;
+		if (ranges.size() != 1 || ranges[0].size != memoryBytes) {
+			address = mmap(base, memoryBytes, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE | MAP_FIXED, -1, 0);
+			if (address == MAP_FAILED) return false;
+		}
+		for (MemoryRange& range : ranges) {
+			address = mmap(base + range.address, range.size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_FIXED, fd, range.offset);
+			if (address == MAP_FAILED) return false;
+		}
+	} else
+#endif
+	memcpy(machine.memory, memory.data(), memoryBytes);
+
+	machine.loadCode(segment);
+	machine.ip = ip;
+	machine.sp = sp;
+	machine.fp = fp;
+	machine.lp = lp;
+	machine.fibers = fibers;
+	machine.runQueue = runQueue;
+	machine.inputWaiters = inputWaiters;
+	machine.freeRegions = freeRegions;
+	machine.regionsCount = regionsCount;
+	machine.fiberStackSize = fiberStackSize;
+	for (WORD region = 0; region < regionsCount; region++) machine.guardRegion(region);
+	machine.current = current;
+	machine.ioLock = NULL;
+	machine.shared = NULL;
+	if (!sharedWords.empty()) {
+		machine.shared = make_shared<SharedMemory>((WORD) sharedWords.size());
+		atomic<WORD>* words = machine.shared->getWords();
+		for (size_t i = 0; i < sharedWords.size(); i++) words[i].store(sharedWords[i], memory_order_relaxed);
+	}
+	machine.status = ExecutionStatus::PAUSED;
+	return true;
+}
+
+//-----------------------------------------------------------------------------
+// Returns memory of live fiber stacks (from stack pointer to stack top)
+// rounded to pages, sorted and merged. Free stack middle is skipped.
+//-----------------------------------------------------------------------------
+vector<MemoryRange> Snapshot::usedRanges(size_t pageSize) {
+	vector<MemoryRange> used;
+	for (size_t i = 0; i < fibers.size(); i++) {
+		Fiber& fiber = fibers[i];
+		if (fiber.state == FiberState::DONE) continue;
+		WORD bottom = (i == (size_t) current) ? sp : fiber.sp;
+		uint64_t from = (uint64_t) max(bottom, 0) * sizeof(WORD) / pageSize * pageSize;
+		uint64_t to = ((uint64_t) max(fiber.stackTop, 0) * sizeof(WORD) + pageSize - 1) / pageSize * pageSize;
+		to = min(to, (uint64_t) memoryBytes);
+		if (to > from) used.push_back({ from, to - from, 0 });
+	}
+	sort(used.begin(), used.end(), [](const MemoryRange& a, const MemoryRange& b) { return a.address < b.address; });
+	vector<MemoryRange> merged;
+	for (MemoryRange& range : used) {
+		if (!merged.empty() && range.address <= merged.back().address + merged.back().size) {
+			MemoryRange& last = merged.back();
+			last.size = max(last.address + last.size, range.address + range.size) - last.address;
+		} else merged.push_back(range);
+	}
+	return merged;
+}
+
+//-----------------------------------------------------------------------------
+// Copies snapshot memory range (parts not in memory file ranges are zero)
+//-----------------------------------------------------------------------------
+void Snapshot::readMemory(const MemoryRange& range, char* data) {
+	if (fd < 0) {
+		memcpy(data, (char*) memory.data() + range.address, range.size);
+		return;
+	}
+	memset(data, 0, range.size);
+#ifndef _WIN32
+	for (MemoryRange& stored : ranges) {
+		uint64_t from = max(range.address, stored.address);
+		uint64_t to = min(range.address + range.size, stored.address + stored.size);
+		size_t done = 0;
+		while (from + done < to) {
+			ssize_t count = pread(fd, data + (from - range.address) + done, to - from - done, stored.offset + (from - stored.address) + done);
+			if (count <= 0) break;
+			done += count;
+		}
+	}
+#endif
+}
+
+//-----------------------------------------------------------------------------
+// Saves checkpoint file (written to temporary file and renamed, so loaded
+// snapshots keep mapping the replaced file)
+//-----------------------------------------------------------------------------
+bool Snapshot::save(const char* filename) {
+	if (!valid) return false;
+	size_t pageSize = MappedFile::getPageSize();
+	vector<MemoryRange> used = usedRanges(pageSize);
+
+	// fibers and scheduler queues
+	vector<WORD> state;
+	state.push_back((WORD) fibers.size());
+	for (Fiber& fiber : fibers) {
+		WORD record[] = { fiber.ip, fiber.sp, fiber.fp, fiber.lp, fiber.stackTop, fiber.region,
+			(WORD) fiber.state, fiber.result, (WORD) fiber.joiners.size() };
+		state.insert(state.end(), record, record + sizeof(record) / sizeof(WORD));
+		state.insert(state.end(), fiber.joiners.begin(), fiber.joiners.end());
+	}
+	state.push_back((WORD) runQueue.size());
+	state.insert(state.end(), runQueue.begin(), runQueue.end());
+	state.push_back((WORD) inputWaiters.size());
+	state.insert(state.end(), inputWaiters.begin(), inputWaiters.end());
+	state.push_back((WORD) freeRegions.size());
+	state.insert(state.end(), freeRegions.begin(), freeRegions.end());
+
+	CheckpointHeader header;
+	memset(&header, 0, sizeof(header));
+	header.magic = CHECKPOINT_MAGIC;
+	header.version = CHECKPOINT_VERSION;
+	header.headerSize = sizeof(CheckpointHeader);
+	header.memoryBytes = memoryBytes;
+	header.pageSize = pageSize;
+	header.maxAddress = maxAddress;
+	header.ip = ip;
+	header.sp = sp;
+	header.fp = fp;
+	header.lp = lp;
+	header.current = current;
+	header.regionsCount = regionsCount;
+	header.fiberStackSize = fiberStackSize;
+	header.codeOffset = sizeof(CheckpointHeader);
+	header.codeSize = (uint32_t) segment->getSize();
+	header.stateOffset = header.codeOffset + header.codeSize * sizeof(WORD);
+	header.stateSize = (uint32_t) state.size();
+	header.sharedOffset = header.stateOffset + header.stateSize * sizeof(WORD);
+	header.sharedSize = (uint32_t) sharedWords.size();
+	header.rangesOffset = header.sharedOffset + header.sharedSize * sizeof(WORD);
+	header.rangesCount = (uint32_t) used.size();
+
+	// memory pages are page aligned in file
+	uint64_t offset = header.rangesOffset + used.size() * sizeof(MemoryRange);
+	offset = (offset + pageSize - 1) / pageSize * pageSize;
+	for (MemoryRange& range : used) {
+		range.offset = offset;
+		offset += range.size;
+	}
+
+	vector<char> data(offset);
+	memcpy(data.data() + header.codeOffset, segment->getCode(), header.codeSize * sizeof(WORD));
+	memcpy(data.data() + header.stateOffset, state.data(), state.size() * sizeof(WORD));
+	memcpy(data.data() + header.sharedOffset, sharedWords.data(), sharedWords.size() * sizeof(WORD));
+	memcpy(data.data() + header.rangesOffset, used.data(), used.size() * sizeof(MemoryRange));
+	for (MemoryRange& range : used) readMemory(range, data.data() + range.offset);
+	uint64_t hash = hashData(data.data() + header.headerSize, data.size() - header.headerSize);
+	header.checksum = (uint32_t)(hash ^ (hash >> 32));
+	memcpy(data.data(), &header, sizeof(header));
+
+	string temporary = string(filename) + ".tmp" + to_string(random_device{}());
+	ofstream file(temporary, ios::out | ios::binary | ios::trunc);
+	if (!file.is_open()) return false;
+	file.write(data.data(), data.size());
+	file.close();
+	error_code error;
+	if (file.fail()) {
+		filesystem::remove(temporary, error);
+		return false;
+	}
+	filesystem::rename(temporary, filename, error);
+	if (error) filesystem::remove(temporary, error);
+	return !error;
+}
+
+//-----------------------------------------------------------------------------
+// Validates checkpoint file and reads its state. Memory ranges are mapped
+// from the file on restore if they are page aligned on this host, or
+// copied otherwise.
+//-----------------------------------------------------------------------------
+bool Snapshot::load(const char* filename) {
+	MappedFile mapping(filename);
+	size_t size = mapping.getSize();
+	if (!mapping.isOpen() || size < sizeof(CheckpointHeader)) return false;
+	char* data = mapping.getData();
+	CheckpointHeader header;
+	memcpy(&header, data, sizeof(header));
+	if (header.magic != CHECKPOINT_MAGIC) return false;
+	if (header.version != CHECKPOINT_VERSION) return false;
+	if (header.headerSize != sizeof(CheckpointHeader)) return false;
+	if (header.maxAddress <= 0 || (uint64_t) header.maxAddress * sizeof(WORD) > header.memoryBytes) return false;
+	if (header.memoryBytes % MappedFile::getPageSize() != 0) return false;
+	if ((uint64_t) header.codeOffset + (uint64_t) header.codeSize * sizeof(WORD) > size) return false;
+	if ((uint64_t) header.stateOffset + (uint64_t) header.stateSize * sizeof(WORD) > size) return false;
+	if ((uint64_t) header.sharedOffset + (uint64_t) header.sharedSize * sizeof(WORD) > size) return false;
+	if ((uint64_t) header.rangesOffset + (uint64_t) header.rangesCount * sizeof(MemoryRange) > size) return false;
+	uint64_t hash = hashData(data + header.headerSize, size - header.headerSize);
+	if (header.checksum != (uint32_t)(hash ^ (hash >> 32))) return false;
+
+	memoryBytes = (size_t) header.memoryBytes;
+	maxAddress = header.maxAddress;
+	ip = header.ip;
+	sp = header.sp;
+	fp = header.fp;
+	lp = header.lp;
+	current = header.current;
+	regionsCount = header.regionsCount;
+	fiberStackSize = header.fiberStackSize;
+	segment = make_shared<CodeSegment>((WORD*)(data + header.codeOffset), (WORD) header.codeSize);
+	WORD* shared = (WORD*)(data + header.sharedOffset);
+	sharedWords.assign(shared, shared + header.sharedSize);
+
+	// fibers and scheduler queues
+	WORD* state = (WORD*)(data + header.stateOffset);
+	WORD* stateEnd = state + header.stateSize;
+	auto next = [&](WORD& value) { if (state >= stateEnd) return false; value = *state++; return true; };
+	WORD count, value;
+	if (!next(count) || count <= 0) return false;
+	for (WORD i = 0; i < count; i++) {
+		Fiber fiber;
+		WORD fiberState, joinersCount;
+		if (!next(fiber.ip) || !next(fiber.sp) || !next(fiber.fp) || !next(fiber.lp) ||
+			!next(fiber.stackTop) || !next(fiber.region) || !next(fiberState) ||
+			!next(fiber.result) || !next(joinersCount)) return false;
+		if (fiberState < 0 || fiberState > (WORD) FiberState::DONE) return false;
+		fiber.state = (FiberState) fiberState;
+		for (WORD j = 0; j < joinersCount; j++) {
+			if (!next(value)) return false;
+			fiber.joiners.push_back(value);
+		}
+		fibers.push_back(fiber);
+	}
+	if (current < 0 || current >= count) return false;
+	if (!next(count)) return false;
+	for (WORD i = 0; i < count; i++) { if (!next(value)) return false; runQueue.push_back(value); }
+	if (!next(count)) return false;
+	for (WORD i = 0; i < count; i++) { if (!next(value)) return false; inputWaiters.push_back(value); }
+	if (!next(count)) return false;
+	for (WORD i = 0; i < count; i++) { if (!next(value)) return false; freeRegions.push_back(value); }
+
+	// memory ranges
+	size_t pageSize = MappedFile::getPageSize();
+	bool aligned = true;
+	ranges.resize(header.rangesCount);
+	memcpy(ranges.data(), data + header.rangesOffset, ranges.size() * sizeof(MemoryRange));
+	for (MemoryRange& range : ranges) {
+		if (range.address + range.size > memoryBytes || range.offset + range.size > size) return false;
+		if (range.address % pageSize != 0 || range.offset % pageSize != 0) aligned = false;
+	}
+#ifndef _WIN32
+	if (aligned) fd = open(filename, O_RDONLY | O_CLOEXEC);
+#endif
+	if (fd < 0) {
+		memory.assign(memoryBytes / sizeof(WORD), 0);
+		for (MemoryRange& range : ranges) memcpy((char*) memory.data() + range.address, data + range.offset, range.size);
+	}
+	return true;
+}
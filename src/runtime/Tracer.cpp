@@ -0,0 +1,177 @@
+/*============================================================================
+*
+*  Virtual Machine call tracing implementation
+*
+*  (C) Bolat Basheyev 2021
+*
+============================================================================*/
+#include <iomanip>
+#include "runtime/Tracer.h"
+
+using namespace std;
+using namespace vm;
+
+constexpr int64_t TRACE_FIBER_TRACKS = 0x10000;           // Thread id = buffer * tracks + fiber
+
+//-----------------------------------------------------------------------------
+// Trace buffer of one machine
+//-----------------------------------------------------------------------------
+TraceBuffer::TraceBuffer(WORD id) {
+	this->id = id;
+	events = new TraceEvent[TRACE_BUFFER_EVENTS];
+	mask = TRACE_BUFFER_EVENTS - 1;
+	head = 0;
+	tail = 0;
+	dropped = 0;
+	open = 0;
+}
+
+TraceBuffer::~TraceBuffer() {
+	delete[] events;
+}
+
+//-----------------------------------------------------------------------------
+// Moves all recorded events to output vector (consumer side)
+//-----------------------------------------------------------------------------
+size_t TraceBuffer::drain(vector<TraceEvent>& out) {
+	uint32_t h = head.load(memory_order_relaxed);
+	uint32_t t = tail.load(memory_order_acquire);
+	for (uint32_t i = h; i != t; i++) out.push_back(events[i & mask]);
+	head.store(t, memory_order_release);
+	return t - h;
+}
+
+//-----------------------------------------------------------------------------
+// Forgets open and dropped calls left by previous run of machine (fiber ids
+// start over, ends of calls of aborted run never come)
+//-----------------------------------------------------------------------------
+void TraceBuffer::restart() {
+	open = 0;
+	skipped.clear();
+}
+
+//-----------------------------------------------------------------------------
+// Opens trace file and starts writer thread
+//-----------------------------------------------------------------------------
+Tracer::Tracer(const char* filename) {
+	stopping = false;
+	written = 0;
+	start = chrono::duration_cast<chrono::nanoseconds>(chrono::steady_clock::now().time_since_epoch()).count();
+	file.open(filename, ios::out | ios::trunc);
+	opened = file.is_open();
+	if (!opened) return;
+	file << "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[" << endl;
+	file << "{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":1,\"tid\":0,\"args\":{\"name\":\"cvm\"}}";
+	writer = thread(&Tracer::run, this);
+}
+
+Tracer::~Tracer() {
+	close();
+}
+
+//-----------------------------------------------------------------------------
+// Creates buffer of machine (buffers live until tracer is destroyed)
+//-----------------------------------------------------------------------------
+TraceBuffer* Tracer::createBuffer() {
+	lock_guard<mutex> guard(lock);
+	buffers.push_back(make_unique<TraceBuffer>((WORD) buffers.size()));
+	return buffers.back().get();
+}
+
+//-----------------------------------------------------------------------------
+// Takes function names from image symbols (called again after lazy
+// compilation adds functions)
+//-----------------------------------------------------------------------------
+void Tracer::setSymbols(ExecutableImage& image) {
+	lock_guard<mutex> guard(lock);
+	for (size_t i = 0; i < image.getSymbolCount(); i++) {
+		ImageSymbol& symbol = image.getSymbol(i);
+		symbols[symbol.address] = symbol.name;
+	}
+}
+
+//-----------------------------------------------------------------------------
+// Stops writer, writes remaining events and completes JSON document
+//-----------------------------------------------------------------------------
+void Tracer::close() {
+	if (!opened) return;
+	{
+		lock_guard<mutex> guard(lock);
+		stopping = true;
+	}
+	wake.notify_all();
+	writer.join();
+	vector<TraceEvent> events;
+	flush(events);
+	file << endl << "]}" << endl;
+	file.close();
+	opened = false;
+}
+
+uint64_t Tracer::getDroppedCount() {
+	lock_guard<mutex> guard(lock);
+	uint64_t dropped = 0;
+	for (auto& buffer : buffers) dropped += buffer->getDropped();
+	return dropped;
+}
+
+//-----------------------------------------------------------------------------
+// Writer thread: drains buffers every flush interval until stopped
+//-----------------------------------------------------------------------------
+void Tracer::run() {
+	vector<TraceEvent> events;
+	unique_lock<mutex> guard(lock);
+	while (!stopping) {
+		wake.wait_for(guard, chrono::milliseconds(TRACE_FLUSH_INTERVAL));
+		guard.unlock();
+		flush(events);
+		guard.lock();
+	}
+}
+
+//-----------------------------------------------------------------------------
+// Drains every buffer and writes its events in order
+//-----------------------------------------------------------------------------
+void Tracer::flush(vector<TraceEvent>& events) {
+	size_t count;
+	{
+		lock_guard<mutex> guard(lock);
+		count = buffers.size();
+	}
+	for (size_t i = 0; i < count; i++) {
+		TraceBuffer* buffer;
+		{
+			lock_guard<mutex> guard(lock);
+			buffer = buffers[i].get();
+		}
+		events.clear();
+		buffer->drain(events);
+		lock_guard<mutex> guard(lock);
+		for (TraceEvent& event : events) writeEvent(buffer, event);
+	}
+}
+
+//-----------------------------------------------------------------------------
+// Writes event as duration begin ("B") or end ("E") of track of machine
+// fiber, new track is named first (called under lock)
+//-----------------------------------------------------------------------------
+void Tracer::writeEvent(TraceBuffer* buffer, TraceEvent& event) {
+	int64_t tid = buffer->getId() * TRACE_FIBER_TRACKS + event.fiber + 1;
+	if (tracks.insert(tid).second) {
+		file << "," << endl << "{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":" << tid;
+		file << ",\"args\":{\"name\":\"machine " << buffer->getId() << " fiber " << event.fiber << "\"}}";
+	}
+	bool begin = (event.type == TraceEventType::CALL || event.type == TraceEventType::SYSCALL_BEGIN);
+	file << "," << endl << "{\"ph\":\"" << (begin ? "B" : "E") << "\",\"pid\":1,\"tid\":" << tid;
+	file << ",\"ts\":" << fixed << setprecision(3) << (event.time - start) / 1000.0 << defaultfloat;
+	if (event.type == TraceEventType::CALL) {
+		auto symbol = symbols.find(event.value);
+		file << ",\"cat\":\"call\",\"name\":\"";
+		if (symbol != symbols.end()) file << symbol->second << "\"";
+		else file << "function " << event.value << "\"";
+	} else if (event.type == TraceEventType::SYSCALL_BEGIN) {
+		file << ",\"cat\":\"syscall\",\"name\":\"syscall 0x" << hex << event.value << dec << "\"";
+	}
+	file << "}";
+	written++;
+}
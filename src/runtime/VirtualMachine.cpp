@@ -9,72 +9,633 @@
 ============================================================================*/
 #include <iostream>
 #include <cstring>
+#include <algorithm>
+#include <chrono>
 #include "runtime/VirtualMachine.h"
+#include "runtime/Channel.h"
+#include "runtime/Profile.h"
+#include "runtime/PerfCounters.h"
+#include "runtime/Tracer.h"
+#include "runtime/Metrics.h"
+#include "runtime/MappedFile.h"
+
+#ifndef _WIN32
+#include <sys/mman.h>
+#include <signal.h>
+#include <setjmp.h>
+#endif
 
 using namespace std;
 using namespace vm;
 
+#ifndef _WIN32
+//-----------------------------------------------------------------------------
+// Hardware faults in dispatch loop (guard pages access and division by zero)
+// are turned into runtime errors by signal handlers, so there are no checks
+// per instruction. Running machine registers fault scope of its thread.
+//-----------------------------------------------------------------------------
+class FaultScope {
+public:
+	sigjmp_buf jump;                     // Return point in run()
+	char* memoryStart;                   // Machine memory
+	char* memoryEnd;
+	size_t guardBytes;                   // Guard pages size on each side
+	volatile FaultKind kind;             // Fault reported by handler
+	FaultScope* previous;                // Outer scope of thread
+};
+
+static thread_local FaultScope* faultScope = NULL;
+static struct sigaction previousSegv;
+static struct sigaction previousFpe;
+static once_flag faultHandlersInstalled;
+
+static void faultHandler(int signal, siginfo_t* info, void* context) {
+	FaultScope* scope = faultScope;
+	if (scope != NULL) {
+		char* address = (char*) info->si_addr;
+		if (signal == SIGFPE) scope->kind = FaultKind::DIVISION;
+		else if (address >= scope->memoryStart - scope->guardBytes && address < scope->memoryStart) scope->kind = FaultKind::STACK_OVERFLOW;
+		else if (address >= scope->memoryEnd && address < scope->memoryEnd + scope->guardBytes) scope->kind = FaultKind::MEMORY_ACCESS;
+		else if (address >= scope->memoryStart && address < scope->memoryEnd) scope->kind = FaultKind::STACK_OVERFLOW; // fiber guard
+		else scope = NULL;
+	}
+	if (scope != NULL) siglongjmp(scope->jump, 1);
+	// not virtual machine fault: previous handler or default action
+	struct sigaction* previous = (signal == SIGFPE) ? &previousFpe : &previousSegv;
+	if (previous->sa_flags & SA_SIGINFO) previous->sa_sigaction(signal, info, context);
+	else if (previous->sa_handler != SIG_DFL && previous->sa_handler != SIG_IGN) previous->sa_handler(signal);
+	else sigaction(signal, previous, NULL);          // fault repeats with default action
+}
+
 //-----------------------------------------------------------------------------
-// Allocates virtual machine RAM in bytes
+// Leaves fault scope of thread while code outside dispatch loop runs (system
+// calls, trap handler): fault there can not jump out holding locks or in the
+// middle of stream output, it is handled as usual process fault
 //-----------------------------------------------------------------------------
-VirtualMachine::VirtualMachine(WORD memorySize) {
-	maxAddress = memorySize / sizeof(WORD);
-	memory = new WORD[maxAddress];
-	memset(memory, 0, maxAddress);
+class OutsideFaultScope {
+public:
+	OutsideFaultScope() { scope = faultScope; faultScope = NULL; };
+	~OutsideFaultScope() { faultScope = scope; };
+private:
+	FaultScope* scope;
+};
+
+static void installFaultHandlers() {
+	call_once(faultHandlersInstalled, [] {
+		struct sigaction action;
+		memset(&action, 0, sizeof(action));
+		action.sa_sigaction = faultHandler;
+		action.sa_flags = SA_SIGINFO | SA_NODEFER;   // handler leaves by siglongjmp
+		sigemptyset(&action.sa_mask);
+		sigaction(SIGSEGV, &action, &previousSegv);
+		sigaction(SIGFPE, &action, &previousFpe);
+		if (previousSegv.sa_handler == SIG_IGN) previousSegv.sa_handler = SIG_DFL;
+		if (previousFpe.sa_handler == SIG_IGN) previousFpe.sa_handler = SIG_DFL;
+	});
+}
+#else
+class OutsideFaultScope {};
+#endif
+
+//-----------------------------------------------------------------------------
+// Reserves virtual machine stack and data RAM in bytes. Memory is reserved
+// address range, pages are committed by system on first touch, so machine
+// resident memory grows with its stacks depth
+//-----------------------------------------------------------------------------
+VirtualMachine::VirtualMachine(size_t memorySize) {
+	code = NULL;
+	input = &cin;
+	output = &cout;
+	verbose = true;
+	status = ExecutionStatus::HALTED;
+	regionsCount = 0;
+	guardedWords = 0;
+	memoryClean = true;
+	countPages = false;
+	fiberStackSize = FIBER_STACK_SIZE;
+	current = 0;
+	fuel = FUEL_UNLIMITED;
+	fuelSlice = 0;
+	interrupted = false;
+	profile = NULL;
+	perf = NULL;
+	retired = 0;
+	callsCount = 0;
+	syscallsCount = 0;
+	maxStackDepth = 0;
+	callDepth = 0;
+	maxCallDepth = 0;
+	metrics = NULL;
+	publishedRetired = 0;
+	publishedCalls = 0;
+	publishedSyscalls = 0;
+	publishedTime = 0;
+	tracer = NULL;
+	trace = NULL;
+	maxAddress = (WORD)(min(memorySize, MAX_MEMORY_SIZE) / sizeof(WORD));
+	fault = FaultKind::NONE;
+	faultAddress = 0;
+	// memory is page aligned mapping, so snapshots can remap it copy-on-write,
+	// PROT_NONE guard pages around memory catch stack overflows
+	size_t pageSize = MappedFile::getPageSize();
+	memoryBytes = ((size_t) maxAddress * sizeof(WORD) + pageSize - 1) / pageSize * pageSize;
+#ifndef _WIN32
+	guardBytes = pageSize;
+	memory = NULL;
+	void* address = mmap(NULL, memoryBytes + 2 * guardBytes, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+	if (address != MAP_FAILED) {
+		memory = (WORD*)((char*) address + guardBytes);
+		if (mprotect(memory, memoryBytes, PROT_READ | PROT_WRITE) != 0) {
+			munmap(address, memoryBytes + 2 * guardBytes);
+			memory = NULL;
+		}
+	}
+	installFaultHandlers();
+#else
+	guardBytes = 0;
+	memory = new WORD[memoryBytes / sizeof(WORD)];
+	memset(memory, 0, memoryBytes);
+#endif
+	if (memory == NULL) throw bad_alloc();
 }
 
 //-----------------------------------------------------------------------------
 // Releases RAM of virtual machine
 //-----------------------------------------------------------------------------
 VirtualMachine::~VirtualMachine() {
+	joinThreads();
+#ifndef _WIN32
+	munmap((char*) memory - guardBytes, memoryBytes + 2 * guardBytes);
+#else
 	delete[] memory;
+#endif
 }
 
 //-----------------------------------------------------------------------------
-// Loads executable image to virtual machine RAM
+// Allocates zeroed shared memory words
 //-----------------------------------------------------------------------------
-bool VirtualMachine::loadImage(ExecutableImage& image) {
-	if (image.getSize() > maxAddress) return false;
-	memcpy(memory, image.getImage(), image.getSize() * sizeof(WORD));
+SharedMemory::SharedMemory(WORD size) {
+	this->size = size;
+	words = new atomic<WORD>[size];
+	for (WORD i = 0; i < size; i++) words[i].store(0, memory_order_relaxed);
+}
+
+SharedMemory::~SharedMemory() {
+	delete[] words;
+}
+
+//-----------------------------------------------------------------------------
+// Loads private code segment copy of executable image. If VM already runs
+// this image (lazy compilation), appends image code starting from address
+//-----------------------------------------------------------------------------
+bool VirtualMachine::loadImage(ExecutableImage& image, WORD from) {
+	if (from < 0) return false;
+	if (from > 0 && segment != NULL) segment->append(image, from);
+	else segment = make_shared<CodeSegment>(image);
+	code = segment->getCode();
 	return true;
 }
 
+//-----------------------------------------------------------------------------
+// Loads code segment shared with other virtual machines
+//-----------------------------------------------------------------------------
+bool VirtualMachine::loadCode(shared_ptr<CodeSegment> segment) {
+	if (segment == NULL || !segment->isValid()) return false;
+	this->segment = segment;
+	code = segment->getCode();
+	return true;
+}
+
+//-----------------------------------------------------------------------------
+// Sets handler called when function stub (OP_TRAP) is executed
+//-----------------------------------------------------------------------------
+void VirtualMachine::setTrapHandler(TrapHandler handler) {
+	trapHandler = handler;
+}
+
+//-----------------------------------------------------------------------------
+// Input queue shared by host and virtual machine
+//-----------------------------------------------------------------------------
+InputQueue::InputQueue() {
+	closed = false;
+}
+
+void InputQueue::push(WORD value) {
+	lock_guard<mutex> guard(lock);
+	values.push_back(value);
+}
+
+void InputQueue::close() {
+	lock_guard<mutex> guard(lock);
+	closed = true;
+}
+
+bool InputQueue::pop(WORD& value) {
+	lock_guard<mutex> guard(lock);
+	if (values.empty()) return false;
+	value = values.front();
+	values.pop_front();
+	return true;
+}
+
+bool InputQueue::isReady() {
+	lock_guard<mutex> guard(lock);
+	return closed || !values.empty();
+}
+
+//-----------------------------------------------------------------------------
+// Sets streams used by system calls (instance local, not owned by VM)
+//-----------------------------------------------------------------------------
+void VirtualMachine::setInput(istream* input) {
+	this->input = (input == NULL) ? &cin : input;
+}
+
+void VirtualMachine::setOutput(ostream* output) {
+	this->output = (output == NULL) ? &cout : output;
+}
+
+//-----------------------------------------------------------------------------
+// Sets host fed input queue, iget parks fiber while queue is empty
+//-----------------------------------------------------------------------------
+void VirtualMachine::setInputQueue(shared_ptr<InputQueue> queue) {
+	inputQueue = queue;
+}
+
 //----------------------------------------------------------------------------
-// Starts execution from address [0x0000]
+// Starts execution from address [0x0000] as main fiber
 //----------------------------------------------------------------------------
-void VirtualMachine::execute() {
+ExecutionStatus VirtualMachine::execute() {
 
-	cout << "-----------------------------------------------------" << endl;
-	cout << "Virtual machine runtime" << endl;
-	cout << "-----------------------------------------------------" << endl;
+	if (verbose) {
+		*output << "-----------------------------------------------------" << endl;
+		*output << "Virtual machine runtime" << endl;
+		*output << "-----------------------------------------------------" << endl;
+	}
+
+	if (code == NULL) {
+		*output << "Runtime error - no code loaded" << endl;
+		return status = ExecutionStatus::ERROR;
+	}
+
+	Fiber main;
+	main.stackTop = maxAddress; // Main fiber stack is at the top of memory
+	main.state = FiberState::RUNNING;
+	main.ip = 0;                // Set Instruction pointer to 0
+	main.sp = maxAddress;       // Set Stack pointer to highest address
+	main.fp = main.sp;          // Set Frame pointer to Stack pointer
+	main.lp = main.sp - 1;      // Set Locals pointer to Stack pointer - 1
+#ifdef CVM_TRACING
+	if (trace != NULL) trace->restart();
+#endif
+	return start(main);
+}
+
+//----------------------------------------------------------------------------
+// Runs function(argument) as main fiber, function returns to OP_HALT
+//----------------------------------------------------------------------------
+ExecutionStatus VirtualMachine::call(WORD address, WORD argument) {
+	if (code == NULL || address <= HALT_ADDRESS || address >= segment->getSize()) {
+		*output << "Runtime error - invalid function address " << address << endl;
+		return status = ExecutionStatus::ERROR;
+	}
+	Fiber main = makeFiber(address, argument, maxAddress, -1);
+	main.state = FiberState::RUNNING;
+#ifdef CVM_TRACING
+	if (trace != NULL) {
+		trace->restart();
+		trace->record(TraceEventType::CALL, address, 0);
+	}
+#endif
+	return start(main);
+}
+
+//----------------------------------------------------------------------------
+// Clears state left by previous run, so reused machine runs next program as
+// new machine: threads are joined, shared memory and threads input/output
+// lock (created by first spawned thread) are dropped, channels detached
+// and memory is replaced with zero pages
+//----------------------------------------------------------------------------
+void VirtualMachine::reset() {
+	joinThreads();
+	shared = NULL;
+	ioLock = NULL;
+	channels.clear();
+	fibers.clear();
+	runQueue.clear();
+	inputWaiters.clear();
+	freeRegions.clear();
+	unguardRegions();
+	regionsCount = 0;
+	status = ExecutionStatus::HALTED;
+#ifndef _WIN32
+	// remapping also drops pages mapped from checkpoint file by snapshots
+	void* address = mmap(memory, memoryBytes, PROT_READ | PROT_WRITE, 
+		MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE | MAP_FIXED, -1, 0);
+	if (address == MAP_FAILED) memset(memory, 0, memoryBytes);
+	else memoryClean = true;
+#else
+	memset(memory, 0, memoryBytes);
+#endif
+}
+
+//----------------------------------------------------------------------------
+// Resets fibers and threads, main fiber owns stack at the top of memory
+//----------------------------------------------------------------------------
+ExecutionStatus VirtualMachine::start(Fiber& main) {
+	joinThreads();
+	fibers.clear();
+	runQueue.clear();
+	inputWaiters.clear();
+	freeRegions.clear();
+	unguardRegions();
+	regionsCount = 0;
+	fibers.push_back(main);
+	current = 0;
+	maxStackDepth = 0;
+	countPages = memoryClean;
+	memoryClean = false;
+	callDepth = (main.ip == 0) ? 0 : 1;  // entry point calls main, call() frame is made
+	maxCallDepth = tracksCalls() ? callDepth : 0;
+	ip = main.ip;
+	sp = main.sp;
+	fp = main.fp;
+	lp = main.lp;
+	return run();
+}
+
+//----------------------------------------------------------------------------
+// Sets budget of backward jumps and calls for following runs (-1 unlimited),
+// exhausted machine returns EXHAUSTED and continues on resume
+//----------------------------------------------------------------------------
+void VirtualMachine::setFuel(int64_t fuel) {
+	this->fuel = fuel < 0 ? FUEL_UNLIMITED : fuel;
+	fuelSlice = 0;
+}
+
+//----------------------------------------------------------------------------
+// Called when fuel slice is spent (after jump or call is done, so machine
+// resumes at the next instruction). Samples stack depth and checks interrupt
+// flag once per slice and takes next slice from fuel budget
+//----------------------------------------------------------------------------
+bool VirtualMachine::refuel() {
+	fuelSlice = 0;
+	sampleStack();
+	if (metrics != NULL) publishMetrics();
+	if (interrupted.exchange(false, memory_order_relaxed)) {
+		status = ExecutionStatus::INTERRUPTED;
+		return false;
+	}
+	if (fuel == 0) {
+		status = ExecutionStatus::EXHAUSTED;
+		return false;
+	}
+	int64_t slice = FUEL_SLICE;
+	if (fuel > 0) {
+		if (slice > fuel) slice = fuel;
+		fuel -= slice;
+	}
+	fuelSlice = (WORD) slice - 1;          // current charge
+	return true;
+}
+
+//----------------------------------------------------------------------------
+// Resumes paused execution or execution if input arrived for parked fibers
+//----------------------------------------------------------------------------
+ExecutionStatus VirtualMachine::resume() {
+	if (status == ExecutionStatus::PAUSED || status == ExecutionStatus::EXHAUSTED ||
+		status == ExecutionStatus::INTERRUPTED) return run();
+	if (status != ExecutionStatus::WAITING) return status;
+	if (!switchFiber()) return status;
+	return run();
+}
+
+//----------------------------------------------------------------------------
+// Attaches call tracer, machine records events to its own buffer (dispatch
+// loop records events only if built with CVM_TRACING)
+//----------------------------------------------------------------------------
+void VirtualMachine::setTracer(Tracer* tracer) {
+	this->tracer = tracer;
+	trace = (tracer != NULL) ? tracer->createBuffer() : NULL;
+}
+
+//----------------------------------------------------------------------------
+// Returns memory size in bytes for stacks of last run: deepest stack (at
+// calls, sampled or touched pages) plus deepest function frame (compiler
+// stack usage of image) and
+// fiber stack regions (lower half of memory), with MEMORY_HEADROOM and
+// rounded up to pages
+//----------------------------------------------------------------------------
+size_t VirtualMachine::recommendMemorySize(WORD frameWords) {
+	size_t regions = (size_t) regionsCount * getRegionWords();
+	size_t stack = (size_t) maxStackDepth + frameWords;
+	size_t words = max(regions * 2, regions + stack);
+	words += words / MEMORY_HEADROOM;
+	size_t pageSize = MappedFile::getPageSize();
+	size_t bytes = (words * sizeof(WORD) + pageSize - 1) / pageSize * pageSize;
+	return min(max(bytes, pageSize), MAX_MEMORY_SIZE);
+}
+
+//----------------------------------------------------------------------------
+// Raises maximum stack depth to stack depth of running fiber. Plain dispatch
+// loop samples depth only per fuel slice, system call and run end (deepest
+// stack between samples is bounded by touched pages), profiling and
+// counting variants at calls
+//----------------------------------------------------------------------------
+void VirtualMachine::sampleStack() {
+	WORD top = fibers.empty() ? maxAddress : fibers[current].stackTop;
+	if (top - sp > maxStackDepth) maxStackDepth = top - sp;
+}
+
+//----------------------------------------------------------------------------
+// Returns main stack depth in words known from memory pages touched below
+// top of memory (page granular lower bound, covers stack missed between
+// samples). Anonymous memory pages become resident on first touch, so it is
+// used once run halts, if memory was not touched by earlier runs
+//----------------------------------------------------------------------------
+WORD VirtualMachine::getTouchedStackDepth() {
+#ifdef __linux__
+	size_t pageSize = MappedFile::getPageSize();
+	size_t pages = memoryBytes / pageSize / 2;           // main stack uses upper half
+	if (pages == 0) return 0;
+	vector<unsigned char> resident(pages);
+	if (mincore((char*) memory + memoryBytes - pages * pageSize, pages * pageSize, resident.data()) != 0) return 0;
+	size_t touched = 0;
+	while (touched < pages && (resident[pages - 1 - touched] & 1)) touched++;
+	// deepest stack word is somewhere in the lowest touched page
+	WORD bottom = (WORD) ((memoryBytes - touched * pageSize + pageSize) / sizeof(WORD));
+	return max(maxAddress - bottom, 0);
+#else
+	return 0;
+#endif
+}
+
+//----------------------------------------------------------------------------
+// Attaches live metrics block, only counters increments after attaching
+// are published
+//----------------------------------------------------------------------------
+void VirtualMachine::setMetrics(Metrics* metrics) {
+	this->metrics = metrics;
+	publishedRetired = retired;
+	publishedCalls = callsCount;
+	publishedSyscalls = syscallsCount;
+}
+
+//----------------------------------------------------------------------------
+// Adds counters and running time increments since last publish to metrics
+// block (relaxed atomics, block may be shared by machines running on other
+// threads), stores current stack depth and raises maximum stack depth
+//----------------------------------------------------------------------------
+void VirtualMachine::publishMetrics() {
+	int64_t now = chrono::duration_cast<chrono::nanoseconds>(chrono::steady_clock::now().time_since_epoch()).count();
+	WORD top = fibers.empty() ? maxAddress : fibers[current].stackTop;
+	sampleStack();
+	metrics->instructions.fetch_add(retired - publishedRetired, memory_order_relaxed);
+	metrics->calls.fetch_add(callsCount - publishedCalls, memory_order_relaxed);
+	metrics->syscalls.fetch_add(syscallsCount - publishedSyscalls, memory_order_relaxed);
+	metrics->nanoseconds.fetch_add(now - publishedTime, memory_order_relaxed);
+	metrics->stackDepth.store(top - sp, memory_order_relaxed);
+	int64_t deepest = metrics->maxStackDepth.load(memory_order_relaxed);
+	while (maxStackDepth > deepest && !metrics->maxStackDepth.compare_exchange_weak(deepest, maxStackDepth, memory_order_relaxed));
+	publishedRetired = retired;
+	publishedCalls = callsCount;
+	publishedSyscalls = syscallsCount;
+	publishedTime = now;
+}
+
+//----------------------------------------------------------------------------
+// Runs dispatch loop with hardware faults trapped (setjmp is kept out of
+// dispatch loop, so its registers allocation is not affected). Attached
+// performance counters are enabled while dispatch loop runs, attached
+// metrics count machine as running
+//----------------------------------------------------------------------------
+ExecutionStatus VirtualMachine::run() {
+	ExecutionStatus result;
+	uint64_t retiredBefore = retired;
+	fault = FaultKind::NONE;
+	if (metrics != NULL) {
+		publishedTime = chrono::duration_cast<chrono::nanoseconds>(chrono::steady_clock::now().time_since_epoch()).count();
+		metrics->running.fetch_add(1, memory_order_relaxed);
+	}
+	if (perf != NULL) perf->start();
+#ifndef _WIN32
+	FaultScope scope;
+	scope.memoryStart = (char*) memory;
+	scope.memoryEnd = (char*) memory + memoryBytes;
+	scope.guardBytes = guardBytes;
+	scope.kind = FaultKind::NONE;
+	scope.previous = faultScope;
+	if (sigsetjmp(scope.jump, 0) != 0) {
+		faultScope = scope.previous;
+		result = trapFault(scope.kind);
+	} else {
+		faultScope = &scope;
+		result = dispatchVariant();
+		faultScope = scope.previous;
+	}
+#else
+	result = dispatchVariant();
+#endif
+	if (fault == FaultKind::NONE) sampleStack();  // faulted stack pointer may be out of memory
+	if (status == ExecutionStatus::HALTED && countPages) maxStackDepth = max(maxStackDepth, getTouchedStackDepth());
+	if (perf != NULL) perf->stop(retired - retiredBefore);
+	if (metrics != NULL) {
+		publishMetrics();
+		metrics->running.fetch_sub(1, memory_order_relaxed);
+	}
+	return result;
+}
+
+//----------------------------------------------------------------------------
+// Runs dispatch loop instance: plain, profiling and / or counting
+//----------------------------------------------------------------------------
+ExecutionStatus VirtualMachine::dispatchVariant() {
+	bool counting = (perf != NULL || metrics != NULL);
+	if (profile != NULL) return counting ? dispatch<true, true>() : dispatch<true, false>();
+	return counting ? dispatch<false, true>() : dispatch<false, false>();
+}
+
+//----------------------------------------------------------------------------
+// Stops machine on hardware fault (stack state is not printed, stack
+// pointer may be out of memory). Instruction pointer is written back before
+// faulting memory access or division (memory words may alias registers), it
+// points after opcode or its read operands, so fault address is address of
+// the last instruction starting before it
+//----------------------------------------------------------------------------
+ExecutionStatus VirtualMachine::trapFault(FaultKind kind) {
+	fault = kind;
+	faultAddress = findInstruction(ip - 1);
+	ip = faultAddress;
+	*output << "Runtime error - ";
+	if (kind == FaultKind::STACK_OVERFLOW) *output << "stack overflow";
+	else if (kind == FaultKind::MEMORY_ACCESS) *output << "memory access out of range";
+	else *output << "division by zero or overflow";
+	*output << " at [" << faultAddress << "]" << endl;
+	return status = ExecutionStatus::ERROR;
+}
+
+//----------------------------------------------------------------------------
+// Returns address of instruction containing code address (instructions are
+// decoded from the code start, used on faults only)
+//----------------------------------------------------------------------------
+WORD VirtualMachine::findInstruction(WORD address) {
+	WORD size = segment->getSize();
+	WORD instruction = 0;
+	WORD next = 0;
+	while (next <= address && next < size) {
+		instruction = next;
+		switch (code[next]) {
+		case OP_CALL:
+			next += 3;
+			break;
+		case OP_CONST: case OP_PUSH: case OP_POP: case OP_JMP: case OP_IFZERO:
+		case OP_SYSCALL: case OP_TRAP: case OP_LOAD: case OP_STORE: case OP_ARG:
+			next += 2;
+			break;
+		default:
+			next++;
+		}
+	}
+	return instruction;
+}
+
+//----------------------------------------------------------------------------
+// Runs current fiber until main fiber halts or no fiber is ready (profiling
+// variant counts instructions and conditional jumps outcomes, counting
+// variant counts retired instructions, calls, system calls and stack depth
+// for performance counters and metrics, both track deepest stack and live
+// calls at every call)
+//----------------------------------------------------------------------------
+template <bool profiling, bool counting>
+ExecutionStatus VirtualMachine::dispatch() {
 
 	WORD a = 0;				    // temporary variables
 	WORD b = 0;                 // temporary variables
-
-	ip = 0;                     // Set Instruction pointer to 0
-	sp = maxAddress;            // Set Stack pointer to highest address
-	fp = sp;                    // Set Frame pointer to Stack pointer
-	lp = sp - 1;                // Set Locals pointer to Stack pointer - 1
+	WORD ptr = 0;               // temporary variables
 
 fetch: 
 
 	//printState();
+	if (profiling) profile->count(ip, code[ip]);
+	if (counting) retired++;
 
-	switch (memory[ip++]) {
+	switch (code[ip++]) {
 		//------------------------------------------------------------------------
 		// STACK OPERATIONS
 		//------------------------------------------------------------------------
 		case OP_CONST: 
-			memory[--sp] = memory[ip++]; 
+			memory[--sp] = code[ip++]; 
 			goto fetch;
 		case OP_PUSH:
-			a = memory[ip++];
+			a = code[ip++];
 			memory[--sp] = memory[a];
 			goto fetch;
 		case OP_POP:  
-			a = memory[ip++];
+			a = code[ip++];
 			memory[a] = memory[sp++]; 
 			break;
+		case OP_DROP:
+			sp++;
+			goto fetch;
 		//------------------------------------------------------------------------
 		// ARITHMETIC OPERATIONS
 		//------------------------------------------------------------------------
@@ -134,11 +695,17 @@ fetch:
 		// FLOW CONTROL OPERATIONS (Relative jumps depending on top of the stack)
 		//------------------------------------------------------------------------
 		case OP_JMP:
-			ip += memory[ip];
+			a = code[ip];
+			ip += a;
+			if (a < 0 && --fuelSlice < 0 && !refuel()) return status; // backward jump costs fuel
 			goto fetch;
 		case OP_IFZERO:
 			a = memory[sp++];
-			if (a == 0) ip += memory[ip]; else ip++;
+			if (profiling) profile->branch(ip - 1, a == 0);
+			if (a != 0) { ip++; goto fetch; }
+			a = code[ip];
+			ip += a;
+			if (a < 0 && --fuelSlice < 0 && !refuel()) return status;
 			goto fetch;
 		//------------------------------------------------------------------------
 		// LOGICAL (BOOLEAN) OPERATIONS
@@ -191,8 +758,8 @@ fetch:
 		// PROCEDURE CALL OPERATIONS
 		//------------------------------------------------------------------------
 		case OP_CALL:
-			a = memory[ip++];      // get call address and increment address
-			b = memory[ip++];      // get arguments count (argc)
+			a = code[ip++];      // get call address and increment address
+			b = code[ip++];      // get arguments count (argc)
 			b = sp + b;            // calculate new frame pointer
 			memory[--sp] = ip;     // push return address to the stack
 			memory[--sp] = fp;     // push old Frame pointer to stack
@@ -200,6 +767,15 @@ fetch:
 			fp = b;                // set Frame pointer to arguments pointer
 			lp = sp - 1;           // set Local variables pointer after top of a stack
 			ip = a;                // jump to call address
+			if (profiling || counting) {
+				if (fibers[current].stackTop - sp > maxStackDepth) maxStackDepth = fibers[current].stackTop - sp;
+				if (++callDepth > maxCallDepth) maxCallDepth = callDepth;
+			}
+			if (counting) callsCount++;
+#ifdef CVM_TRACING
+			if (trace != NULL) trace->record(TraceEventType::CALL, a, current);
+#endif
+			if (--fuelSlice < 0 && !refuel()) return status; // call costs fuel
 			goto fetch;
 		case OP_RET:
 			a = memory[sp++];      // read function return value on top of a stack
@@ -209,36 +785,103 @@ fetch:
 			fp = memory[b + 2];    // restore old Frame pointer
 			ip = memory[b + 3];    // set IP to return address
 			memory[--sp] = a;      // save return value on top of a stack
+			if (profiling || counting) callDepth--;
+#ifdef CVM_TRACING
+			if (trace != NULL) trace->record(TraceEventType::RETURN, 0, current);
+#endif
 			goto fetch;
 		case OP_SYSCALL:
-			a = memory[ip++];      // read system call index from top of the stack
-			sysCall(a);         // make system call by index
+			a = code[ip++];      // read system call index from top of the stack
+			if (counting) syscallsCount++;
+#ifdef CVM_TRACING
+			if (trace != NULL) {
+				ptr = current;       // system call may switch fiber
+				trace->record(TraceEventType::SYSCALL_BEGIN, a, ptr);
+				b = sysCall(a);
+				trace->record(TraceEventType::SYSCALL_END, a, ptr);
+				if (!b) return status;
+				goto fetch;
+			}
+#endif
+			if (!sysCall(a)) return status; // make system call by index
+			goto fetch;
+		case OP_TRAP:
+			a = code[ip++];      // read function stub index
+			{
+				OutsideFaultScope outside;
+				b = trapHandler ? trapHandler(a) : -1;  // compile function, get its address
+			}
+			if (b < 0) {
+				*output << "Runtime error - unresolved function stub at [" << ip - 2 << "]" << endl;
+				printState();
+				return status = ExecutionStatus::ERROR;
+			}
+			code = segment->getCode();             // code could be reallocated by handler
+			segment->writeWord(ip - 2, OP_JMP);    // patch stub to jump to function
+			segment->writeWord(ip - 1, b - (ip - 1)); // relative to jump operand
+			a = memory[lp + 3] - 3;                // caller's call instruction address
+			if (a >= 0 && code[a] == OP_CALL && code[a + 1] == ip - 2) {
+				segment->writeWord(a + 1, b);      // patch call target to function
+			}
+			ip = b;
 			goto fetch;
 		case OP_HALT: 
-			printState();
-			return;
+			if (current == 0) {    // main fiber halt stops virtual machine
+				if (verbose) printState();
+				return status = ExecutionStatus::HALTED;
+			}
+			if (!finishFiber()) return status; // spawned fiber returned
+			goto fetch;
 		//------------------------------------------------------------------------
 		// LOCAL VARIABLES AND CALL ARGUMENTS OPERATIONS
 		//------------------------------------------------------------------------
 		case OP_LOAD:
-			a = memory[ip++];         // read local variable index
+			a = code[ip++];         // read local variable index
 			b = lp - a;               // calculate local variable address
 			memory[--sp] = memory[b]; // push local variable to stack
 			goto fetch;
 		case OP_STORE:
-			a = memory[ip++];         // read local variable index
+			a = code[ip++];         // read local variable index
 			b = lp - a;               // calculate local variable address
 			memory[b] = memory[sp++]; // pop top of stack to local variable
 			goto fetch;
 		case OP_ARG:
-			a = memory[ip++];         // read parameter index
+			a = code[ip++];         // read parameter index
 			b = fp - a - 1;           // calculate parameter address
 			memory[--sp] = memory[b]; // push parameter to stack
 			goto fetch;
+		//------------------------------------------------------------------------
+		// SHARED MEMORY ATOMIC OPERATIONS
+		//------------------------------------------------------------------------
+		case OP_AFADD:
+			b = memory[sp++];                     // addend
+			a = memory[sp++];                     // shared memory address
+			if (!checkShared(a)) return status;
+			memory[--sp] = shared->getWords()[a].fetch_add(b);
+			goto fetch;
+		case OP_ACAS:
+			b = memory[sp++];                     // desired value
+			ptr = memory[sp++];                   // expected value
+			a = memory[sp++];                     // shared memory address
+			if (!checkShared(a)) return status;
+			shared->getWords()[a].compare_exchange_strong(ptr, b);
+			memory[--sp] = ptr;                   // old value (equals expected if swapped)
+			goto fetch;
+		case OP_ALOAD:
+			a = memory[sp++];                     // shared memory address
+			if (!checkShared(a)) return status;
+			memory[--sp] = shared->getWords()[a].load(memory_order_acquire);
+			goto fetch;
+		case OP_ASTORE:
+			b = memory[sp++];                     // value
+			a = memory[sp++];                     // shared memory address
+			if (!checkShared(a)) return status;
+			shared->getWords()[a].store(b, memory_order_release);
+			goto fetch;
 		default:
-			cout << "Runtime error - unknown opcode at [" << ip << "]" << endl;
+			*output << "Runtime error - unknown opcode at [" << ip << "]" << endl;
 			printState();
-			return;
+			return status = ExecutionStatus::ERROR;
 	}
 
 	goto fetch;
@@ -246,39 +889,436 @@ fetch:
 }
 
 //----------------------------------------------------------------------------
-// SYSCALL implementation
+// SYSCALL implementation, returns false if dispatch loop has to stop
 //----------------------------------------------------------------------------
-void VirtualMachine::sysCall(WORD n) {
-	WORD ptr, a;
+bool VirtualMachine::sysCall(WORD n) {
+	OutsideFaultScope outside;
+	unique_lock<mutex> guard;
+	WORD ptr, a, b;
+	sampleStack();                          // system call may switch fiber
+	if (sp <= 0) {                          // result push would hit guard page outside fault scope
+		*output << "Runtime error - stack overflow at [" << ip - 2 << "]" << endl;
+		fault = FaultKind::STACK_OVERFLOW;
+		faultAddress = ip - 2;
+		status = ExecutionStatus::ERROR;
+		return false;
+	}
 	switch (n) {
-	case 0x20:  // print C style string
+	case SYS_PRINT_STRING:  // print C style string
 		ptr = memory[sp++];
-		cout << ((char*)&memory[ptr]);
-		return;
-	case 0x21:  // print int from TOS
+		if (ioLock != NULL) guard = unique_lock<mutex>(*ioLock);
+		*output << ((char*)&memory[ptr]);
+		return true;
+	case SYS_PRINT_INT:     // print int from TOS
 		a = memory[sp++];
-		cout << a << endl;
-		return;
-	case 0x22:
-		cin >> a;
+		if (ioLock != NULL) guard = unique_lock<mutex>(*ioLock);
+		*output << a << '\n';                  // output stream decides when to flush
+		return true;
+	case SYS_READ_INT:      // read int from input to TOS
+		if (inputQueue != NULL) return readInput();
+		a = 0;
+		if (ioLock != NULL) guard = unique_lock<mutex>(*ioLock);
+		output->flush();                        // prompt is shown before input is read
+		*input >> a;
 		memory[--sp] = a;
-		return;
+		return true;
+	case SYS_FIBER_SPAWN:   // spawn fiber calling function(argument), push fiber id
+		b = memory[sp++];
+		a = memory[sp++];
+		memory[--sp] = spawnFiber(a, b);
+		return true;
+	case SYS_FIBER_YIELD:   // let other ready fibers run
+		if (runQueue.empty()) return true;
+		saveFiber();
+		fibers[current].state = FiberState::READY;
+		runQueue.push_back(current);
+		return switchFiber();
+	case SYS_FIBER_JOIN:    // wait for fiber completion, push its result
+		a = memory[sp++];
+		return joinFiber(a);
+	case SYS_THREAD_SPAWN:  // run function(argument) on new thread, push thread id
+		b = memory[sp++];
+		a = memory[sp++];
+		memory[--sp] = spawnThread(a, b);
+		return true;
+	case SYS_THREAD_JOIN:   // wait for thread completion, push its result
+		a = memory[sp++];
+		memory[--sp] = joinThread(a);
+		return true;
+	case SYS_CHECKPOINT:    // pause machine, so host can snapshot it, push 0
+		memory[--sp] = 0;
+		if (ioLock != NULL) return true;      // threads family can not be snapshotted
+		status = ExecutionStatus::PAUSED;
+		return false;
+	case SYS_CHANNEL_SEND:
+	case SYS_CHANNEL_RECV:
+	case SYS_CHANNEL_SEND_BLOCK:
+	case SYS_CHANNEL_RECV_BLOCK:
+	case SYS_CHANNEL_CLOSE:
+		return channelCall(n);
+	}
+	return true;
+}
+
+//----------------------------------------------------------------------------
+// Creates fiber with stack region at the bottom of memory and frame calling
+// function, which returns to OP_HALT. Returns fiber id or -1
+//----------------------------------------------------------------------------
+WORD VirtualMachine::spawnFiber(WORD address, WORD argument) {
+	if (address <= HALT_ADDRESS || address >= segment->getSize()) return -1;
+	WORD region;
+	if (!freeRegions.empty()) {
+		region = freeRegions.back();
+		freeRegions.pop_back();
+	} else {
+		// regions use lower half of memory, main fiber stack the upper half
+		if ((regionsCount + 1) * getRegionWords() > maxAddress / 2) return -1;
+		region = regionsCount++;
+		guardRegion(region);
+	}
+	Fiber fiber = makeFiber(address, argument, (region + 1) * getRegionWords(), region);
+	fibers.push_back(fiber);
+	WORD id = (WORD) fibers.size() - 1;
+	runQueue.push_back(id);
+	if (tracksCalls()) callDepth++;              // fiber function returns with OP_RET
+#ifdef CVM_TRACING
+	if (trace != NULL) trace->record(TraceEventType::CALL, address, id);
+#endif
+	return id;
+}
+
+//----------------------------------------------------------------------------
+// Returns fiber stack region size in words: fiber stack rounded up to pages
+// and guard page below it, so overflowing fiber stack faults instead of
+// overwriting stack of neighbour fiber
+//----------------------------------------------------------------------------
+WORD VirtualMachine::getRegionWords() {
+#ifndef _WIN32
+	WORD pageWords = (WORD) (MappedFile::getPageSize() / sizeof(WORD));
+	return (fiberStackSize + pageWords - 1) / pageWords * pageWords + pageWords;
+#else
+	return fiberStackSize;
+#endif
+}
+
+//----------------------------------------------------------------------------
+// Makes the lowest page of stack region inaccessible
+//----------------------------------------------------------------------------
+void VirtualMachine::guardRegion(WORD region) {
+#ifndef _WIN32
+	WORD regionWords = getRegionWords();
+	mprotect(memory + (size_t) region * regionWords, MappedFile::getPageSize(), PROT_NONE);
+	guardedWords = max(guardedWords, (region + 1) * regionWords);
+#endif
+}
+
+//----------------------------------------------------------------------------
+// Makes guard pages of stack regions accessible again (regions are released)
+//----------------------------------------------------------------------------
+void VirtualMachine::unguardRegions() {
+#ifndef _WIN32
+	if (guardedWords > 0) mprotect(memory, (size_t) guardedWords * sizeof(WORD), PROT_READ | PROT_WRITE);
+#endif
+	guardedWords = 0;
+}
+
+//----------------------------------------------------------------------------
+// Runs function(argument) on child virtual machine thread sharing code,
+// shared memory and input/output. Returns thread id or -1
+//----------------------------------------------------------------------------
+WORD VirtualMachine::spawnThread(WORD address, WORD argument) {
+	if (trapHandler) {
+		*output << "Runtime error - threads require fully compiled code" << endl;
+		return -1;
+	}
+	if (address <= HALT_ADDRESS || address >= segment->getSize()) return -1;
+	if (shared == NULL) shared = make_shared<SharedMemory>();
+	if (ioLock == NULL) ioLock = make_shared<mutex>();
+	VirtualMachine* child = new VirtualMachine(maxAddress * sizeof(WORD));
+	child->setVerbose(false);
+	child->loadCode(segment);
+	child->shared = shared;
+	child->ioLock = ioLock;
+	child->input = input;
+	child->output = output;
+	child->inputQueue = inputQueue;
+	child->fiberStackSize = fiberStackSize;
+	child->channels = channels;
+	if (tracer != NULL) child->setTracer(tracer);
+	if (metrics != NULL) child->setMetrics(metrics);
+	children.push_back(child);
+	threads.emplace_back([child, address, argument] { child->call(address, argument); });
+	return (WORD) children.size() - 1;
+}
+
+//----------------------------------------------------------------------------
+// Waits for thread, returns its function result or -1
+//----------------------------------------------------------------------------
+WORD VirtualMachine::joinThread(WORD id) {
+	if (id < 0 || id >= (WORD) children.size() || children[id] == NULL) return -1;
+	threads[id].join();
+	VirtualMachine* child = children[id];
+	WORD result = (child->status == ExecutionStatus::HALTED) ? child->getResult() : -1;
+	// child machine has the same memory size, its deepest stack counts too
+	maxStackDepth = max(maxStackDepth, child->maxStackDepth);
+	maxCallDepth = max(maxCallDepth, child->maxCallDepth);
+	delete child;
+	children[id] = NULL;
+	return result;
+}
+
+//----------------------------------------------------------------------------
+// Waits for all not joined threads
+//----------------------------------------------------------------------------
+void VirtualMachine::joinThreads() {
+	for (size_t i = 0; i < children.size(); i++) joinThread((WORD) i);
+	threads.clear();
+	children.clear();
+}
+
+//----------------------------------------------------------------------------
+// Attaches channel, scripts refer channels by index in attach order
+//----------------------------------------------------------------------------
+WORD VirtualMachine::attachChannel(shared_ptr<Channel> channel) {
+	channels.push_back(channel);
+	return (WORD) channels.size() - 1;
+}
+
+//----------------------------------------------------------------------------
+// Channel system call: channel index is the first argument. If channel is
+// full (send) or empty (receive) other ready fibers run and system call is
+// retried, without ready fibers the thread waits spinning then yielding
+//----------------------------------------------------------------------------
+bool VirtualMachine::channelCall(WORD n) {
+	WORD argc = 1;
+	if (n == SYS_CHANNEL_SEND) argc = 2;
+	if (n == SYS_CHANNEL_SEND_BLOCK || n == SYS_CHANNEL_RECV_BLOCK) argc = 3;
+	WORD index = memory[sp + argc - 1];
+	WORD result = -1;
+	if (index >= 0 && index < (WORD) channels.size()) {
+		Channel* channel = channels[index].get();
+		for (unsigned spins = 0; !tryChannelCall(n, channel, result); spins++) {
+			if (!runQueue.empty()) {
+				ip -= 2;                       // retry system call when fiber resumes
+				saveFiber();
+				fibers[current].state = FiberState::READY;
+				runQueue.push_back(current);
+				return switchFiber();
+			}
+			if (interrupted.exchange(false, memory_order_relaxed)) {
+				ip -= 2;                       // retry system call on resume
+				status = ExecutionStatus::INTERRUPTED;
+				return false;
+			}
+			if (spins > 64) this_thread::yield();
+		}
+	}
+	sp += argc;
+	if (n != SYS_CHANNEL_CLOSE) memory[--sp] = result;
+	return true;
+}
+
+//----------------------------------------------------------------------------
+// Makes channel system call without blocking, returns false if it has to
+// wait. Blocks are transferred from/to shared memory words
+//----------------------------------------------------------------------------
+bool VirtualMachine::tryChannelCall(WORD n, Channel* channel, WORD& result) {
+	constexpr WORD CHUNK = 256;
+	WORD chunk[CHUNK];
+	WORD value, address, count, done, size;
+	atomic<WORD>* words;
+	switch (n) {
+	case SYS_CHANNEL_SEND:           // csend(channel, value): 1 - sent, 0 - closed
+		value = memory[sp];
+		if (channel->send(&value, 1) == 1) result = 1;
+		else if (channel->isClosed()) result = 0;
+		else return false;
+		return true;
+	case SYS_CHANNEL_RECV:           // crecv(channel): value, 0 - closed and empty
+		if (channel->receive(&value, 1) == 1) result = value;
+		else if (!channel->isClosed()) return false;
+		else result = (channel->receive(&value, 1) == 1) ? value : 0;
+		return true;
+	case SYS_CHANNEL_SEND_BLOCK:     // csendb(channel, address, count): words sent
+	case SYS_CHANNEL_RECV_BLOCK:     // crecvb(channel, address, count): words received
+		count = memory[sp];
+		address = memory[sp + 1];
+		if (shared == NULL) shared = make_shared<SharedMemory>();
+		if (address < 0 || count < 0 || address > shared->getSize() - count) {
+			result = -1;
+			return true;
+		}
+		words = shared->getWords() + address;
+		result = 0;
+		while (result < count) {
+			size = min(CHUNK, count - result);
+			if (n == SYS_CHANNEL_SEND_BLOCK) {
+				for (WORD i = 0; i < size; i++) chunk[i] = words[result + i].load(memory_order_relaxed);
+				done = channel->send(chunk, size);
+			} else {
+				done = channel->receive(chunk, size);
+				if (done == 0 && result == 0 && channel->isClosed()) done = channel->receive(chunk, size);
+				for (WORD i = 0; i < done; i++) words[result + i].store(chunk[i], memory_order_relaxed);
+			}
+			result += done;
+			if (done < size) break;
+		}
+		return result > 0 || count == 0 || channel->isClosed();
+	case SYS_CHANNEL_CLOSE:          // cclose(channel)
+		channel->close();
+		return true;
+	}
+	return true;
+}
+
+//----------------------------------------------------------------------------
+// Validates shared memory address (allocates default shared memory)
+//----------------------------------------------------------------------------
+bool VirtualMachine::checkShared(WORD address) {
+	if (shared == NULL) shared = make_shared<SharedMemory>();
+	if (address >= 0 && address < shared->getSize()) return true;
+	*output << "Runtime error - shared memory address " << address << " out of range" << endl;
+	printState();
+	status = ExecutionStatus::ERROR;
+	return false;
+}
+
+//----------------------------------------------------------------------------
+// Makes fiber with frame calling function(argument) and returning to OP_HALT
+//----------------------------------------------------------------------------
+Fiber VirtualMachine::makeFiber(WORD address, WORD argument, WORD top, WORD region) {
+	Fiber fiber;
+	fiber.stackTop = top;
+	fiber.region = region;
+	memory[top - 1] = argument;          // argument
+	memory[top - 2] = HALT_ADDRESS;      // return address
+	memory[top - 3] = top;               // old frame pointer
+	memory[top - 4] = top - 1;           // old locals pointer
+	fiber.ip = address;
+	fiber.fp = top;
+	fiber.sp = top - 4;
+	fiber.lp = fiber.sp - 1;
+	return fiber;
+}
+
+//----------------------------------------------------------------------------
+// Completes running fiber: keeps result, releases stack and wakes joiners
+//----------------------------------------------------------------------------
+bool VirtualMachine::finishFiber() {
+	Fiber& fiber = fibers[current];
+	fiber.result = memory[sp];
+	fiber.state = FiberState::DONE;
+	freeRegions.push_back(fiber.region);
+	for (WORD id : fiber.joiners) {
+		Fiber& joiner = fibers[id];
+		memory[--joiner.sp] = fiber.result;
+		joiner.state = FiberState::READY;
+		runQueue.push_back(id);
+	}
+	fiber.joiners.clear();
+	return switchFiber();
+}
+
+//----------------------------------------------------------------------------
+// Pushes fiber result or parks running fiber until fiber completes
+//----------------------------------------------------------------------------
+bool VirtualMachine::joinFiber(WORD id) {
+	if (id <= 0 || id >= (WORD) fibers.size() || id == current) {
+		memory[--sp] = -1;
+		return true;
+	}
+	if (fibers[id].state == FiberState::DONE) {
+		memory[--sp] = fibers[id].result;
+		return true;
+	}
+	saveFiber();
+	fibers[current].state = FiberState::JOINING;
+	fibers[id].joiners.push_back(current);
+	return switchFiber();
+}
+
+//----------------------------------------------------------------------------
+// Pushes value from input queue or parks running fiber until input arrives
+//----------------------------------------------------------------------------
+bool VirtualMachine::readInput() {
+	WORD value = 0;
+	if (inputWaiters.empty() && inputQueue->isReady()) {
+		if (!inputQueue->pop(value)) value = 0;   // closed queue reads 0
+		memory[--sp] = value;
+		return true;
 	}
+	saveFiber();
+	fibers[current].state = FiberState::WAITING_INPUT;
+	inputWaiters.push_back(current);
+	return switchFiber();
+}
+
+//----------------------------------------------------------------------------
+// Wakes fibers parked on input in arrival order while input is available
+//----------------------------------------------------------------------------
+void VirtualMachine::deliverInput() {
+	WORD value;
+	while (!inputWaiters.empty() && inputQueue != NULL && inputQueue->isReady()) {
+		if (!inputQueue->pop(value)) value = 0;   // closed queue reads 0
+		Fiber& fiber = fibers[inputWaiters.front()];
+		memory[--fiber.sp] = value;
+		fiber.state = FiberState::READY;
+		runQueue.push_back(inputWaiters.front());
+		inputWaiters.pop_front();
+	}
+}
+
+//----------------------------------------------------------------------------
+// Switches to next ready fiber, returns false if there is no one
+//----------------------------------------------------------------------------
+bool VirtualMachine::switchFiber() {
+	deliverInput();
+	if (runQueue.empty()) {
+		if (!inputWaiters.empty()) {
+			status = ExecutionStatus::WAITING;
+			return false;
+		}
+		*output << "Runtime error - all fibers are blocked" << endl;
+		printState();
+		status = ExecutionStatus::ERROR;
+		return false;
+	}
+	current = runQueue.front();
+	runQueue.pop_front();
+	Fiber& fiber = fibers[current];
+	fiber.state = FiberState::RUNNING;
+	ip = fiber.ip;
+	sp = fiber.sp;
+	fp = fiber.fp;
+	lp = fiber.lp;
+	return true;
+}
+
+//----------------------------------------------------------------------------
+// Saves registers of running fiber
+//----------------------------------------------------------------------------
+void VirtualMachine::saveFiber() {
+	Fiber& fiber = fibers[current];
+	fiber.ip = ip;
+	fiber.sp = sp;
+	fiber.fp = fp;
+	fiber.lp = lp;
 }
 
 //----------------------------------------------------------------------------
-// Prints IP, SP, FP, LP and STACK to standard out
+// Prints IP, SP, FP, LP and STACK to output stream
 //----------------------------------------------------------------------------
 void VirtualMachine::printState() {
-	cout << "VM:";
-	cout << " IP=" << ip;
-	cout << " FP=" << fp;
-	cout << " LP=" << lp;
-	cout << " SP=" << sp;
-	cout << " STACK=[";
-	for (WORD i = maxAddress - 1; i >= sp; i--) {
-		cout << memory[i];
-		if (i > sp) cout << ",";
+	*output << "VM:";
+	*output << " IP=" << ip;
+	*output << " FP=" << fp;
+	*output << " LP=" << lp;
+	*output << " SP=" << sp;
+	*output << " STACK=[";
+	WORD top = fibers.empty() ? maxAddress : fibers[current].stackTop;
+	for (WORD i = top - 1; i >= sp; i--) {
+		*output << memory[i];
+		if (i > sp) *output << ",";
 	}
-	cout << "] -> TOP" << endl;
+	*output << "] -> TOP" << endl;
 }